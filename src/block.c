@@ -0,0 +1,317 @@
+#include <string.h>
+
+#include "block.h"
+#include "proto.h"
+
+/* The bits must be zeroed */
+static void block_put_bits(block_bits_t *bits, uint64_t value, int n)
+{
+    while (n > 0) {
+        int free_bits = 8 - (bits->pos & 7);
+        int take = n < free_bits ? n : free_bits;
+        uint8_t chunk = (value >> (n - take)) & ((1u << take) - 1);
+
+        bits->data[bits->pos >> 3] |= chunk << (free_bits - take);
+        bits->pos += take;
+        n -= take;
+    }
+}
+
+/* Returns 0 past the end of the bits */
+static uint64_t block_get_bits(block_bits_t *bits, int n)
+{
+    uint64_t value = 0;
+
+    if (bits->pos + n > bits->size) {
+        bits->pos = bits->size + 1;
+        return 0;
+    }
+
+    while (n > 0) {
+        int available = 8 - (bits->pos & 7);
+        int take = n < available ? n : available;
+        uint8_t chunk = (bits->data[bits->pos >> 3] >> (available - take)) & ((1u << take) - 1);
+
+        value = (value << take) | chunk;
+        bits->pos += take;
+        n -= take;
+    }
+
+    return value;
+}
+
+static void block_put_varint(block_bits_t *bits, int64_t value)
+{
+    uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+
+    while (zigzag >= 0x80) {
+        block_put_bits(bits, (zigzag & 0x7F) | 0x80, 8);
+        zigzag >>= 7;
+    }
+    block_put_bits(bits, zigzag, 8);
+}
+
+static int64_t block_get_varint(block_bits_t *bits)
+{
+    uint64_t zigzag = 0;
+    uint64_t byte;
+    int shift = 0;
+
+    do {
+        byte = block_get_bits(bits, 8);
+        zigzag |= (byte & 0x7F) << shift;
+        shift += 7;
+    } while ((byte & 0x80) && shift < 64);
+
+    return (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+}
+
+/* Value of 'n' bits in two's complement */
+static int64_t block_get_signed(block_bits_t *bits, int n)
+{
+    uint64_t value = block_get_bits(bits, n);
+
+    if (value & ((uint64_t)1 << (n - 1)))
+        value |= ~(uint64_t)0 << n;
+
+    return (int64_t)value;
+}
+
+static uint64_t block_double_bits(double value)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static double block_bits_double(uint64_t bits)
+{
+    double value;
+
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+void block_encoder_init(block_encoder_t *encoder, uint8_t type)
+{
+    memset(encoder->data, 0, BLOCK_SIZE);
+    encoder->bits.data = encoder->data;
+    encoder->bits.size = (BLOCK_SIZE - BLOCK_FOOTER_LENGTH) * 8;
+    encoder->bits.pos = 0;
+    encoder->count = 0;
+    encoder->type = type;
+    encoder->first = 0;
+    encoder->last = 0;
+    encoder->delta = 0;
+    encoder->previous = 0;
+    encoder->leading = -1;
+    encoder->trailing = 0;
+    encoder->min = 0;
+    encoder->max = 0;
+}
+
+static void block_encoder_timestamp(block_encoder_t *encoder, int64_t timestamp)
+{
+    block_bits_t *bits = &(encoder->bits);
+    int64_t delta = timestamp - encoder->last;
+    int64_t dod = delta - encoder->delta;
+
+    if (encoder->count == 1) {
+        block_put_varint(bits, delta);
+    } else if (dod == 0) {
+        block_put_bits(bits, 0, 1);
+    } else if (dod >= -64 && dod < 64) {
+        block_put_bits(bits, 2, 2);
+        block_put_bits(bits, (uint64_t)dod, 7);
+    } else if (dod >= -256 && dod < 256) {
+        block_put_bits(bits, 6, 3);
+        block_put_bits(bits, (uint64_t)dod, 9);
+    } else if (dod >= -2048 && dod < 2048) {
+        block_put_bits(bits, 14, 4);
+        block_put_bits(bits, (uint64_t)dod, 12);
+    } else {
+        block_put_bits(bits, 15, 4);
+        block_put_bits(bits, (uint64_t)dod, 64);
+    }
+    encoder->delta = delta;
+}
+
+static void block_encoder_float(block_encoder_t *encoder, double value)
+{
+    block_bits_t *bits = &(encoder->bits);
+    uint64_t current = block_double_bits(value);
+    uint64_t xor = current ^ encoder->previous;
+    int leading;
+    int trailing;
+
+    if (encoder->count == 0) {
+        block_put_bits(bits, current, 64);
+    } else if (xor == 0) {
+        block_put_bits(bits, 0, 1);
+    } else {
+        leading = __builtin_clzll(xor);
+        trailing = __builtin_ctzll(xor);
+        if (leading > 31)
+            leading = 31;
+
+        if (encoder->leading >= 0 && leading >= encoder->leading && trailing >= encoder->trailing) {
+            block_put_bits(bits, 2, 2);
+            block_put_bits(bits, xor >> encoder->trailing, 64 - encoder->leading - encoder->trailing);
+        } else {
+            block_put_bits(bits, 3, 2);
+            block_put_bits(bits, leading, 5);
+            block_put_bits(bits, 64 - leading - trailing - 1, 6);
+            block_put_bits(bits, xor >> trailing, 64 - leading - trailing);
+            encoder->leading = leading;
+            encoder->trailing = trailing;
+        }
+    }
+    encoder->previous = current;
+}
+
+/* Returns 0 when the block is full */
+int block_encoder_add(block_encoder_t *encoder, int64_t timestamp, double value)
+{
+    if (encoder->bits.pos + BLOCK_MAX_SAMPLE_BITS > encoder->bits.size)
+        return 0;
+
+    if (encoder->count == 0) {
+        encoder->first = timestamp;
+        encoder->min = value;
+        encoder->max = value;
+    } else {
+        block_encoder_timestamp(encoder, timestamp);
+        if (value < encoder->min)
+            encoder->min = value;
+        if (value > encoder->max)
+            encoder->max = value;
+    }
+
+    if (encoder->type == BLOCK_TYPE_INT) {
+        int64_t integer = (int64_t)value;
+
+        block_put_varint(&(encoder->bits), integer - (int64_t)encoder->previous);
+        encoder->previous = (uint64_t)integer;
+    } else {
+        block_encoder_float(encoder, value);
+    }
+
+    encoder->last = timestamp;
+    encoder->count++;
+
+    return 1;
+}
+
+/* Write the footer, the block is ready to be written */
+void block_encoder_finish(block_encoder_t *encoder, uint32_t point)
+{
+    uint8_t *p = encoder->data + BLOCK_SIZE - BLOCK_FOOTER_LENGTH;
+
+    memset(p, 0, BLOCK_FOOTER_LENGTH);
+    p = proto_put_u32(p, BLOCK_MAGIC);
+    p = proto_put_u32(p, point);
+    p = proto_put_u32(p, encoder->count);
+    *p = encoder->type;
+    p += 4;
+    p = proto_put_i64(p, encoder->first);
+    p = proto_put_i64(p, encoder->last);
+    p = proto_put_i64(p, (int64_t)block_double_bits(encoder->min));
+    proto_put_i64(p, (int64_t)block_double_bits(encoder->max));
+}
+
+/* Read the footer of the block. Returns -1 if the block is invalid. */
+int block_decoder_init(block_decoder_t *decoder, const uint8_t *block)
+{
+    const uint8_t *p = block + BLOCK_SIZE - BLOCK_FOOTER_LENGTH;
+
+    if (proto_get_u32(p) != BLOCK_MAGIC)
+        return -1;
+
+    decoder->point = proto_get_u32(p + 4);
+    decoder->count = proto_get_u32(p + 8);
+    decoder->type = p[12];
+    decoder->first = proto_get_i64(p + 16);
+    decoder->last = proto_get_i64(p + 24);
+    decoder->min = block_bits_double((uint64_t)proto_get_i64(p + 32));
+    decoder->max = block_bits_double((uint64_t)proto_get_i64(p + 40));
+
+    /* Only read */
+    decoder->bits.data = (uint8_t *)block;
+    decoder->bits.size = (BLOCK_SIZE - BLOCK_FOOTER_LENGTH) * 8;
+    decoder->bits.pos = 0;
+    decoder->index = 0;
+    decoder->timestamp = decoder->first;
+    decoder->delta = 0;
+    decoder->previous = 0;
+    decoder->leading = 0;
+    decoder->trailing = 0;
+
+    return 0;
+}
+
+static void block_decoder_timestamp(block_decoder_t *decoder)
+{
+    block_bits_t *bits = &(decoder->bits);
+
+    if (decoder->index == 1) {
+        decoder->delta = block_get_varint(bits);
+    } else if (block_get_bits(bits, 1) == 0) {
+        /* Same delta */
+    } else if (block_get_bits(bits, 1) == 0) {
+        decoder->delta += block_get_signed(bits, 7);
+    } else if (block_get_bits(bits, 1) == 0) {
+        decoder->delta += block_get_signed(bits, 9);
+    } else if (block_get_bits(bits, 1) == 0) {
+        decoder->delta += block_get_signed(bits, 12);
+    } else {
+        decoder->delta += (int64_t)block_get_bits(bits, 64);
+    }
+    decoder->timestamp += decoder->delta;
+}
+
+static double block_decoder_float(block_decoder_t *decoder)
+{
+    block_bits_t *bits = &(decoder->bits);
+
+    if (decoder->index == 0) {
+        decoder->previous = block_get_bits(bits, 64);
+    } else if (block_get_bits(bits, 1) == 1) {
+        if (block_get_bits(bits, 1) == 1) {
+            int length;
+
+            decoder->leading = block_get_bits(bits, 5);
+            length = block_get_bits(bits, 6) + 1;
+            decoder->trailing = 64 - decoder->leading - length;
+        }
+        decoder->previous ^= block_get_bits(bits, 64 - decoder->leading - decoder->trailing) << decoder->trailing;
+    }
+
+    return block_bits_double(decoder->previous);
+}
+
+/* Returns 1 with the next sample, 0 at the end of the block or -1 if the
+   block is corrupted */
+int block_decoder_next(block_decoder_t *decoder, int64_t *timestamp, double *value)
+{
+    if (decoder->index >= decoder->count)
+        return 0;
+
+    if (decoder->index > 0)
+        block_decoder_timestamp(decoder);
+
+    if (decoder->type == BLOCK_TYPE_INT) {
+        decoder->previous += (uint64_t)block_get_varint(&(decoder->bits));
+        *value = (double)(int64_t)decoder->previous;
+    } else {
+        *value = block_decoder_float(decoder);
+    }
+
+    if (decoder->bits.pos > decoder->bits.size)
+        return -1;
+
+    *timestamp = decoder->timestamp;
+    decoder->index++;
+
+    return 1;
+}
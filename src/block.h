@@ -0,0 +1,91 @@
+#ifndef _BLOCK_H_
+#define _BLOCK_H_
+
+/* Compressed block of the samples of one point, written by the recorder and
+   read by mbquery.
+
+   A block has a fixed size of BLOCK_SIZE bytes: a bit stream of the samples
+   (most significant bit first) then a footer at the end of the block:
+     magic (uint32), point (uint32), count (uint32), type (uint8),
+     reserved (3 bytes), first and last timestamps (int64, ms since Epoch),
+     min and max values (double)
+   The integers are little endian.
+
+   Timestamps: the first one is only in the footer, the second one is the
+   delta with the first one (zigzag varint) and the next ones are the delta of
+   the deltas: '0' for the same delta, '10' and 7 bits, '110' and 9 bits,
+   '1110' and 12 bits or '1111' and 64 bits.
+
+   BLOCK_TYPE_FLOAT: the first value is written on 64 bits, the next ones are
+   XORed with the previous one: '0' for the same value, '10' and the
+   meaningful bits when they fit in the window of the previous value, or '11',
+   the number of leading zeros (5 bits), the number of meaningful bits minus
+   one (6 bits) and the meaningful bits.
+
+   BLOCK_TYPE_INT: difference with the previous value (0 for the first one) as
+   a zigzag varint. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOCK_MAGIC 0x4B4C424D
+#define BLOCK_SIZE 1024
+#define BLOCK_FOOTER_LENGTH 48
+/* Worst case of a sample (delta varint and integer varint) */
+#define BLOCK_MAX_SAMPLE_BITS 160
+
+/* Same values as parser_value_t */
+#define BLOCK_TYPE_INT 0
+#define BLOCK_TYPE_FLOAT 1
+
+/* Entry of the index of a segment, one by block */
+#define BLOCK_INDEX_LENGTH 24
+
+typedef struct {
+    uint8_t *data;
+    /* In bits */
+    size_t size;
+    size_t pos;
+} block_bits_t;
+
+typedef struct {
+    uint8_t data[BLOCK_SIZE];
+    block_bits_t bits;
+    uint32_t count;
+    uint8_t type;
+    int64_t first;
+    int64_t last;
+    int64_t delta;
+    /* Previous value, bits of the double or integer */
+    uint64_t previous;
+    int leading;
+    int trailing;
+    double min;
+    double max;
+} block_encoder_t;
+
+typedef struct {
+    block_bits_t bits;
+    uint32_t point;
+    uint32_t count;
+    uint8_t type;
+    int64_t first;
+    int64_t last;
+    double min;
+    double max;
+    /* Position of the next sample */
+    uint32_t index;
+    int64_t timestamp;
+    int64_t delta;
+    uint64_t previous;
+    int leading;
+    int trailing;
+} block_decoder_t;
+
+void block_encoder_init(block_encoder_t *encoder, uint8_t type);
+int block_encoder_add(block_encoder_t *encoder, int64_t timestamp, double value);
+void block_encoder_finish(block_encoder_t *encoder, uint32_t point);
+int block_decoder_init(block_decoder_t *decoder, const uint8_t *block);
+int block_decoder_next(block_decoder_t *decoder, int64_t *timestamp, double *value);
+
+#endif /* _BLOCK_H_ */
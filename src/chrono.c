@@ -4,6 +4,8 @@
 #include <glib.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <math.h>
 
 #include "chrono.h"
 
@@ -92,3 +94,71 @@ void split_delay_in_hmsd(int delay,
     *minute = (delay / 60) - ((*hour)*60);
     *second = delay % 60;
 }
+
+/* Microseconds of CLOCK_MONOTONIC, not affected by steps of the wall clock */
+gint64 chrono_monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((gint64)ts.tv_sec * G_USEC_PER_SEC) + (ts.tv_nsec / 1000);
+}
+
+/* Sleep until an absolute deadline of CLOCK_MONOTONIC so the delays don't
+   accumulate from one cycle to the next. Returns -1 if interrupted by a
+   signal. */
+int chrono_sleep_until(gint64 deadline_us)
+{
+    struct timespec ts;
+    int rc;
+
+    ts.tv_sec = deadline_us / G_USEC_PER_SEC;
+    ts.tv_nsec = (deadline_us % G_USEC_PER_SEC) * 1000;
+
+    rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+
+    return 0;
+}
+
+void chrono_stats_init(chrono_stats_t *stats)
+{
+    stats->count = 0;
+    stats->min = 0;
+    stats->max = 0;
+    stats->last = 0;
+    stats->mean = 0;
+    stats->m2 = 0;
+}
+
+/* Welford's online algorithm for mean and variance */
+void chrono_stats_add(chrono_stats_t *stats, gint64 value)
+{
+    double delta;
+
+    if (stats->count == 0 || value < stats->min)
+        stats->min = value;
+    if (stats->count == 0 || value > stats->max)
+        stats->max = value;
+
+    stats->last = value;
+    stats->count++;
+    delta = value - stats->mean;
+    stats->mean += delta / stats->count;
+    stats->m2 += delta * (value - stats->mean);
+}
+
+void chrono_stats_print(chrono_stats_t *stats, const char *name)
+{
+    double stddev = 0;
+
+    if (stats->count > 1)
+        stddev = sqrt(stats->m2 / (stats->count - 1));
+
+    g_print("%s: %" G_GUINT64_FORMAT " samples, last %" G_GINT64_FORMAT " us, "
+            "min %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us, mean %.0f us, stddev %.0f us\n",
+            name, stats->count, stats->last, stats->min, stats->max, stats->mean, stddev);
+}
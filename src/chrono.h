@@ -10,6 +10,16 @@ typedef struct {
     char *message;
 } chrono_t;
 
+/* Running statistics of a time measure (in microseconds) */
+typedef struct {
+    guint64 count;
+    gint64 min;
+    gint64 max;
+    gint64 last;
+    double mean;
+    double m2;
+} chrono_stats_t;
+
 char* new_date_time_string(void);
 void print_date_time(void);
 
@@ -20,4 +30,11 @@ void split_delay_in_hmsd(int delay,
                          int *hour, int *minute, int *second,
                          int *tenth);
 
+gint64 chrono_monotonic_us(void);
+int chrono_sleep_until(gint64 deadline_us);
+
+void chrono_stats_init(chrono_stats_t *stats);
+void chrono_stats_add(chrono_stats_t *stats, gint64 value);
+void chrono_stats_print(chrono_stats_t *stats, const char *name);
+
 #endif /* _CHRONO_H_ */
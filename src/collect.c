@@ -5,7 +5,9 @@
 #include <string.h>
 #include <errno.h>
 #include <modbus.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -14,18 +16,20 @@
 #include "option.h"
 #include "keyfile.h"
 #include "output.h"
+#include "sched.h"
+#include "pipeline.h"
+#include "conn.h"
+#include "health.h"
+#include "regmap.h"
 
-#define BITS_NB 0
-#define INPUT_BITS_NB 0
-#define REGISTERS_NB 400
-#define INPUT_REGISTERS_NB 0
+/* Max number of events handled by epoll_wait() */
+#define MAX_EVENTS 64
 
 static volatile gboolean stop = FALSE;
 static volatile gboolean reload = FALSE;
 /* Required to stop server */
 static int opt_mode = OPT_MODE_MASTER;
 static modbus_t *ctx = NULL;
-static int server_socket = -1;
 
 static void sigint_stop(int dummy)
 {
@@ -34,9 +38,6 @@ static void sigint_stop(int dummy)
     if (opt_mode == OPT_MODE_SLAVE) {
         /* Rude way to stop server loop */
         modbus_close(ctx);
-    } else if (opt_mode == OPT_MODE_SERVER) {
-        close(server_socket);
-        server_socket = -1;
     }
 }
 
@@ -46,43 +47,223 @@ static void sighup_reload(int dummy)
     reload = TRUE;
 }
 
-static gboolean collect_listen_output(option_t *opt, modbus_mapping_t *mb_mapping, uint8_t *query, int header_length,
-                                      int *output_socket)
+/* Shared by the server workers */
+typedef struct {
+    option_t *opt;
+    /* Writers are exclusive, readers run concurrently */
+    GRWLock lock;
+    regmap_t *regmap;
+    GMutex output_mutex;
+    output_t output;
+    /* Written ranges not yet sent when the writes are coalesced */
+    GMutex dirty_mutex;
+    GCond dirty_cond;
+    int nb_dirty;
+    regmap_range_t *dirty;
+    int nb_dirty_write;
+    gint64 first_dirty_write;
+    gboolean flusher_stop;
+    GThread *flusher;
+    /* Clients connected to all the workers */
+    volatile gint nb_connection;
+} listen_shared_t;
+
+static gpointer collect_listen_flusher(gpointer data);
+
+static int collect_listen_shared_init(listen_shared_t *shared, option_t *opt)
 {
-    /* Write multiple registers and single register */
-    if (query[header_length] == 0x10 || query[header_length] == 0x6) {
-        int rc;
-        int addr = MODBUS_GET_INT16_FROM_INT8(query, header_length + 1);
-        int nb = 1;
+    regmap_t *regmap = regmap_new();
 
-        if (query[header_length] == 0x10)
-            nb = MODBUS_GET_INT16_FROM_INT8(query, header_length + 3);
+    if (regmap_parse_ranges(regmap, REGMAP_COILS, opt->coils) == -1 ||
+        regmap_parse_ranges(regmap, REGMAP_DISCRETE_INPUTS, opt->discrete_inputs) == -1 ||
+        regmap_parse_ranges(regmap, REGMAP_HOLDING_REGISTERS, opt->holding_registers) == -1 ||
+        regmap_parse_ranges(regmap, REGMAP_INPUT_REGISTERS, opt->input_registers) == -1) {
+        regmap_free(regmap);
+        return -1;
+    }
 
-        /* Write to local unix socket */
-        if (opt->verbose)
-            g_print("Addr %d: %d values\n", addr, nb);
+    shared->opt = opt;
+    g_rw_lock_init(&(shared->lock));
+    shared->regmap = regmap;
+    g_mutex_init(&(shared->output_mutex));
+    output_init(&(shared->output), opt);
+
+    g_mutex_init(&(shared->dirty_mutex));
+    g_cond_init(&(shared->dirty_cond));
+    shared->nb_dirty = 0;
+    shared->dirty = NULL;
+    shared->nb_dirty_write = 0;
+    shared->flusher_stop = FALSE;
+    shared->flusher = NULL;
+    g_atomic_int_set(&(shared->nb_connection), 0);
+    if (opt->flush_window > 0 || opt->flush_count > 1)
+        shared->flusher = g_thread_new("flusher", collect_listen_flusher, shared);
 
-        if (!output_is_connected(*output_socket))
-            *output_socket = output_connect(opt->socket_file, opt->verbose);
+    return 0;
+}
 
-        if (output_is_connected(*output_socket)) {
-            rc = output_write(*output_socket, opt, NULL, addr, nb, NULL, mb_mapping->tab_registers + addr, opt->verbose);
-            if (rc == -1) {
-                output_close(output_socket);
-            }
+static void collect_listen_shared_clear(listen_shared_t *shared)
+{
+    if (shared->flusher != NULL) {
+        /* Send the pending writes */
+        g_mutex_lock(&(shared->dirty_mutex));
+        shared->flusher_stop = TRUE;
+        g_cond_signal(&(shared->dirty_cond));
+        g_mutex_unlock(&(shared->dirty_mutex));
+        g_thread_join(shared->flusher);
+    }
+    g_free(shared->dirty);
+    g_cond_clear(&(shared->dirty_cond));
+    g_mutex_clear(&(shared->dirty_mutex));
+
+    output_clear(&(shared->output));
+    g_mutex_clear(&(shared->output_mutex));
+    g_rw_lock_clear(&(shared->lock));
+    if (shared->opt->verbose)
+        g_print("%d pages of %d values used by the register map\n", shared->regmap->nb_page, REGMAP_PAGE_SIZE);
+    regmap_free(shared->regmap);
+}
+
+static void collect_listen_output(listen_shared_t *shared, int addr, int nb, uint16_t *tab_reg)
+{
+    option_t *opt = shared->opt;
+    gint64 timestamp;
+
+    /* Write to local unix socket */
+    if (opt->verbose)
+        g_print("Addr %d: %d values\n", addr, nb);
+
+    g_mutex_lock(&(shared->output_mutex));
+    timestamp = g_get_real_time();
+    /* Each write is a cycle */
+    output_write(&(shared->output), opt, NULL, addr, nb, OUTPUT_TYPE_INT, tab_reg, NULL, timestamp, opt->verbose);
+    output_flush(&(shared->output), opt, TRUE, timestamp);
+    g_mutex_unlock(&(shared->output_mutex));
+}
+
+/* Send the latest values of the written ranges, the dirty mutex is held */
+static void collect_listen_flush(listen_shared_t *shared)
+{
+    regmap_range_t *dirty = shared->dirty;
+    int nb_dirty = shared->nb_dirty;
+    uint16_t *tab_reg = NULL;
+    int i;
+
+    shared->dirty = NULL;
+    shared->nb_dirty = 0;
+    shared->nb_dirty_write = 0;
+    g_mutex_unlock(&(shared->dirty_mutex));
+
+    for (i = 0; i < nb_dirty; i++) {
+        int nb = dirty[i].end - dirty[i].start;
+
+        tab_reg = g_renew(uint16_t, tab_reg, nb);
+        g_rw_lock_reader_lock(&(shared->lock));
+        regmap_get_registers(shared->regmap, REGMAP_HOLDING_REGISTERS, dirty[i].start, nb, tab_reg);
+        g_rw_lock_reader_unlock(&(shared->lock));
+
+        collect_listen_output(shared, dirty[i].start, nb, tab_reg);
+    }
+    g_free(tab_reg);
+    g_free(dirty);
+
+    g_mutex_lock(&(shared->dirty_mutex));
+}
+
+/* Send the coalesced writes at the end of the window or when enough writes
+   are pending */
+static gpointer collect_listen_flusher(gpointer data)
+{
+    listen_shared_t *shared = data;
+    option_t *opt = shared->opt;
+
+    g_mutex_lock(&(shared->dirty_mutex));
+    while (!shared->flusher_stop) {
+        if (shared->nb_dirty == 0) {
+            g_cond_wait(&(shared->dirty_cond), &(shared->dirty_mutex));
+        } else if (opt->flush_count > 1 && shared->nb_dirty_write >= opt->flush_count) {
+            collect_listen_flush(shared);
+        } else if (opt->flush_window > 0) {
+            gint64 end_time = shared->first_dirty_write + (gint64)opt->flush_window * 1000;
+
+            if (g_get_monotonic_time() >= end_time)
+                collect_listen_flush(shared);
+            else
+                g_cond_wait_until(&(shared->dirty_cond), &(shared->dirty_mutex), end_time);
+        } else {
+            g_cond_wait(&(shared->dirty_cond), &(shared->dirty_mutex));
         }
-        return TRUE;
-    } else {
-        return FALSE;
     }
+
+    if (shared->nb_dirty > 0)
+        collect_listen_flush(shared);
+    g_mutex_unlock(&(shared->dirty_mutex));
+
+    return NULL;
+}
+
+/* Add the written range to the ranges of the flusher */
+static void collect_listen_coalesce(listen_shared_t *shared, int addr, int nb)
+{
+    g_mutex_lock(&(shared->dirty_mutex));
+    if (shared->nb_dirty == 0)
+        shared->first_dirty_write = g_get_monotonic_time();
+    regmap_ranges_add(&(shared->dirty), &(shared->nb_dirty), addr, nb);
+    shared->nb_dirty_write++;
+
+    if (shared->nb_dirty_write == 1 || shared->nb_dirty_write == shared->opt->flush_count)
+        g_cond_signal(&(shared->dirty_cond));
+    g_mutex_unlock(&(shared->dirty_mutex));
+}
+
+/* Reply to the request under the lock of the register map and forward the
+   written registers */
+static void collect_listen_reply(listen_shared_t *shared, modbus_t *listen_ctx, uint8_t *query, int query_length,
+                                 int header_length)
+{
+    uint8_t function = query[header_length];
+    uint16_t tab_reg[MODBUS_MAX_WRITE_REGISTERS];
+    int addr = 0;
+    int nb = 0;
+
+    if (!regmap_is_write(function)) {
+        g_rw_lock_reader_lock(&(shared->lock));
+        regmap_reply(shared->regmap, listen_ctx, query, query_length);
+        g_rw_lock_reader_unlock(&(shared->lock));
+        return;
+    }
+
+    g_rw_lock_writer_lock(&(shared->lock));
+    regmap_reply(shared->regmap, listen_ctx, query, query_length);
+    /* Write multiple registers and single register */
+    if (function == 0x10 || function == 0x6) {
+        addr = MODBUS_GET_INT16_FROM_INT8(query, header_length + 1);
+        nb = 1;
+        if (function == 0x10)
+            nb = MODBUS_GET_INT16_FROM_INT8(query, header_length + 3);
+
+        /* Copy the values to send them without the lock */
+        if (nb > MODBUS_MAX_WRITE_REGISTERS || !regmap_is_declared(shared->regmap, REGMAP_HOLDING_REGISTERS, addr, nb))
+            nb = 0;
+        else if (shared->flusher == NULL)
+            regmap_get_registers(shared->regmap, REGMAP_HOLDING_REGISTERS, addr, nb, tab_reg);
+    }
+    g_rw_lock_writer_unlock(&(shared->lock));
+
+    if (nb == 0)
+        return;
+
+    if (shared->flusher != NULL)
+        collect_listen_coalesce(shared, addr, nb);
+    else
+        collect_listen_output(shared, addr, nb, tab_reg);
 }
 
 static int collect_listen_rtu(option_t *opt)
 {
     int rc;
-    modbus_mapping_t *mb_mapping = NULL;
+    listen_shared_t shared;
     uint8_t query[MODBUS_RTU_MAX_ADU_LENGTH];
-    int output_socket = -1;
     int header_length;
 
     ctx = modbus_new_rtu(opt->device, opt->baud, opt->parity[0], opt->data_bit, opt->stop_bit);
@@ -100,178 +281,888 @@ static int collect_listen_rtu(option_t *opt)
 
     modbus_set_slave(ctx, opt->id);
 
-    mb_mapping = modbus_mapping_new(BITS_NB, INPUT_BITS_NB, REGISTERS_NB, INPUT_REGISTERS_NB);
-    if (mb_mapping == NULL) {
-        g_warning("modbus_mapping_new: %s", modbus_strerror(errno));
+    if (collect_listen_shared_init(&shared, opt) == -1)
         return -1;
-    }
 
     header_length = modbus_get_header_length(ctx);
     while (!stop) {
         rc = modbus_receive(ctx, query);
         if (rc > 0) {
-            modbus_reply(ctx, query, rc, mb_mapping);
-            collect_listen_output(opt, mb_mapping, query, header_length, &output_socket);
+            collect_listen_reply(&shared, ctx, query, rc, header_length);
         }
     }
 
-    output_close(&output_socket);
-    modbus_mapping_free(mb_mapping);
+    collect_listen_shared_clear(&shared);
     modbus_close(ctx);
     modbus_free(ctx);
 
     return 0;
 }
 
-static int collect_listen_tcp(option_t *opt)
+/* Non-blocking connection of a client, the requests are framed from the
+   received bytes so a partial request doesn't stall the worker */
+typedef struct {
+    /* Time of the last request (us) */
+    gint64 last;
+    uint8_t buffer[MODBUS_TCP_MAX_ADU_LENGTH];
+    int length;
+} listen_client_t;
+
+/* Server worker, the connections of a worker are only handled by its
+   thread */
+typedef struct {
+    listen_shared_t *shared;
+    modbus_t *ctx;
+    int header_length;
+    int listen_socket;
+    int epfd;
+    /* Socket => listen_client_t */
+    GHashTable *clients;
+} listen_tcp_t;
+
+/* Listen socket of a worker, all the workers bind the same port and the
+   kernel shares out the connections */
+static int collect_listen_socket(option_t *opt, int shared_socket)
+{
+    struct sockaddr_in addr;
+    int enable = 1;
+    int s;
+
+#ifndef SO_REUSEPORT
+    if (shared_socket != -1)
+        return shared_socket;
+#endif
+
+    s = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (s == -1) {
+        g_warning("socket: %s", strerror(errno));
+        return -1;
+    }
+
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+#ifdef SO_REUSEPORT
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1 && shared_socket != -1) {
+        /* Not supported by the kernel */
+        close(s);
+        return shared_socket;
+    }
+#endif
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt->port);
+    if (opt->ip == NULL || strcmp(opt->ip, "0.0.0.0") == 0) {
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    } else if (inet_pton(AF_INET, opt->ip, &(addr.sin_addr)) != 1) {
+        g_warning("Invalid IP address %s", opt->ip);
+        close(s);
+        return -1;
+    }
+
+    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(s, opt->backlog) == -1) {
+        g_warning("Unable to listen on %s:%d: %s", opt->ip, opt->port, strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    /* All pending connections are accepted on each event */
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+
+    return s;
+}
+
+static void collect_listen_close(listen_tcp_t *listen_tcp, int s)
+{
+    if (listen_tcp->shared->opt->verbose) {
+        g_print("Connection closed on socket %d\n", s);
+    }
+
+    epoll_ctl(listen_tcp->epfd, EPOLL_CTL_DEL, s, NULL);
+    close(s);
+    g_hash_table_remove(listen_tcp->clients, GINT_TO_POINTER(s));
+    g_atomic_int_add(&(listen_tcp->shared->nb_connection), -1);
+}
+
+/* Accept all pending connections (edge-triggered) */
+static void collect_listen_accept(listen_tcp_t *listen_tcp)
+{
+    listen_shared_t *shared = listen_tcp->shared;
+    option_t *opt = shared->opt;
+
+    for (;;) {
+        socklen_t addrlen;
+        struct sockaddr_in clientaddr;
+        struct epoll_event ev;
+        listen_client_t *client;
+        gint nb_connection;
+        int newfd;
+
+        addrlen = sizeof(clientaddr);
+        memset(&clientaddr, 0, sizeof(clientaddr));
+        newfd = accept(listen_tcp->listen_socket, (struct sockaddr *)&clientaddr, &addrlen);
+        if (newfd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept() error");
+            return;
+        }
+
+        /* The limit applies to the connections of all the workers, the
+           place is taken before the check */
+        nb_connection = g_atomic_int_add(&(shared->nb_connection), 1);
+        if (opt->max_connections > 0 && nb_connection >= opt->max_connections) {
+            g_atomic_int_add(&(shared->nb_connection), -1);
+            if (opt->verbose) {
+                g_print("Connection from %s:%d refused, too many connections\n",
+                        inet_ntoa(clientaddr.sin_addr), clientaddr.sin_port);
+            }
+            close(newfd);
+            continue;
+        }
+
+        /* All the received bytes are read on each event */
+        fcntl(newfd, F_SETFL, fcntl(newfd, F_GETFL) | O_NONBLOCK);
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = newfd;
+        if (epoll_ctl(listen_tcp->epfd, EPOLL_CTL_ADD, newfd, &ev) == -1) {
+            perror("epoll_ctl");
+            g_atomic_int_add(&(shared->nb_connection), -1);
+            close(newfd);
+            continue;
+        }
+
+        client = g_new(listen_client_t, 1);
+        client->last = chrono_monotonic_us();
+        client->length = 0;
+        g_hash_table_insert(listen_tcp->clients, GINT_TO_POINTER(newfd), client);
+
+        if (opt->verbose) {
+            g_print("New connection from %s:%d on socket %d\n",
+                    inet_ntoa(clientaddr.sin_addr), clientaddr.sin_port, newfd);
+        }
+    }
+}
+
+/* Reply to the complete requests of the buffer, the length of each request
+   is given by its MBAP header. Returns -1 on an invalid header. */
+static int collect_listen_frames(listen_tcp_t *listen_tcp, listen_client_t *client)
 {
-    modbus_mapping_t *mb_mapping = NULL;
     uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
-    int output_socket = -1;
-    int header_length;
+    int offset = 0;
 
-    fd_set refset;
-    fd_set rdset;
-    int fdmax;
+    while (client->length - offset >= listen_tcp->header_length) {
+        const uint8_t *frame = client->buffer + offset;
+        /* Transaction ID, protocol ID and length of the unit ID and PDU */
+        int frame_length = 6 + MODBUS_GET_INT16_FROM_INT8(frame, 4);
 
-    ctx = modbus_new_tcp(opt->ip, opt->port);
-    if (ctx == NULL) {
+        if (MODBUS_GET_INT16_FROM_INT8(frame, 2) != 0 || frame_length <= listen_tcp->header_length ||
+            frame_length > MODBUS_TCP_MAX_ADU_LENGTH)
+            return -1;
+
+        if (client->length - offset < frame_length)
+            break;
+
+        /* The fields missing in a short request are read as zeros */
+        memcpy(query, frame, frame_length);
+        memset(query + frame_length, 0, sizeof(query) - frame_length);
+        collect_listen_reply(listen_tcp->shared, listen_tcp->ctx, query, frame_length, listen_tcp->header_length);
+        offset += frame_length;
+    }
+
+    /* Start of the next request */
+    client->length -= offset;
+    memmove(client->buffer, client->buffer + offset, client->length);
+
+    return 0;
+}
+
+/* Handle all the requests received on the socket (edge-triggered), the
+   bytes of an incomplete request are kept for the next event */
+static void collect_listen_client(listen_tcp_t *listen_tcp, int s)
+{
+    listen_client_t *client = g_hash_table_lookup(listen_tcp->clients, GINT_TO_POINTER(s));
+    ssize_t rc;
+
+    if (client == NULL)
+        return;
+
+    client->last = chrono_monotonic_us();
+    modbus_set_socket(listen_tcp->ctx, s);
+
+    for (;;) {
+        rc = recv(s, client->buffer + client->length, sizeof(client->buffer) - client->length, 0);
+        if (rc == -1 && errno == EINTR)
+            continue;
+
+        if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        if (rc <= 0) {
+            /* Connection closed or error */
+            collect_listen_close(listen_tcp, s);
+            return;
+        }
+
+        client->length += rc;
+        if (collect_listen_frames(listen_tcp, client) == -1) {
+            g_warning("Invalid request on socket %d", s);
+            collect_listen_close(listen_tcp, s);
+            return;
+        }
+    }
+}
+
+/* Close the connections without request since 'idle_timeout' */
+static void collect_listen_reap(listen_tcp_t *listen_tcp)
+{
+    gint64 now = chrono_monotonic_us();
+    gint64 idle_timeout = (gint64)listen_tcp->shared->opt->idle_timeout * 1000;
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, listen_tcp->clients);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        int s = GPOINTER_TO_INT(key);
+
+        if (now - ((listen_client_t *)value)->last < idle_timeout)
+            continue;
+
+        if (listen_tcp->shared->opt->verbose) {
+            g_print("Idle connection closed on socket %d\n", s);
+        }
+        epoll_ctl(listen_tcp->epfd, EPOLL_CTL_DEL, s, NULL);
+        close(s);
+        g_hash_table_iter_remove(&iter);
+        g_atomic_int_add(&(listen_tcp->shared->nb_connection), -1);
+    }
+}
+
+static gpointer collect_listen_worker(gpointer data)
+{
+    listen_tcp_t *listen_tcp = data;
+    option_t *opt = listen_tcp->shared->opt;
+    struct epoll_event events[MAX_EVENTS];
+    int timeout;
+
+    /* Wake up regularly to reap the idle connections and to see the stop
+       request (the signal is only received by one thread) */
+    timeout = 1000;
+    if (opt->idle_timeout > 0)
+        timeout = MIN(timeout, MAX(opt->idle_timeout / 2, 1));
+
+    while (!stop) {
+        int nfds;
+        int i;
+
+        nfds = epoll_wait(listen_tcp->epfd, events, MAX_EVENTS, timeout);
+        if (nfds == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait() failure.");
+            /* If stop is set to 1 by signal handling, the program will exit
+               but I think it's safer to do that in all cases. */
+            stop = 1;
+            continue;
+        }
+
+        for (i = 0; i < nfds; i++) {
+            if (events[i].data.fd == listen_tcp->listen_socket) {
+                /* Clients are asking new connections */
+                collect_listen_accept(listen_tcp);
+            } else {
+                collect_listen_client(listen_tcp, events[i].data.fd);
+            }
+        }
+
+        if (opt->idle_timeout > 0)
+            collect_listen_reap(listen_tcp);
+    }
+
+    return NULL;
+}
+
+static int collect_listen_worker_init(listen_tcp_t *listen_tcp, listen_shared_t *shared, int shared_socket)
+{
+    option_t *opt = shared->opt;
+    struct epoll_event ev;
+
+    listen_tcp->shared = shared;
+    listen_tcp->epfd = -1;
+    listen_tcp->clients = NULL;
+    listen_tcp->listen_socket = -1;
+    listen_tcp->ctx = modbus_new_tcp(opt->ip, opt->port);
+    if (listen_tcp->ctx == NULL) {
         g_warning("modbus_new_tcp: %s", modbus_strerror(errno));
         return -1;
     }
 
-    modbus_set_debug(ctx, opt->verbose);
+    modbus_set_debug(listen_tcp->ctx, opt->verbose);
+    listen_tcp->header_length = modbus_get_header_length(listen_tcp->ctx);
 
-    mb_mapping = modbus_mapping_new(BITS_NB, INPUT_BITS_NB, REGISTERS_NB, INPUT_REGISTERS_NB);
-    if (mb_mapping == NULL) {
-        g_warning("modbus_mapping_new: %s", modbus_strerror(errno));
+    listen_tcp->listen_socket = collect_listen_socket(opt, shared_socket);
+    if (listen_tcp->listen_socket == -1)
+        return -1;
+
+    listen_tcp->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (listen_tcp->epfd == -1) {
+        g_warning("epoll_create1: %s", strerror(errno));
         return -1;
     }
 
-    /* Listen client */
-    server_socket = modbus_tcp_listen(ctx, 5);
-    if (server_socket == -1) {
-        g_warning("modbus_tcp_listen: %s", modbus_strerror(errno));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = listen_tcp->listen_socket;
+    epoll_ctl(listen_tcp->epfd, EPOLL_CTL_ADD, listen_tcp->listen_socket, &ev);
+
+    listen_tcp->clients = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+
+    return 0;
+}
+
+static void collect_listen_worker_clear(listen_tcp_t *listen_tcp, int shared_socket)
+{
+    GHashTableIter iter;
+    gpointer key;
+
+    if (listen_tcp->clients != NULL) {
+        g_hash_table_iter_init(&iter, listen_tcp->clients);
+        while (g_hash_table_iter_next(&iter, &key, NULL)) {
+            close(GPOINTER_TO_INT(key));
+        }
+        g_hash_table_destroy(listen_tcp->clients);
+    }
+
+    if (listen_tcp->epfd != -1)
+        close(listen_tcp->epfd);
+
+    if (listen_tcp->listen_socket != -1 && listen_tcp->listen_socket != shared_socket)
+        close(listen_tcp->listen_socket);
+
+    if (listen_tcp->ctx != NULL)
+        modbus_free(listen_tcp->ctx);
+}
+
+static int collect_listen_tcp(option_t *opt)
+{
+    listen_shared_t shared;
+    listen_tcp_t *workers;
+    GThread **threads;
+    int shared_socket = -1;
+    int rc = 0;
+    int i;
+
+    if (collect_listen_shared_init(&shared, opt) == -1)
         return -1;
+
+    workers = g_new0(listen_tcp_t, opt->workers);
+    threads = g_new0(GThread *, opt->workers);
+    for (i = 0; i < opt->workers; i++) {
+        rc = collect_listen_worker_init(&(workers[i]), &shared, shared_socket);
+        if (rc == -1) {
+            opt->workers = i + 1;
+            break;
+        }
+        if (i == 0)
+            shared_socket = workers[i].listen_socket;
     }
 
-    /* Clear the reference set of socket */
-    FD_ZERO(&refset);
-    /* Add the server socket */
-    FD_SET(server_socket, &refset);
+    if (rc == 0) {
+        if (opt->verbose)
+            g_print("Listening on %s:%d with %d workers\n", opt->ip, opt->port, opt->workers);
 
-    header_length = modbus_get_header_length(ctx);
-    /* Keep track of the max file descriptor */
-    fdmax = server_socket;
-    while (!stop) {
-        int s;
+        /* The main thread is the first worker */
+        for (i = 1; i < opt->workers; i++) {
+            threads[i] = g_thread_new("worker", collect_listen_worker, &(workers[i]));
+        }
+        collect_listen_worker(&(workers[0]));
+        for (i = 1; i < opt->workers; i++) {
+            g_thread_join(threads[i]);
+        }
+    }
+
+    /* The shared socket is closed last */
+    for (i = opt->workers - 1; i >= 0; i--) {
+        collect_listen_worker_clear(&(workers[i]), i > 0 ? shared_socket : -1);
+    }
+    g_free(threads);
+    g_free(workers);
+    collect_listen_shared_clear(&shared);
 
-        rdset = refset;
+    return rc;
+}
 
-        if (select(fdmax+1, &rdset, NULL, NULL, NULL) == -1) {
-            perror("select() failure.");
-            /* If stop is set to 1 by signal handling, the program will exit
-               but I think it's safer to do that in all cases. */
-            stop = 1;
+/* Shared by the polling threads of a cycle */
+typedef struct {
+    option_t *opt;
+    /* Protects the output and the counter of pending servers */
+    GMutex mutex;
+    GCond cond;
+    int pending;
+    /* Sinks of the records */
+    output_t output;
+    /* Output thread (NULL to send from the polling threads) */
+    output_queue_t *queue;
+    /* Wall clock time of the cycle (us) */
+    gint64 timestamp;
+} poll_cycle_t;
+
+static void collect_poll_output(poll_cycle_t *cycle, server_t *server, int n, uint16_t *tab_reg)
+{
+    option_t *opt = cycle->opt;
+    guint8 mask[MODBUS_MAX_READ_REGISTERS];
+
+    /* Skip the unchanged values when reporting by exception */
+    if (server->rbe != NULL &&
+        rbe_filter(server->rbe, n, server->lengths[n], server->output_types[n], tab_reg, mask) == 0)
+        return;
+
+    if (cycle->queue != NULL) {
+        output_queue_write(cycle->queue, server->prefixes[n], server->addresses[n], server->lengths[n],
+                           server->output_types[n], tab_reg, server->rbe != NULL ? mask : NULL, cycle->timestamp);
+        return;
+    }
+
+    g_mutex_lock(&cycle->mutex);
+
+    output_write(&(cycle->output), opt, server->prefixes[n], server->addresses[n], server->lengths[n],
+                 server->output_types[n], tab_reg, server->rbe != NULL ? mask : NULL, cycle->timestamp, opt->verbose);
+
+    g_mutex_unlock(&cycle->mutex);
+}
+
+/* Send the due reads one at a time */
+static void collect_poll_lockstep(option_t *opt, modbus_t *server_ctx, server_t *server)
+{
+    plan_t *plan = server->plan;
+    /* Response times are only tracked on the shared serial bus */
+    health_t *health = (opt->backend == OPT_BACKEND_RTU) ? &(server->health) : NULL;
+    int rc;
+    int r;
+
+    for (r = 0; r < plan->nb_read; r++) {
+        plan_read_t *read = &(plan->reads[r]);
+        gint64 start;
+
+        if (!read->due || !server->connected)
             continue;
+
+        /* Don't waste the bus when the probe has failed */
+        if (health != NULL && health->state == HEALTH_OPEN)
+            break;
+
+        if (opt->verbose) {
+            g_print("Name: %s, addr:%d l:%d\n", server->name, read->addr, read->nb);
         }
 
-        /* Run through the existing connections looking for data to be read */
-        for (s = 0; s <= fdmax; s++) {
-            if (!FD_ISSET(s, &rdset)) {
-                continue;
+        if (health != NULL) {
+            /* Timeout learnt from the response times of the slave */
+            gint64 timeout = health_timeout(health, read->nb);
+
+            modbus_set_response_timeout(server_ctx, timeout / G_USEC_PER_SEC, timeout % G_USEC_PER_SEC);
+        }
+
+        start = chrono_monotonic_us();
+        rc = modbus_read_registers(server_ctx, read->addr, read->nb, plan->tab_reg + read->offset);
+        if (health != NULL) {
+            int saved_errno = errno;
+            gint64 now = chrono_monotonic_us();
+
+            if (rc != -1 || (saved_errno > MODBUS_ENOBASE && saved_errno < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX)) {
+                /* An exception is an answer of a live slave */
+                health_success(health, read->nb, now - start);
+            } else if (saved_errno == ETIMEDOUT || saved_errno == EMBBADCRC || saved_errno == EMBBADDATA) {
+                /* CRC errors and garbage are failures too */
+                health_failure(health, saved_errno == ETIMEDOUT, read->nb, now - start, now, opt->breaker,
+                               (gint64)opt->probe * 1000);
             }
-            if (s == server_socket) {
-                /* A client is asking a new connection */
-                socklen_t addrlen;
-                struct sockaddr_in clientaddr;
-                int newfd;
-
-                /* Handle new connections */
-                addrlen = sizeof(clientaddr);
-                memset(&clientaddr, 0, sizeof(clientaddr));
-                newfd = accept(server_socket, (struct sockaddr *)&clientaddr, &addrlen);
-                if (newfd == -1) {
-                    perror("accept() error");
-                } else {
-                    FD_SET(newfd, &refset);
-
-                    if (newfd > fdmax) {
-                        /* Keep track of the maximum */
-                        fdmax = newfd;
-                    }
-                    if (opt->verbose) {
-                        g_print("New connection from %s:%d on socket %d\n",
-                                inet_ntoa(clientaddr.sin_addr), clientaddr.sin_port, newfd);
-                    }
-                }
-            } else {
-                int rc;
-
-                modbus_set_socket(ctx, s);
-                rc = modbus_receive(ctx, query);
-                if (rc > 0) {
-                    modbus_reply(ctx, query, rc, mb_mapping);
-                    collect_listen_output(opt, mb_mapping, query, header_length, &output_socket);
-                } else if (rc == -1) {
-                    /* This example server in ended on connection closing or
-                     * any errors. */
-                    if (opt->verbose) {
-                        g_print("Connection closed on socket %d\n", s);
-                    }
-                    close(s);
+            errno = saved_errno;
+        }
 
-                    /* Remove from reference set */
-                    FD_CLR(s, &refset);
+        if (rc == -1) {
+            g_warning("Name: %s, addr:%d l:%d %s\n", server->name, read->addr, read->nb,
+                      modbus_strerror(errno));
+            if (errno == EBADF || errno == ECONNRESET || errno == EPIPE) {
+                modbus_close(server_ctx);
+                server->connected = FALSE;
+                /* Skip this server in this iteration */
+            }
+            /* Else MODBUS_ERROR_RECOVERY_PROTOCOL has already flushed the data, good! */
+        } else {
+            read->ok = TRUE;
+        }
+    }
+}
 
-                    if (s == fdmax) {
-                        fdmax--;
-                    }
-                }
+/* Keep many due reads in flight on the TCP connection of the server */
+static void collect_poll_pipelined(option_t *opt, modbus_t *server_ctx, server_t *server)
+{
+    pipeline_status_t status;
+    int unit_id = server->id ? server->id : 0xFF;
+
+    status = pipeline_read(server_ctx, unit_id, &(server->tid), server->plan, server->pipeline,
+                           server->name, opt->verbose);
+    switch (status) {
+        case PIPELINE_ERROR:
+            g_warning("Name: %s, pipelined reads %s\n", server->name, modbus_strerror(errno));
+            modbus_close(server_ctx);
+            server->connected = FALSE;
+            break;
+        case PIPELINE_TIMEOUT:
+            /* A response may be lost once in a while */
+            modbus_flush(server_ctx);
+            if (++server->pipeline_losses < PIPELINE_MAX_LOSSES)
+                break;
+            /* Fall through */
+        case PIPELINE_BUSY:
+            /* The device can't handle many outstanding requests, try again
+               later */
+            g_warning("Name: %s, fall back to one request at a time for %d s\n", server->name,
+                      (int)(PIPELINE_RETRY_INTERVAL / G_USEC_PER_SEC));
+            server->pipeline_losses = 0;
+            server->pipeline_retry = chrono_monotonic_us() + PIPELINE_RETRY_INTERVAL;
+            modbus_flush(server_ctx);
+            break;
+        default:
+            server->pipeline_losses = 0;
+            break;
+    }
+}
+
+/* Read the due addresses of a server with the given context */
+static void collect_poll_server(poll_cycle_t *cycle, modbus_t *server_ctx, server_t *server)
+{
+    option_t *opt = cycle->opt;
+    plan_t *plan = server->plan;
+    int rc;
+    int r;
+    int n;
+
+    /* TCP connections are handled by collect_poll_connect() */
+    if (opt->backend == OPT_BACKEND_RTU && !server->connected) {
+        rc = modbus_connect(server_ctx);
+        server->connected = (rc == 0);
+        if (rc == -1) {
+            g_warning("modbus_connect: %s", modbus_strerror(errno));
+        }
+    }
+
+    for (r = 0; r < plan->nb_read; r++) {
+        plan->reads[r].ok = FALSE;
+    }
+
+    if (server->connected) {
+        if (server->pipeline > 1 && chrono_monotonic_us() >= server->pipeline_retry) {
+            collect_poll_pipelined(opt, server_ctx, server);
+        } else {
+            collect_poll_lockstep(opt, server_ctx, server);
+        }
+    }
+
+    /* Slice the reads back to the configured addresses */
+    for (n = 0; n < server->n; n++) {
+        gboolean ok;
+        uint16_t *tab_reg = plan_entry_registers(plan, n, server->addresses[n], &ok);
+
+        if (ok)
+            collect_poll_output(cycle, server, n, tab_reg);
+    }
+
+    plan_clear_due(plan);
+}
+
+/* Poll the due slaves of a serial bus, one at a time */
+static void collect_poll_bus(poll_cycle_t *cycle, bus_t *bus)
+{
+    gint64 now = chrono_monotonic_us();
+    int rc;
+    int i;
+
+    for (i = 0; i < bus->nb_slave; i++) {
+        server_t *server = bus->slaves[i];
+
+        if (!plan_is_due(server->plan))
+            continue;
+
+        /* A dead slave is only probed from time to time */
+        if (!health_allow(&(server->health), now)) {
+            plan_clear_due(server->plan);
+            continue;
+        }
+
+        rc = modbus_set_slave(bus->ctx, server->id);
+        if (rc != 0) {
+            g_warning("modbus_set_slave with ID %d: %s\n", server->id, modbus_strerror(errno));
+            plan_clear_due(server->plan);
+            continue;
+        }
+
+        collect_poll_server(cycle, bus->ctx, server);
+    }
+}
+
+static void collect_poll_done(poll_cycle_t *cycle)
+{
+    g_mutex_lock(&cycle->mutex);
+    cycle->pending--;
+    if (cycle->pending == 0)
+        g_cond_signal(&cycle->cond);
+    g_mutex_unlock(&cycle->mutex);
+}
+
+/* Thread pool function, each TCP server has its own context */
+static void collect_poll_job(gpointer data, gpointer user_data)
+{
+    server_t *server = data;
+    poll_cycle_t *cycle = user_data;
+
+    collect_poll_server(cycle, server->ctx, server);
+    collect_poll_done(cycle);
+}
+
+/* Thread pool function, each serial bus has its own thread */
+static void collect_poll_bus_job(gpointer data, gpointer user_data)
+{
+    bus_t *bus = data;
+    poll_cycle_t *cycle = user_data;
+
+    collect_poll_bus(cycle, bus);
+    collect_poll_done(cycle);
+}
+
+/* Whether at least one slave of the bus is due */
+static gboolean collect_poll_bus_is_due(bus_t *bus)
+{
+    int i;
+
+    if (bus->ctx == NULL)
+        return FALSE;
+
+    for (i = 0; i < bus->nb_slave; i++) {
+        if (plan_is_due(bus->slaves[i]->plan))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Start the due connections to the TCP servers and complete the pending
+   ones, never blocks so the attempts run in parallel while sleeping */
+static void collect_poll_connect(option_t *opt, int nb_server, server_t *servers)
+{
+    gint64 now = chrono_monotonic_us();
+    int i;
+
+    for (i = 0; i < nb_server; i++) {
+        server_t *server = &(servers[i]);
+        conn_t *conn = &(server->conn);
+        uint32_t to_sec;
+        uint32_t to_usec;
+        int s;
+
+        if (conn->state == CONN_CONNECTED) {
+            if (server->connected)
+                continue;
+            /* Closed by a failed read */
+            conn_reset(conn, now);
+        }
+
+        if (conn->state == CONN_DISCONNECTED && now >= conn->deadline) {
+            if (opt->verbose) {
+                g_print("Connecting to %s:%d\n", server->ip, server->port);
             }
+            modbus_get_response_timeout(server->ctx, &to_sec, &to_usec);
+            conn_start(conn, server->ip, server->port, now, (gint64)to_sec * G_USEC_PER_SEC + to_usec);
+        }
+
+        if (conn->state != CONN_CONNECTING)
+            continue;
+
+        s = conn_check(conn, now);
+        if (s != -1) {
+            modbus_set_socket(server->ctx, s);
+            server->connected = TRUE;
+        } else if (conn->state == CONN_DISCONNECTED) {
+            g_warning("Connection to %s:%d: %s, next attempt in %" G_GINT64_FORMAT " ms", server->ip,
+                      server->port, strerror(errno), (conn->deadline - now) / 1000);
         }
     }
+}
 
-    modbus_mapping_free(mb_mapping);
-    output_close(&output_socket);
-    close(server_socket);
-    server_socket = -1;
-    modbus_free(ctx);
+/* First deadline of a periodic read (in us of the monotonic clock). When
+   aligned, it's on the next multiple of the interval of the wall clock. */
+static gint64 collect_poll_first_due(option_t *opt, gint64 now, gint64 real_now, gint64 interval)
+{
+    if (opt->align)
+        return now + interval - (real_now % interval);
 
-    return 0;
+    return now;
 }
 
-static int collect_poll(option_t *opt, int nb_server, server_t *servers)
+static int collect_poll(option_t *opt, int nb_server, server_t *servers, int nb_bus, bus_t *buses)
 {
     int rc;
     int i;
-    int n;
-    uint16_t tab_reg[MODBUS_MAX_READ_REGISTERS];
-    /* Local unix socket to output */
-    int output_socket = -1;
+    poll_cycle_t cycle;
+    GThreadPool *pool = NULL;
+    sched_t *sched;
+    chrono_stats_t jitter;
+    gint64 now;
+    gint64 real_now;
+    int nb_open = 0;
+    int status = 0;
+    uint32_t to_sec;
+    uint32_t to_usec;
+    gint64 last_report;
+
+    cycle.opt = opt;
+    cycle.pending = 0;
+    output_init(&cycle.output, opt);
+    cycle.queue = opt->queue_size > 0 ? output_queue_new(opt) : NULL;
+    cycle.timestamp = 0;
+    g_mutex_init(&cycle.mutex);
+    g_cond_init(&cycle.cond);
+
+    sched = sched_new();
+    chrono_stats_init(&jitter);
+    now = chrono_monotonic_us();
+    real_now = g_get_real_time();
+
+    /* Merge the address entries of each server in the fewest requests */
+    for (i = 0; i < nb_server; i++) {
+        server_t *server = &(servers[i]);
+        int gap = server->gap == -1 ? opt->gap : server->gap;
+        int *intervals = g_new(int, MAX(server->n, 1));
+        int n;
+        int r;
+
+        /* Interval of the address, else of the server, else of settings */
+        for (n = 0; n < server->n; n++) {
+            if (server->intervals != NULL && server->intervals[n] > 0) {
+                intervals[n] = server->intervals[n];
+            } else if (server->interval > 0) {
+                intervals[n] = server->interval;
+            } else {
+                intervals[n] = opt->interval;
+            }
+        }
+
+        /* Outstanding requests are only handled in TCP */
+        if (opt->backend != OPT_BACKEND_TCP) {
+            server->pipeline = 1;
+        } else if (server->pipeline == -1) {
+            server->pipeline = opt->pipeline;
+        }
+        server->pipeline = CLAMP(server->pipeline, 1, PIPELINE_MAX_DEPTH);
+        server->tid = 0;
+        server->pipeline_losses = 0;
+        server->pipeline_retry = 0;
+
+        rbe_free(server->rbe);
+        server->rbe = NULL;
+        if (opt->rbe) {
+            double deadband = 0;
+            gboolean percent = FALSE;
+            int heartbeat = server->heartbeat == -1 ? opt->heartbeat : server->heartbeat;
+
+            if (!rbe_parse_deadband(server->deadband, &deadband, &percent))
+                rbe_parse_deadband(opt->deadband, &deadband, &percent);
+            server->rbe = rbe_new(server->n, server->lengths, deadband, percent, heartbeat);
+        }
+
+        /* Names and types are formatted once */
+        keyfile_server_free_prefixes(server);
+        server->output_types = g_new(output_type_t, MAX(server->n, 1));
+        server->prefixes = g_new(output_prefixes_t *, MAX(server->n, 1));
+        for (n = 0; n < server->n; n++) {
+            server->output_types[n] = output_get_type(server->types != NULL ? server->types[n] : NULL);
+            server->prefixes[n] = output_prefixes_new(i, server->name, server->addresses[n], server->lengths[n]);
+        }
+
+        plan_free(server->plan);
+        server->plan = plan_new(server->n, server->addresses, server->lengths, intervals, gap,
+                                MODBUS_MAX_READ_REGISTERS);
+        g_free(intervals);
+
+        for (r = 0; r < server->plan->nb_read; r++) {
+            gint64 interval = (gint64)server->plan->reads[r].interval * 1000;
+            sched_add(sched, collect_poll_first_due(opt, now, real_now, interval), interval, server, r);
+        }
+    }
 
     if (opt->backend == OPT_BACKEND_RTU) {
-        ctx = modbus_new_rtu(opt->device, opt->baud, opt->parity[0], opt->data_bit, opt->stop_bit);
-        if (ctx == NULL) {
-            g_warning("modbus_new_rtu: %s", modbus_strerror(errno));
-            return -1;
+        /* Also the slaves of the lines which can't be opened, they are
+           reported */
+        for (i = 0; i < nb_server; i++) {
+            health_init(&(servers[i].health));
+            servers[i].connected = FALSE;
         }
 
-        modbus_set_debug(ctx, opt->verbose);
+        /* Open each serial line with its slaves, settings are the default */
+        for (i = 0; i < nb_bus; i++) {
+            bus_t *bus = &(buses[i]);
+            int s;
 
-        rc = modbus_connect(ctx);
-        if (rc == -1) {
-            g_warning("modbus_connect: %s", modbus_strerror(errno));
-            return -1;
+            bus->ctx = NULL;
+            if (bus->nb_slave == 0)
+                continue;
+
+            bus->ctx = modbus_new_rtu(bus->device ? bus->device : opt->device,
+                                      bus->baud != -1 ? bus->baud : opt->baud,
+                                      bus->parity ? bus->parity[0] : opt->parity[0],
+                                      bus->data_bit != -1 ? bus->data_bit : opt->data_bit,
+                                      bus->stop_bit != -1 ? bus->stop_bit : opt->stop_bit);
+            if (bus->ctx == NULL) {
+                g_warning("modbus_new_rtu: %s", modbus_strerror(errno));
+                continue;
+            }
+
+            modbus_set_debug(bus->ctx, opt->verbose);
+
+            rc = modbus_connect(bus->ctx);
+            if (rc == -1) {
+                g_warning("modbus_connect of bus %s: %s", bus->name, modbus_strerror(errno));
+                modbus_free(bus->ctx);
+                bus->ctx = NULL;
+                continue;
+            }
+            nb_open++;
+
+            modbus_get_response_timeout(bus->ctx, &to_sec, &to_usec);
+            bus->max_timeout = (gint64)to_sec * G_USEC_PER_SEC + to_usec;
+
+            /* The line is open */
+            for (s = 0; s < bus->nb_slave; s++) {
+                bus->slaves[s]->connected = TRUE;
+                bus->slaves[s]->health.max_timeout = bus->max_timeout;
+            }
+        }
+
+        if (nb_open == 0) {
+            g_warning("No serial line can be opened");
+            status = -1;
+            goto end;
+        }
+
+        /* A dedicated thread per serial line */
+        pool = g_thread_pool_new(collect_poll_bus_job, &cycle, MAX(nb_bus, 1), TRUE, NULL);
+        if (pool == NULL) {
+            g_warning("Unable to create the threads of %d buses", nb_bus);
+            status = -1;
+            goto end;
         }
     } else {
-        /* TCP */
+        /* TCP, the contexts not created are not closed */
+        for (i = 0; i < nb_server; i++) {
+            servers[i].ctx = NULL;
+            conn_init(&(servers[i].conn));
+        }
+
         for (i = 0; i < nb_server; i++) {
             server_t *server = &(servers[i]);
             server->ctx = modbus_new_tcp(server->ip, server->port);
             if (server->ctx == NULL) {
                 g_warning("modbus_new_tcp: %s", modbus_strerror(errno));
-                return -1;
+                status = -1;
+                goto end;
             }
 
             modbus_set_debug(server->ctx, opt->verbose);
@@ -281,106 +1172,182 @@ static int collect_poll(option_t *opt, int nb_server, server_t *servers)
                 modbus_set_slave(server->ctx, server->id);
             }
 
-            rc = modbus_connect(server->ctx);
-            server->connected = (rc == 0);
-            if (rc == -1) {
-                g_warning("modbus_connect: %s", modbus_strerror(errno));
-                /* but continue */
-            }
+            /* Connected in background by collect_poll_connect() */
+            server->connected = FALSE;
+        }
+
+        /* Servers are polled concurrently by a bounded pool of threads so
+           a slow server doesn't delay the others */
+        pool = g_thread_pool_new(collect_poll_job, &cycle, MIN(opt->threads, MAX(nb_server, 1)), FALSE, NULL);
+        if (pool == NULL) {
+            g_warning("Unable to create the pool of %d threads", opt->threads);
+            status = -1;
+            goto end;
         }
     }
 
+    last_report = chrono_monotonic_us();
     while (!stop) {
-        GTimeVal tv;
-        int delta;
+        sched_item_t item;
+        int nb_due;
+        gint64 deadline;
 
-        g_get_current_time(&tv);
-        /* Seconds until the next multiple of RECORDING_INTERVAL */
-        delta = (((tv.tv_sec / opt->interval) + 1) * opt->interval) - tv.tv_sec;
-        if (opt->verbose) {
-            g_print("Going to sleep for %d seconds...\n", delta);
+        if (opt->backend == OPT_BACKEND_TCP)
+            collect_poll_connect(opt, nb_server, servers);
+
+        now = chrono_monotonic_us();
+        deadline = sched_next_due(sched);
+        if (deadline == -1) {
+            deadline = now + (gint64)opt->interval * 1000;
         }
 
-        rc = usleep(delta * 1000000);
-        if (rc == -1) {
-            g_warning("usleep has been interrupted\n");
+        if (deadline > now) {
+            if (opt->verbose) {
+                g_print("Going to sleep for %" G_GINT64_FORMAT " ms...\n", (deadline - now) / 1000);
+            }
+
+            rc = chrono_sleep_until(deadline);
+            if (rc == -1) {
+                /* Interrupted by a signal, check stop and go back to sleep */
+                continue;
+            }
         }
 
+        /* Start jitter of the cycle */
+        now = chrono_monotonic_us();
+        chrono_stats_add(&jitter, now - deadline);
+        cycle.timestamp = g_get_real_time();
+
         if (opt->verbose) {
             g_print("Wake up: ");
             print_date_time();
-            g_print("\n");
+            g_print(" (jitter %" G_GINT64_FORMAT " us)\n", now - deadline);
         }
 
-        for (i = 0; i < nb_server; i++) {
-            server_t *server = &(servers[i]);
+        /* Dispatch only the reads due on this tick */
+        while (sched_pop_due(sched, now, &item)) {
+            server_t *server = item.data;
+            server->plan->reads[item.index].due = TRUE;
+        }
 
-            if (opt->backend == OPT_BACKEND_RTU) {
-                rc = modbus_set_slave(ctx, server->id);
-                if (rc != 0) {
-                    g_warning("modbus_set_slave with ID %d: %s\n", server->id, modbus_strerror(errno));
-                    continue;
+        if (opt->backend == OPT_BACKEND_TCP) {
+            /* Complete the connections established while sleeping and skip
+               the servers still not connected */
+            collect_poll_connect(opt, nb_server, servers);
+            for (i = 0; i < nb_server; i++) {
+                server_t *server = &(servers[i]);
+
+                if (!server->connected && plan_is_due(server->plan)) {
+                    if (opt->verbose) {
+                        g_print("Skip %s, not connected\n", server->name);
+                    }
+                    plan_clear_due(server->plan);
                 }
-            } else {
-                /* Set current context in TCP */
-                ctx = server->ctx;
             }
+        }
 
-            if (!server->connected) {
-                rc = modbus_connect(ctx);
-                server->connected = (rc == 0);
-                if (rc == -1) {
-                    g_warning("modbus_connect: %s", modbus_strerror(errno));
-                }
+        /* Dispatch the due servers or buses then wait for the end of the cycle */
+        nb_due = 0;
+        if (opt->backend == OPT_BACKEND_RTU) {
+            for (i = 0; i < nb_bus; i++) {
+                if (collect_poll_bus_is_due(&(buses[i])))
+                    nb_due++;
+            }
+        } else {
+            for (i = 0; i < nb_server; i++) {
+                if (plan_is_due(servers[i].plan))
+                    nb_due++;
             }
+        }
 
-            for (n = 0; n < server->n && server->connected; n++) {
-                if (opt->verbose) {
-                    g_print("Name: %s, addr:%d l:%d\n", server->name, server->addresses[n], server->lengths[n]);
-                }
+        g_mutex_lock(&cycle.mutex);
+        cycle.pending = nb_due;
+        g_mutex_unlock(&cycle.mutex);
 
-                rc = modbus_read_registers(ctx, server->addresses[n], server->lengths[n], tab_reg);
-                if (rc == -1) {
-                    g_warning("Name: %s, addr:%d l:%d %s\n", server->name, server->addresses[n], server->lengths[n],
-                              modbus_strerror(errno));
-                    if (errno == EBADF || errno == ECONNRESET || errno == EPIPE) {
-                        modbus_close(ctx);
-                        server->connected = FALSE;
-                        /* Skip this server in this iteration */
-                    }
-                    /* Else MODBUS_ERROR_RECOVERY_PROTOCOL has already flushed the data, good! */
-                } else {
-                    /* Write to local unix socket */
-                    if (!output_is_connected(output_socket))
-                        output_socket = output_connect(opt->socket_file, opt->verbose);
-
-                    if (output_is_connected(output_socket)) {
-                        rc = output_write(output_socket, opt, server->name, server->addresses[n],
-                                          server->lengths[n], server->types[n], tab_reg, opt->verbose);
-                        if (rc == -1) {
-                            output_close(&output_socket);
-                        }
-                    }
+        if (opt->backend == OPT_BACKEND_RTU) {
+            for (i = 0; i < nb_bus; i++) {
+                if (collect_poll_bus_is_due(&(buses[i])))
+                    g_thread_pool_push(pool, &(buses[i]), NULL);
+            }
+        } else {
+            for (i = 0; i < nb_server; i++) {
+                if (plan_is_due(servers[i].plan))
+                    g_thread_pool_push(pool, &(servers[i]), NULL);
+            }
+        }
+
+        g_mutex_lock(&cycle.mutex);
+        while (cycle.pending > 0)
+            g_cond_wait(&cycle.cond, &cycle.mutex);
+
+        /* Send the records of the cycle at once */
+        if (cycle.queue != NULL)
+            output_queue_end_cycle(cycle.queue, cycle.timestamp);
+        else
+            output_flush(&cycle.output, opt, TRUE, cycle.timestamp);
+        g_mutex_unlock(&cycle.mutex);
+
+        /* Reads of the slaves of a closed bus are lost */
+        for (i = 0; i < nb_server; i++) {
+            plan_clear_due(servers[i].plan);
+        }
+
+        now = chrono_monotonic_us();
+        if (opt->report > 0 && now - last_report >= (gint64)opt->report * 1000) {
+            if (opt->backend == OPT_BACKEND_RTU) {
+                for (i = 0; i < nb_server; i++) {
+                    health_report(&(servers[i].health), servers[i].name, now - last_report);
                 }
             }
+            if (cycle.queue != NULL)
+                output_queue_report(cycle.queue);
+            else
+                output_report(&cycle.output);
+            last_report = now;
         }
     }
 
-    output_close(&output_socket);
+end:
+    /* The queue thread is stopped on errors too */
+    if (pool != NULL)
+        g_thread_pool_free(pool, FALSE, TRUE);
+    if (cycle.queue != NULL) {
+        if (opt->verbose)
+            output_queue_report(cycle.queue);
+        output_queue_free(cycle.queue);
+    }
+    output_clear(&cycle.output);
 
     if (opt->backend == OPT_BACKEND_RTU) {
-        modbus_close(ctx);
-        modbus_free(ctx);
+        for (i = 0; i < nb_bus; i++) {
+            if (buses[i].ctx != NULL) {
+                modbus_close(buses[i].ctx);
+                modbus_free(buses[i].ctx);
+                buses[i].ctx = NULL;
+            }
+        }
     } else {
         /* TCP */
         for (i = 0; i < nb_server; i++) {
             server_t *server = &(servers[i]);
-            modbus_close(server->ctx);
-            modbus_free(server->ctx);
+            conn_close(&(server->conn));
+            if (server->ctx != NULL) {
+                modbus_close(server->ctx);
+                modbus_free(server->ctx);
+                server->ctx = NULL;
+            }
         }
     }
 
-    return 0;
+    /* Not only in verbose mode */
+    if (jitter.count > 0)
+        chrono_stats_print(&jitter, "Start jitter of cycles");
+
+    sched_free(sched);
+    g_mutex_clear(&cycle.mutex);
+    g_cond_clear(&cycle.cond);
+
+    return status;
 }
 
 int main(int argc, char *argv[])
@@ -389,6 +1356,8 @@ int main(int argc, char *argv[])
     option_t *opt = NULL;
     int nb_server = 0;
     server_t *servers = NULL;
+    int nb_bus = 0;
+    bus_t *buses = NULL;
 
 reload:
     /* Parse command line options */
@@ -396,7 +1365,7 @@ reload:
     option_parse(opt, argc, argv);
 
     /* Parse .ini file */
-    servers = keyfile_parse(opt, &nb_server);
+    servers = keyfile_parse(opt, &nb_server, &buses, &nb_bus);
 
     option_set_undefined(opt);
 
@@ -437,7 +1406,7 @@ reload:
             break;
         case OPT_MODE_MASTER:
         case OPT_MODE_CLIENT:
-            collect_poll(opt, nb_server, servers);
+            collect_poll(opt, nb_server, servers, nb_bus, buses);
             break;
         default:
             break;
@@ -448,6 +1417,7 @@ reload:
     }
 
     keyfile_server_free(nb_server, servers);
+    keyfile_bus_free(nb_bus, buses);
     option_free(opt);
 
     if (reload) {
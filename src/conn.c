@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <glib.h>
+
+#include "conn.h"
+
+void conn_init(conn_t *conn)
+{
+    conn->state = CONN_DISCONNECTED;
+    conn->fd = -1;
+    conn->backoff = CONN_BACKOFF_MIN;
+    /* First attempt as soon as possible */
+    conn->deadline = 0;
+}
+
+/* Start a non-blocking connection if the next attempt is due. Returns -1 on
+   immediate failure. */
+int conn_start(conn_t *conn, const char *ip, int port, gint64 now, gint64 timeout)
+{
+    struct sockaddr_in addr;
+    int flag = 1;
+    int rc;
+
+    if (conn->state != CONN_DISCONNECTED || now < conn->deadline)
+        return 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &(addr.sin_addr)) != 1) {
+        g_warning("Invalid IP address %s", ip);
+        conn_failed(conn, now);
+        return -1;
+    }
+
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd == -1) {
+        g_warning("socket: %s", strerror(errno));
+        conn_failed(conn, now);
+        return -1;
+    }
+
+    /* Same as libmodbus, disable Nagle's algorithm */
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    rc = connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (rc == -1 && errno != EINPROGRESS) {
+        g_warning("connect to %s:%d: %s", ip, port, strerror(errno));
+        conn_failed(conn, now);
+        return -1;
+    }
+
+    conn->state = CONN_CONNECTING;
+    conn->deadline = now + timeout;
+
+    return 0;
+}
+
+/* Check without blocking if the connection in progress is established.
+   Returns the socket once connected (in blocking mode for libmodbus), -1
+   otherwise. */
+int conn_check(conn_t *conn, gint64 now)
+{
+    struct pollfd pfd;
+    int error = 0;
+    socklen_t len = sizeof(error);
+    int fd;
+
+    if (conn->state != CONN_CONNECTING)
+        return -1;
+
+    pfd.fd = conn->fd;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, 0) != 1) {
+        if (now >= conn->deadline) {
+            errno = ETIMEDOUT;
+            conn_failed(conn, now);
+        }
+        return -1;
+    }
+
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+        errno = error;
+        conn_failed(conn, now);
+        return -1;
+    }
+
+    fd = conn->fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    conn->state = CONN_CONNECTED;
+    conn->backoff = CONN_BACKOFF_MIN;
+
+    return fd;
+}
+
+/* The connection has been established by the owner */
+void conn_established(conn_t *conn, int fd)
+{
+    conn->fd = fd;
+    conn->state = CONN_CONNECTED;
+    conn->backoff = CONN_BACKOFF_MIN;
+}
+
+/* Close the attempt and delay the next one with an exponential backoff. The
+   jitter spreads the attempts of servers which failed at the same time. */
+void conn_failed(conn_t *conn, gint64 now)
+{
+    int delay;
+
+    if (conn->state == CONN_CONNECTING && conn->fd != -1)
+        close(conn->fd);
+
+    conn->fd = -1;
+    conn->state = CONN_DISCONNECTED;
+
+    delay = conn->backoff / 2 + g_random_int_range(0, conn->backoff / 2 + 1);
+    conn->deadline = now + (gint64)delay * 1000;
+    conn->backoff = MIN(conn->backoff * 2, CONN_BACKOFF_MAX);
+}
+
+/* Abort the attempt in progress */
+void conn_close(conn_t *conn)
+{
+    if (conn->state == CONN_CONNECTING && conn->fd != -1)
+        close(conn->fd);
+
+    conn->fd = -1;
+    conn->state = CONN_DISCONNECTED;
+}
+
+/* The established connection has been lost (the socket is closed by its
+   owner), reconnect immediately then with backoff */
+void conn_reset(conn_t *conn, gint64 now)
+{
+    conn->fd = -1;
+    conn->state = CONN_DISCONNECTED;
+    conn->deadline = now;
+}
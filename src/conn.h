@@ -0,0 +1,35 @@
+#ifndef _CONN_H_
+#define _CONN_H_
+
+#include <glib.h>
+
+/* Delays between two connection attempts (ms) */
+#define CONN_BACKOFF_MIN 500
+#define CONN_BACKOFF_MAX 60000
+
+typedef enum {
+    CONN_DISCONNECTED,
+    CONN_CONNECTING,
+    CONN_CONNECTED
+} conn_state_t;
+
+/* Non-blocking connection to a TCP server, the state and the backoff are
+   also used by the connections made by their owner */
+typedef struct {
+    conn_state_t state;
+    int fd;
+    /* Current delay before the next attempt (ms) */
+    int backoff;
+    /* Time of the next attempt or end of the current one (us) */
+    gint64 deadline;
+} conn_t;
+
+void conn_init(conn_t *conn);
+int conn_start(conn_t *conn, const char *ip, int port, gint64 now, gint64 timeout);
+int conn_check(conn_t *conn, gint64 now);
+void conn_established(conn_t *conn, int fd);
+void conn_failed(conn_t *conn, gint64 now);
+void conn_reset(conn_t *conn, gint64 now);
+void conn_close(conn_t *conn);
+
+#endif /* _CONN_H_ */
@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "health.h"
+
+void health_init(health_t *health)
+{
+    health->state = HEALTH_CLOSED;
+    health->failures = 0;
+    health->max_timeout = 0;
+    health->probe = 0;
+    health->nb_samples = 0;
+    health->next_sample = 0;
+    health->busy = 0;
+    health->nb_requests = 0;
+    health->nb_timeouts = 0;
+    health->nb_errors = 0;
+    health->nb_skipped = 0;
+}
+
+/* Whether the slave can be polled now. An open breaker only lets a probe
+   through once its delay has elapsed. */
+gboolean health_allow(health_t *health, gint64 now)
+{
+    if (health->state == HEALTH_OPEN) {
+        if (now < health->probe) {
+            health->nb_skipped++;
+            return FALSE;
+        }
+        health->state = HEALTH_HALF_OPEN;
+    }
+
+    return TRUE;
+}
+
+static int health_compare(const void *a, const void *b)
+{
+    gint64 va = *(const gint64 *)a;
+    gint64 vb = *(const gint64 *)b;
+
+    return (va > vb) - (va < vb);
+}
+
+/* Response timeout of a read of nb registers learnt from the slave: twice the
+   95th percentile of the last response times, bounded by the configured
+   timeout. The times of the smaller reads are scaled up to the size of this
+   one. */
+gint64 health_timeout(health_t *health, int nb)
+{
+    gint64 sorted[HEALTH_NB_SAMPLES];
+    gint64 p95;
+    int i;
+
+    if (health->nb_samples < HEALTH_MIN_SAMPLES || health->state != HEALTH_CLOSED)
+        return health->max_timeout;
+
+    for (i = 0; i < health->nb_samples; i++) {
+        sorted[i] = health->samples[i];
+        if (health->sizes[i] < nb)
+            sorted[i] = sorted[i] * HEALTH_READ_BYTES(nb) / HEALTH_READ_BYTES(health->sizes[i]);
+    }
+    qsort(sorted, health->nb_samples, sizeof(gint64), health_compare);
+    p95 = sorted[(health->nb_samples * 95) / 100];
+
+    return CLAMP(p95 * 2, HEALTH_MIN_TIMEOUT, health->max_timeout);
+}
+
+static void health_add_sample(health_t *health, int nb, gint64 elapsed)
+{
+    health->samples[health->next_sample] = elapsed;
+    health->sizes[health->next_sample] = nb;
+    health->next_sample = (health->next_sample + 1) % HEALTH_NB_SAMPLES;
+    if (health->nb_samples < HEALTH_NB_SAMPLES)
+        health->nb_samples++;
+}
+
+/* The slave has answered a read of nb registers, with the values or an
+   exception */
+void health_success(health_t *health, int nb, gint64 elapsed)
+{
+    health_add_sample(health, nb, elapsed);
+
+    health->busy += elapsed;
+    health->nb_requests++;
+    health->failures = 0;
+    health->state = HEALTH_CLOSED;
+}
+
+/* The slave hasn't answered ('timeout') or with an invalid frame, the breaker
+   opens after 'threshold' consecutive failures (never if 0) or on a failed
+   probe. A timeout is kept as a response time so the timeout grows back when
+   the slave has become slower. */
+void health_failure(health_t *health, gboolean timeout, int nb, gint64 elapsed, gint64 now, int threshold,
+                    gint64 probe_interval)
+{
+    health->busy += elapsed;
+    health->nb_requests++;
+    if (timeout) {
+        health_add_sample(health, nb, elapsed);
+        health->nb_timeouts++;
+    } else {
+        health->nb_errors++;
+    }
+    health->failures++;
+
+    if (health->state == HEALTH_HALF_OPEN || (threshold > 0 && health->failures >= threshold)) {
+        health->state = HEALTH_OPEN;
+        health->probe = now + probe_interval;
+    }
+}
+
+/* Print the occupancy of the bus by the slave over the period (us) and
+   reset the counters */
+void health_report(health_t *health, const char *name, gint64 period)
+{
+    static const char *states[] = {"closed", "open", "half-open"};
+
+    g_print("Slave %s: bus occupancy %.1f%%, %u requests, %u timeouts, %u errors, %u skipped, breaker %s\n",
+            name, period > 0 ? (100.0 * health->busy) / period : 0.0, health->nb_requests,
+            health->nb_timeouts, health->nb_errors, health->nb_skipped, states[health->state]);
+
+    health->busy = 0;
+    health->nb_requests = 0;
+    health->nb_timeouts = 0;
+    health->nb_errors = 0;
+    health->nb_skipped = 0;
+}
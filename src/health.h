@@ -0,0 +1,54 @@
+#ifndef _HEALTH_H_
+#define _HEALTH_H_
+
+#include <glib.h>
+
+/* Number of response times kept to compute the timeout */
+#define HEALTH_NB_SAMPLES 32
+/* Min number of samples to adapt the timeout */
+#define HEALTH_MIN_SAMPLES 8
+/* Lower bound of the adaptive timeout (us) */
+#define HEALTH_MIN_TIMEOUT 50000
+/* Bytes on the line of a RTU read of nb registers (request and response) */
+#define HEALTH_READ_BYTES(nb) (13 + 2 * (nb))
+
+typedef enum {
+    /* The slave answers, all requests are sent */
+    HEALTH_CLOSED,
+    /* The slave is considered dead, requests are skipped until the next probe */
+    HEALTH_OPEN,
+    /* A single request is sent to probe the slave */
+    HEALTH_HALF_OPEN
+} health_state_t;
+
+/* Circuit breaker and statistics of a slave on a shared bus */
+typedef struct {
+    health_state_t state;
+    /* Number of consecutive timeouts or invalid frames */
+    int failures;
+    /* Configured response timeout, bound of the adaptive one (us) */
+    gint64 max_timeout;
+    /* Time of the next probe when open (us) */
+    gint64 probe;
+    /* Last response times (us) and number of registers of these reads */
+    gint64 samples[HEALTH_NB_SAMPLES];
+    int sizes[HEALTH_NB_SAMPLES];
+    int nb_samples;
+    int next_sample;
+    /* Time spent on the bus (us) and counters since the last report */
+    gint64 busy;
+    guint nb_requests;
+    guint nb_timeouts;
+    guint nb_errors;
+    guint nb_skipped;
+} health_t;
+
+void health_init(health_t *health);
+gboolean health_allow(health_t *health, gint64 now);
+gint64 health_timeout(health_t *health, int nb);
+void health_success(health_t *health, int nb, gint64 elapsed);
+void health_failure(health_t *health, gboolean timeout, int nb, gint64 elapsed, gint64 now, int threshold,
+                    gint64 probe_interval);
+void health_report(health_t *health, const char *name, gint64 period);
+
+#endif /* _HEALTH_H_ */
@@ -4,15 +4,25 @@
 #include "keyfile.h"
 
 static gboolean keyfile_set_integer(GKeyFile *key_file, const gchar *group_name, const gchar *key, int *value);
-
-/* Parse config file (.ini-like file) */
-server_t* keyfile_parse(option_t *opt, int *nb_server)
+static int keyfile_get_interval(GKeyFile *key_file, const gchar *group_name, const gchar *key);
+static int keyfile_get_timeout(GKeyFile *key_file, const gchar *group_name, const gchar *key);
+static int* keyfile_get_interval_list(GKeyFile *key_file, const gchar *group_name, const gchar *key,
+                                      gsize *length);
+static bus_t* keyfile_parse_buses(GKeyFile *key_file, gchar **groups, int *nb_bus);
+static int keyfile_find_bus(bus_t *buses, int nb_bus, const char *name);
+static void keyfile_parse_sinks(GKeyFile *key_file, option_t *opt);
+
+/* Parse config file (.ini-like file). The serial buses are only defined in
+   master mode. */
+server_t* keyfile_parse(option_t *opt, int *nb_server, bus_t **buses, int *nb_bus)
 {
     int i;
     GKeyFile *key_file = NULL;
     server_t* servers = NULL;
 
     *nb_server = 0;
+    *buses = NULL;
+    *nb_bus = 0;
 
     if (opt->ini_file == NULL) {
         return NULL;
@@ -46,16 +56,96 @@ server_t* keyfile_parse(option_t *opt, int *nb_server)
 
     keyfile_set_integer(key_file, "settings", "databit", &(opt->data_bit));
     keyfile_set_integer(key_file, "settings", "stopbit", &(opt->stop_bit));
-    keyfile_set_integer(key_file, "settings", "interval", &(opt->interval));
+    if (opt->interval == -1)
+        opt->interval = keyfile_get_interval(key_file, "settings", "interval");
+
+    if (g_key_file_has_key(key_file, "settings", "align", NULL))
+        opt->align = g_key_file_get_boolean(key_file, "settings", "align", NULL);
+    keyfile_set_integer(key_file, "settings", "threads", &(opt->threads));
+    keyfile_set_integer(key_file, "settings", "gap", &(opt->gap));
+    keyfile_set_integer(key_file, "settings", "pipeline", &(opt->pipeline));
+
+    if (opt->rbe == FALSE)
+        opt->rbe = g_key_file_get_boolean(key_file, "settings", "rbe", NULL);
+
+    if (opt->deadband == NULL)
+        opt->deadband = g_key_file_get_string(key_file, "settings", "deadband", NULL);
+
+    if (opt->flush_window == -1)
+        opt->flush_window = keyfile_get_interval(key_file, "settings", "flushwindow");
+    keyfile_set_integer(key_file, "settings", "flushcount", &(opt->flush_count));
+
+    if (opt->coils == NULL)
+        opt->coils = g_key_file_get_string(key_file, "settings", "coils", NULL);
+    if (opt->discrete_inputs == NULL)
+        opt->discrete_inputs = g_key_file_get_string(key_file, "settings", "discreteinputs", NULL);
+    if (opt->holding_registers == NULL)
+        opt->holding_registers = g_key_file_get_string(key_file, "settings", "holdingregisters", NULL);
+    if (opt->input_registers == NULL)
+        opt->input_registers = g_key_file_get_string(key_file, "settings", "inputregisters", NULL);
+
+    keyfile_set_integer(key_file, "settings", "heartbeat", &(opt->heartbeat));
+
+    if (opt->breaker == -1 && g_key_file_has_key(key_file, "settings", "breaker", NULL))
+        opt->breaker = g_key_file_get_integer(key_file, "settings", "breaker", NULL);
+
+    if (opt->probe == -1)
+        opt->probe = keyfile_get_interval(key_file, "settings", "probe");
+
+    if (opt->report == -1 && g_key_file_has_key(key_file, "settings", "report", NULL)) {
+        char *report_string = g_key_file_get_string(key_file, "settings", "report", NULL);
+        /* 0 disables the reports */
+        opt->report = (strcmp(report_string, "0") == 0) ? 0 : option_parse_interval(report_string);
+        g_free(report_string);
+    }
 
     if (opt->ip == NULL)
         opt->ip = g_key_file_get_string(key_file, "settings", "ip", NULL);
 
     keyfile_set_integer(key_file, "settings", "port", &(opt->port));
+    keyfile_set_integer(key_file, "settings", "backlog", &(opt->backlog));
+    keyfile_set_integer(key_file, "settings", "maxconnections", &(opt->max_connections));
+    keyfile_set_integer(key_file, "settings", "workers", &(opt->workers));
+
+    if (opt->idle_timeout == -1)
+        opt->idle_timeout = keyfile_get_timeout(key_file, "settings", "idletimeout");
 
     if (opt->socket_file == NULL)
         opt->socket_file = g_key_file_get_string(key_file, "settings", "socketfile", NULL);
 
+    if (opt->shm_file == NULL)
+        opt->shm_file = g_key_file_get_string(key_file, "settings", "shmfile", NULL);
+
+    if (opt->protocol == OPT_PROTOCOL_UNDEFINED) {
+        char *protocol_string = g_key_file_get_string(key_file, "settings", "protocol", NULL);
+        opt->protocol = option_parse_protocol(protocol_string);
+        g_free(protocol_string);
+    }
+
+    keyfile_set_integer(key_file, "settings", "outputbytes", &(opt->output_bytes));
+    if (opt->output_latency == -1)
+        opt->output_latency = keyfile_get_timeout(key_file, "settings", "outputlatency");
+    if (opt->cycle_marker == FALSE)
+        opt->cycle_marker = g_key_file_get_boolean(key_file, "settings", "cyclemarker", NULL);
+
+    /* 0 disables the queue */
+    if (opt->queue_size == -1 && g_key_file_has_key(key_file, "settings", "queue", NULL))
+        opt->queue_size = g_key_file_get_integer(key_file, "settings", "queue", NULL);
+    if (opt->overflow == OPT_OVERFLOW_UNDEFINED) {
+        char *overflow_string = g_key_file_get_string(key_file, "settings", "overflow", NULL);
+        opt->overflow = option_parse_overflow(overflow_string);
+        g_free(overflow_string);
+    }
+
+    if (opt->spool_dir == NULL)
+        opt->spool_dir = g_key_file_get_string(key_file, "settings", "spooldir", NULL);
+    keyfile_set_integer(key_file, "settings", "spoolsize", &(opt->spool_size));
+    if (opt->spool_age == -1)
+        opt->spool_age = keyfile_get_timeout(key_file, "settings", "spoolage");
+    keyfile_set_integer(key_file, "settings", "spoolrate", &(opt->spool_rate));
+    keyfile_set_integer(key_file, "settings", "sinkbuffer", &(opt->sink_buffer));
+    keyfile_parse_sinks(key_file, opt);
+
     if (opt->daemon == FALSE)
         opt->daemon = g_key_file_get_boolean(key_file, "settings", "daemon", NULL);
 
@@ -82,6 +172,10 @@ server_t* keyfile_parse(option_t *opt, int *nb_server)
             section_length = SERVER_LENGTH;
         }
 
+        if (opt->mode == OPT_MODE_MASTER) {
+            *buses = keyfile_parse_buses(key_file, groups, nb_bus);
+        }
+
         /* Count [slave] sections to allocate servers */
         i = 0;
         while (groups[i] != NULL) {
@@ -105,10 +199,26 @@ server_t* keyfile_parse(option_t *opt, int *nb_server)
                     gsize n_address;
                     gsize n_length;
                     gsize n_types;
+                    gsize n_intervals;
 
                     /* Returns 0 if not found. The slave ID can be set in TCP client mode too. */
                     servers[c].id = g_key_file_get_integer(key_file, groups[i], "id", NULL);
 
+                    servers[c].bus = 0;
+                    if (opt->mode == OPT_MODE_MASTER) {
+                        char *bus_name = g_key_file_get_string(key_file, groups[i], "bus", NULL);
+                        bus_t *bus;
+
+                        if (bus_name != NULL) {
+                            servers[c].bus = keyfile_find_bus(*buses, *nb_bus, bus_name);
+                            g_free(bus_name);
+                        }
+
+                        bus = &((*buses)[servers[c].bus]);
+                        bus->slaves = g_renew(server_t*, bus->slaves, bus->nb_slave + 1);
+                        bus->slaves[bus->nb_slave++] = &(servers[c]);
+                    }
+
                     if (opt->mode == OPT_MODE_CLIENT) {
                         servers[c].ip = g_key_file_get_string(key_file, groups[i], "ip", NULL);
                         if (servers[c].ip == NULL)
@@ -135,6 +245,10 @@ server_t* keyfile_parse(option_t *opt, int *nb_server)
                                                                      &n_length, NULL);
                     /* Types are optional (integer by default) but it's all or nothing */
                     servers[c].types = g_key_file_get_string_list(key_file, groups[i], "types", &n_types, NULL);
+                    /* Intervals are optional too (interval of the section by default) */
+                    servers[c].interval = keyfile_get_interval(key_file, groups[i], "interval");
+                    servers[c].intervals = keyfile_get_interval_list(key_file, groups[i], "intervals",
+                                                                     &n_intervals);
 
                     /* Check list to be sure each address is associated to a length */
                     if (n_address != n_length) {
@@ -145,10 +259,39 @@ server_t* keyfile_parse(option_t *opt, int *nb_server)
                         g_error("Not same number of addresses (%zd) and types (%zd)", n_address, n_length);
                     }
 
+                    if (servers[c].intervals != NULL && n_intervals != n_address) {
+                        g_error("Not same number of addresses (%zd) and intervals (%zd)", n_address, n_intervals);
+                    }
+
                     /* Used by TCP client */
                     servers[c].ctx = NULL;
                     servers[c].connected = FALSE;
 
+                    if (g_key_file_has_key(key_file, groups[i], "gap", NULL)) {
+                        servers[c].gap = g_key_file_get_integer(key_file, groups[i], "gap", NULL);
+                    } else {
+                        servers[c].gap = -1;
+                    }
+                    /* Built once all options are known */
+                    servers[c].plan = NULL;
+                    servers[c].output_types = NULL;
+                    servers[c].prefixes = NULL;
+
+                    /* Report by exception */
+                    servers[c].rbe = NULL;
+                    servers[c].deadband = g_key_file_get_string(key_file, groups[i], "deadband", NULL);
+                    if (g_key_file_has_key(key_file, groups[i], "heartbeat", NULL)) {
+                        servers[c].heartbeat = g_key_file_get_integer(key_file, groups[i], "heartbeat", NULL);
+                    } else {
+                        servers[c].heartbeat = -1;
+                    }
+
+                    if (g_key_file_has_key(key_file, groups[i], "pipeline", NULL)) {
+                        servers[c].pipeline = g_key_file_get_integer(key_file, groups[i], "pipeline", NULL);
+                    } else {
+                        servers[c].pipeline = -1;
+                    }
+
                     /* FIXME Check mutliple of two for float types */
 
                     servers[c].n = n_address;
@@ -181,6 +324,21 @@ server_t* keyfile_parse(option_t *opt, int *nb_server)
     return servers;
 }
 
+void keyfile_server_free_prefixes(server_t *server)
+{
+    int n;
+
+    if (server->prefixes != NULL) {
+        for (n = 0; n < server->n; n++) {
+            output_prefixes_free(server->prefixes[n]);
+        }
+    }
+    g_free(server->prefixes);
+    server->prefixes = NULL;
+    g_free(server->output_types);
+    server->output_types = NULL;
+}
+
 void keyfile_server_free(int nb_server, server_t* servers)
 {
     int i;
@@ -192,12 +350,132 @@ void keyfile_server_free(int nb_server, server_t* servers)
             g_free(servers[i].addresses);
             g_free(servers[i].lengths);
             g_strfreev(servers[i].types);
+            g_free(servers[i].intervals);
+            plan_free(servers[i].plan);
+            g_free(servers[i].deadband);
+            rbe_free(servers[i].rbe);
+            keyfile_server_free_prefixes(&(servers[i]));
             /* ctx is freed by the function which creates it */
         }
         g_slice_free1(sizeof(server_t) * nb_server, servers);
     }
 }
 
+void keyfile_bus_free(int nb_bus, bus_t *buses)
+{
+    int i;
+
+    if (nb_bus > 0) {
+        for (i = 0; i < nb_bus; i++) {
+            g_free(buses[i].name);
+            g_free(buses[i].device);
+            g_free(buses[i].parity);
+            g_free(buses[i].slaves);
+            /* ctx is freed by the function which creates it */
+        }
+        g_free(buses);
+    }
+}
+
+/* Parse the [bus "name"] sections of the serial lines. The first bus is the
+   line defined in settings. */
+static bus_t* keyfile_parse_buses(GKeyFile *key_file, gchar **groups, int *nb_bus)
+{
+    const char bus_name[] = "bus";
+    const size_t BUS_LENGTH = 3;
+    bus_t *buses;
+    int i;
+    int c;
+
+    *nb_bus = 1;
+    for (i = 0; groups[i] != NULL; i++) {
+        if (strncmp(groups[i], bus_name, BUS_LENGTH) == 0)
+            (*nb_bus)++;
+    }
+
+    buses = g_new0(bus_t, *nb_bus);
+    buses[0].name = g_strdup("settings");
+    buses[0].baud = -1;
+    buses[0].data_bit = -1;
+    buses[0].stop_bit = -1;
+
+    for (i = 0, c = 1; groups[i] != NULL; i++) {
+        bus_t *bus;
+
+        if (strncmp(groups[i], bus_name, BUS_LENGTH) != 0)
+            continue;
+
+        /* 'bus' + space + " + ... + " */
+        if (strlen(groups[i]) <= BUS_LENGTH + 3)
+            g_error("The section [%s] requires a name (eg. [bus \"port1\"])", groups[i]);
+
+        bus = &(buses[c++]);
+        bus->name = g_strndup(groups[i] + BUS_LENGTH + 2, strlen(groups[i]) - BUS_LENGTH - 3);
+        bus->device = g_key_file_get_string(key_file, groups[i], "device", NULL);
+        bus->parity = g_key_file_get_string(key_file, groups[i], "parity", NULL);
+        bus->baud = -1;
+        bus->data_bit = -1;
+        bus->stop_bit = -1;
+        keyfile_set_integer(key_file, groups[i], "baud", &(bus->baud));
+        keyfile_set_integer(key_file, groups[i], "databit", &(bus->data_bit));
+        keyfile_set_integer(key_file, groups[i], "stopbit", &(bus->stop_bit));
+    }
+
+    return buses;
+}
+
+/* Parse the [sink "name"] sections of the outputs, the recorder of the
+   settings is only used without sinks */
+static void keyfile_parse_sinks(GKeyFile *key_file, option_t *opt)
+{
+    const char sink_name[] = "sink";
+    const size_t SINK_LENGTH = 4;
+    gchar **groups = g_key_file_get_groups(key_file, NULL);
+    int i;
+
+    for (i = 0; groups[i] != NULL; i++) {
+        opt_sink_t *sink;
+        char *type_string;
+
+        if (strncmp(groups[i], sink_name, SINK_LENGTH) != 0)
+            continue;
+
+        /* 'sink' + space + " + ... + " */
+        if (strlen(groups[i]) <= SINK_LENGTH + 3)
+            g_error("The section [%s] requires a name (eg. [sink \"dashboard\"])", groups[i]);
+
+        opt->sinks = g_renew(opt_sink_t, opt->sinks, opt->nb_sink + 1);
+        sink = &(opt->sinks[opt->nb_sink++]);
+        sink->name = g_strndup(groups[i] + SINK_LENGTH + 2, strlen(groups[i]) - SINK_LENGTH - 3);
+
+        type_string = g_key_file_get_string(key_file, groups[i], "type", NULL);
+        sink->type = option_parse_sink_type(type_string);
+        if (sink->type == OPT_SINK_UNDEFINED)
+            sink->type = OPT_SINK_STREAM;
+        g_free(type_string);
+
+        sink->path = g_key_file_get_string(key_file, groups[i], "path", NULL);
+        if (sink->path == NULL)
+            g_error("The sink '%s' requires a path", sink->name);
+
+        sink->shm_file = g_key_file_get_string(key_file, groups[i], "shmfile", NULL);
+    }
+    g_strfreev(groups);
+}
+
+static int keyfile_find_bus(bus_t *buses, int nb_bus, const char *name)
+{
+    int i;
+
+    /* The first one can't be selected by name */
+    for (i = 1; i < nb_bus; i++) {
+        if (strcmp(buses[i].name, name) == 0)
+            return i;
+    }
+
+    g_error("Unknown bus '%s'", name);
+    return 0;
+}
 
 /* Set value from config file if defined and not already set by command line.
    Returns TRUE when value is modified, FALSE otherwise.
@@ -217,3 +495,49 @@ static gboolean keyfile_set_integer(GKeyFile *key_file, const gchar *group_name,
     }
     return FALSE;
 }
+
+/* Returns the interval in milliseconds or -1 if not defined */
+static int keyfile_get_interval(GKeyFile *key_file, const gchar *group_name, const gchar *key)
+{
+    char *interval_string = g_key_file_get_string(key_file, group_name, key, NULL);
+    int interval = option_parse_interval(interval_string);
+
+    g_free(interval_string);
+    return interval;
+}
+
+/* Same as keyfile_get_interval() but 0 (never) is accepted */
+static int keyfile_get_timeout(GKeyFile *key_file, const gchar *group_name, const gchar *key)
+{
+    char *timeout_string = g_key_file_get_string(key_file, group_name, key, NULL);
+    int timeout;
+    char *end;
+
+    if (timeout_string != NULL && g_ascii_strtod(timeout_string, &end) == 0 && end != timeout_string)
+        timeout = 0;
+    else
+        timeout = option_parse_interval(timeout_string);
+
+    g_free(timeout_string);
+    return timeout;
+}
+
+/* Returns the list of intervals in milliseconds or NULL if not defined */
+static int* keyfile_get_interval_list(GKeyFile *key_file, const gchar *group_name, const gchar *key,
+                                      gsize *length)
+{
+    gchar **list = g_key_file_get_string_list(key_file, group_name, key, length, NULL);
+    int *intervals;
+    gsize i;
+
+    if (list == NULL)
+        return NULL;
+
+    intervals = g_new(int, MAX(*length, 1));
+    for (i = 0; i < *length; i++) {
+        intervals[i] = option_parse_interval(list[i]);
+    }
+    g_strfreev(list);
+
+    return intervals;
+}
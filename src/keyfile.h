@@ -4,6 +4,11 @@
 #include <glib.h>
 #include <modbus.h>
 #include "option.h"
+#include "plan.h"
+#include "rbe.h"
+#include "conn.h"
+#include "health.h"
+#include "output.h"
 
 #define MBT_LOCAL_INI_FILE "mbcollect.ini"
 #define MBT_ETC_INI_FILE ("/etc/" MBT_LOCAL_INI_FILE)
@@ -27,11 +32,61 @@ typedef struct {
     int *lengths;
     /* List of data types (int, floatmsb, floatlsb) at each address */
     char **types;
+    /* Polling interval of the server in ms (-1 to use settings) */
+    int interval;
+    /* List of polling intervals in ms at each address (optional) */
+    int *intervals;
     /* Whether the server is connected */
     gboolean connected;
+    /* TCP - Non-blocking connection with backoff */
+    conn_t conn;
+    /* RTU - Circuit breaker and response times of the slave */
+    health_t health;
+    /* RTU - Index of the serial bus of the slave */
+    int bus;
+    /* Max number of unused registers read to merge two entries (-1 to use settings) */
+    int gap;
+    /* Coalesced reads of the address entries */
+    plan_t *plan;
+    /* TCP - Max number of outstanding requests (-1 to use settings) */
+    int pipeline;
+    /* TCP - Last transaction ID of pipelined requests */
+    uint16_t tid;
+    /* TCP - Consecutive timed out pipelined exchanges */
+    int pipeline_losses;
+    /* TCP - One request at a time until this time (us, monotonic) */
+    gint64 pipeline_retry;
+    /* Deadband of floats (NULL to use settings) */
+    char *deadband;
+    /* Heartbeat in number of polls (-1 to use settings) */
+    int heartbeat;
+    /* Last reported values when reporting by exception (NULL otherwise) */
+    rbe_t *rbe;
+    /* Output type and names of the registers at each address */
+    output_type_t *output_types;
+    output_prefixes_t **prefixes;
 } server_t;
 
-server_t* keyfile_parse(option_t *opt, int *nb_server);
+/* RTU - Serial line shared by slaves, the settings are used when not defined */
+typedef struct {
+    char *name;
+    char *device;
+    int baud;
+    char *parity;
+    int data_bit;
+    int stop_bit;
+    /* Modbus context of the line */
+    modbus_t *ctx;
+    /* Configured response timeout (us) */
+    gint64 max_timeout;
+    /* Slaves polled on this line */
+    int nb_slave;
+    server_t **slaves;
+} bus_t;
+
+server_t* keyfile_parse(option_t *opt, int *nb_server, bus_t **buses, int *nb_bus);
 void keyfile_server_free(int nb_server, server_t* servers);
+void keyfile_server_free_prefixes(server_t *server);
+void keyfile_bus_free(int nb_bus, bus_t *buses);
 
 #endif /* _KEYFILE_H_ */
@@ -1,4 +1,5 @@
 #include <string.h>
+#include <unistd.h>
 #include <glib.h>
 #include <config.h>
 
@@ -24,9 +25,43 @@ option_t* option_new(void)
     /* TCP */
     opt->ip = NULL;
     opt->port = -1;
+    opt->backlog = -1;
+    opt->max_connections = -1;
+    opt->idle_timeout = -1;
+    opt->workers = -1;
+    opt->flush_window = -1;
+    opt->flush_count = -1;
+    opt->coils = NULL;
+    opt->discrete_inputs = NULL;
+    opt->holding_registers = NULL;
+    opt->input_registers = NULL;
 
     opt->interval = -1;
+    opt->align = TRUE;
     opt->socket_file = NULL;
+    opt->shm_file = NULL;
+    opt->protocol = OPT_PROTOCOL_UNDEFINED;
+    opt->output_bytes = -1;
+    opt->output_latency = -1;
+    opt->cycle_marker = FALSE;
+    opt->queue_size = -1;
+    opt->spool_dir = NULL;
+    opt->spool_size = -1;
+    opt->spool_age = -1;
+    opt->spool_rate = -1;
+    opt->nb_sink = 0;
+    opt->sinks = NULL;
+    opt->sink_buffer = -1;
+    opt->overflow = OPT_OVERFLOW_UNDEFINED;
+    opt->threads = -1;
+    opt->gap = -1;
+    opt->pipeline = -1;
+    opt->rbe = FALSE;
+    opt->deadband = NULL;
+    opt->heartbeat = -1;
+    opt->breaker = -1;
+    opt->probe = -1;
+    opt->report = -1;
     opt->ini_file = NULL;
     opt->daemon = FALSE;
     opt->pid_file = NULL;
@@ -37,11 +72,26 @@ option_t* option_new(void)
 
 void option_free(option_t *opt)
 {
+    int i;
+
     g_free(opt->pid_file);
     g_free(opt->device);
     g_free(opt->parity);
     g_free(opt->ip);
     g_free(opt->socket_file);
+    g_free(opt->shm_file);
+    g_free(opt->spool_dir);
+    for (i = 0; i < opt->nb_sink; i++) {
+        g_free(opt->sinks[i].name);
+        g_free(opt->sinks[i].path);
+        g_free(opt->sinks[i].shm_file);
+    }
+    g_free(opt->sinks);
+    g_free(opt->deadband);
+    g_free(opt->coils);
+    g_free(opt->discrete_inputs);
+    g_free(opt->holding_registers);
+    g_free(opt->input_registers);
     g_free(opt->ini_file);
     g_slice_free(option_t, opt);
 }
@@ -53,6 +103,9 @@ void option_parse(option_t* opt, int argc, char **argv)
     int argc_copy;
     gchar **argv_copy = NULL;
     char *mode_string = NULL;
+    char *interval_string = NULL;
+    char *protocol_string = NULL;
+    char *overflow_string = NULL;
 
     GOptionContext *context;
     GError *error = NULL;
@@ -68,9 +121,47 @@ void option_parse(option_t* opt, int argc, char **argv)
         {"stopbit", 's', 0, G_OPTION_ARG_INT, &(opt->stop_bit), "Bits of stop (1 or 2)", "1"},
         {"ip", 0, 0, G_OPTION_ARG_STRING, &(opt->ip), "IP address of server (eg. 127.0.0.1)", NULL},
         {"port", 0, 0, G_OPTION_ARG_INT, &(opt->port), "Port number of server (eg. 1502)", NULL},
-        {"interval", 'i', 0, G_OPTION_ARG_INT, &(opt->interval), "Interval in seconds", NULL},
+        {"backlog", 0, 0, G_OPTION_ARG_INT, &(opt->backlog), "Max number of pending connections in server mode",
+         "32"},
+        {"maxconnections", 0, 0, G_OPTION_ARG_INT, &(opt->max_connections),
+         "Max number of connected clients in server mode (0 for no limit)", "0"},
+        {"workers", 'w', 0, G_OPTION_ARG_INT, &(opt->workers), "Number of threads in server mode (CPUs by default)",
+         "4"},
+        {"interval", 'i', 0, G_OPTION_ARG_STRING, &interval_string,
+         "Interval in seconds (eg. 10 or 0.5) or in milliseconds (eg. 100ms)", NULL},
         {"socketfile", 0, 0, G_OPTION_ARG_FILENAME, &(opt->socket_file),
          "Local Unix socket file (eg. /tmp/mbsocket)", NULL},
+        {"shmfile", 0, 0, G_OPTION_ARG_FILENAME, &(opt->shm_file),
+         "Shared memory ring of the recorder (eg. /dev/shm/mbring)", NULL},
+        {"protocol", 0, 0, G_OPTION_ARG_STRING, &protocol_string,
+         "Output 'text' (default) or 'binary' records to the socket", NULL},
+        {"outputbytes", 0, 0, G_OPTION_ARG_INT, &(opt->output_bytes),
+         "Send the records before the end of cycle when N bytes are buffered", "65536"},
+        {"cyclemarker", 0, 0, G_OPTION_ARG_NONE, &(opt->cycle_marker), "Send a marker at the end of each cycle",
+         NULL},
+        {"queue", 0, 0, G_OPTION_ARG_INT, &(opt->queue_size),
+         "Number of records queued for the output thread (0 to disable)", "1024"},
+        {"overflow", 0, 0, G_OPTION_ARG_STRING, &overflow_string,
+         "When the output queue is full 'block' (default), 'dropoldest' or 'conflate'", NULL},
+        {"spooldir", 0, 0, G_OPTION_ARG_FILENAME, &(opt->spool_dir),
+         "Directory of the records kept while the recorder is unavailable", NULL},
+        {"spoolsize", 0, 0, G_OPTION_ARG_INT, &(opt->spool_size), "Max size of the spool in MiB", "64"},
+        {"spoolrate", 0, 0, G_OPTION_ARG_INT, &(opt->spool_rate),
+         "Replay of the spool in bytes by second", "65536"},
+        {"sinkbuffer", 0, 0, G_OPTION_ARG_INT, &(opt->sink_buffer),
+         "Max bytes pending for a slow output sink", "4194304"},
+        {"threads", 't', 0, G_OPTION_ARG_INT, &(opt->threads), "Number of polling threads in client mode", "16"},
+        {"gap", 0, 0, G_OPTION_ARG_INT, &(opt->gap),
+         "Max number of unused registers read to merge two addresses in a single request", "0"},
+        {"pipeline", 0, 0, G_OPTION_ARG_INT, &(opt->pipeline),
+         "Max number of outstanding requests per connection in client mode", "1"},
+        {"rbe", 0, 0, G_OPTION_ARG_NONE, &(opt->rbe), "Report by exception, only output changed values", NULL},
+        {"deadband", 0, 0, G_OPTION_ARG_STRING, &(opt->deadband),
+         "Min change of floats to report, absolute or in percent", "0.5 or 2%"},
+        {"heartbeat", 0, 0, G_OPTION_ARG_INT, &(opt->heartbeat),
+         "Report unchanged values every N polls (0 to never)", "N"},
+        {"breaker", 0, 0, G_OPTION_ARG_INT, &(opt->breaker),
+         "Number of consecutive timeouts to stop polling a slave in master mode (0 to never)", "3"},
         {"inifile", 'f', 0, G_OPTION_ARG_FILENAME, &(opt->ini_file), "Filename of config file (.ini-like)", NULL},
         {"daemon", 0, 0, G_OPTION_ARG_NONE, &(opt->daemon), "Run in daemon mode", NULL},
         {"pidfile", 0, 0, G_OPTION_ARG_FILENAME, &(opt->pid_file), "File to save thee PID", "PIDFILE"},
@@ -101,6 +192,15 @@ void option_parse(option_t* opt, int argc, char **argv)
 
     g_free(mode_string);
 
+    opt->interval = option_parse_interval(interval_string);
+    g_free(interval_string);
+
+    opt->protocol = option_parse_protocol(protocol_string);
+    g_free(protocol_string);
+
+    opt->overflow = option_parse_overflow(overflow_string);
+    g_free(overflow_string);
+
     if (opt->ini_file == NULL) {
         /* Check existing config file (.ini-like config files) */
         if (g_file_test(MBT_LOCAL_INI_FILE, G_FILE_TEST_EXISTS)) {
@@ -132,6 +232,96 @@ opt_mode_t option_parse_mode(char *mode_string)
     return OPT_MODE_UNKNOWN;
 }
 
+opt_protocol_t option_parse_protocol(const char *protocol_string)
+{
+    if (protocol_string == NULL)
+        return OPT_PROTOCOL_UNDEFINED;
+
+    if (strcmp(protocol_string, "text") == 0)
+        return OPT_PROTOCOL_TEXT;
+
+    if (strcmp(protocol_string, "binary") == 0)
+        return OPT_PROTOCOL_BINARY;
+
+    g_error("invalid protocol '%s'", protocol_string);
+    return OPT_PROTOCOL_UNDEFINED;
+}
+
+opt_overflow_t option_parse_overflow(const char *overflow_string)
+{
+    if (overflow_string == NULL)
+        return OPT_OVERFLOW_UNDEFINED;
+
+    if (strcmp(overflow_string, "block") == 0)
+        return OPT_OVERFLOW_BLOCK;
+
+    if (strcmp(overflow_string, "dropoldest") == 0)
+        return OPT_OVERFLOW_DROP_OLDEST;
+
+    if (strcmp(overflow_string, "conflate") == 0)
+        return OPT_OVERFLOW_CONFLATE;
+
+    g_error("invalid overflow policy '%s'", overflow_string);
+    return OPT_OVERFLOW_UNDEFINED;
+}
+
+opt_sink_type_t option_parse_sink_type(const char *type_string)
+{
+    if (type_string == NULL)
+        return OPT_SINK_UNDEFINED;
+
+    if (strcmp(type_string, "stream") == 0)
+        return OPT_SINK_STREAM;
+
+    if (strcmp(type_string, "seqpacket") == 0)
+        return OPT_SINK_SEQPACKET;
+
+    if (strcmp(type_string, "dgram") == 0)
+        return OPT_SINK_DGRAM;
+
+    if (strcmp(type_string, "file") == 0)
+        return OPT_SINK_FILE;
+
+    g_error("invalid sink type '%s'", type_string);
+    return OPT_SINK_UNDEFINED;
+}
+
+/* Parse an interval in seconds ("10", "0.5" or "2s") or in milliseconds
+   ("100ms"). Returns the interval in milliseconds or -1 if not defined. */
+int option_parse_interval(const char *interval_string)
+{
+    double value;
+    char *end;
+
+    if (interval_string == NULL)
+        return -1;
+
+    value = g_ascii_strtod(interval_string, &end);
+    if (end == interval_string)
+        g_error("invalid interval '%s'", interval_string);
+
+    while (*end == ' ')
+        end++;
+
+    if (strcmp(end, "ms") == 0) {
+        /* Already in milliseconds */
+    } else if (*end == '\0' || strcmp(end, "s") == 0) {
+        value *= 1000;
+    } else {
+        g_error("invalid unit of interval '%s'", interval_string);
+    }
+
+    /* Negated tests to reject NaN too */
+    if (!(value >= 1))
+        g_error("interval '%s' is lower than 1 ms", interval_string);
+
+    /* Rounded to at most G_MAXINT below */
+    if (!(value < G_MAXINT + 0.5))
+        g_error("interval '%s' is greater than %d ms", interval_string, G_MAXINT);
+
+    return (int)(value + 0.5);
+}
+
 /* Set mode and backend accordingly */
 void option_set_mode(option_t *opt, opt_mode_t mode)
 {
@@ -154,9 +344,6 @@ int option_set_undefined(option_t *opt)
         if (opt->id == -1)
             opt->id = 1;
 
-        if (opt->interval == -1)
-            opt->interval = 10;
-
         if (opt->device == NULL)
             opt->device = g_strdup("/dev/ttyUSB0");
 
@@ -177,11 +364,107 @@ int option_set_undefined(option_t *opt)
 
         if (opt->port == -1)
             opt->port = 502;
+
+        if (opt->backlog == -1)
+            opt->backlog = 32;
+
+        if (opt->max_connections == -1)
+            opt->max_connections = 0;
+
+        if (opt->idle_timeout == -1)
+            opt->idle_timeout = 0;
+
+        if (opt->workers < 1) {
+            long nb_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+            opt->workers = nb_cpu > 0 ? MIN(nb_cpu, 8) : 1;
+        }
     }
 
+    if (opt->interval == -1)
+        opt->interval = 10000;
+
     if (opt->socket_file == NULL)
         opt->socket_file = g_strdup("/tmp/mbsocket");
 
+    if (opt->protocol == OPT_PROTOCOL_UNDEFINED)
+        opt->protocol = OPT_PROTOCOL_TEXT;
+
+    if (opt->output_bytes == -1)
+        opt->output_bytes = 65536;
+
+    if (opt->output_latency == -1)
+        opt->output_latency = 0;
+
+    if (opt->queue_size == -1)
+        opt->queue_size = 1024;
+
+    if (opt->overflow == OPT_OVERFLOW_UNDEFINED)
+        opt->overflow = OPT_OVERFLOW_BLOCK;
+
+    if (opt->spool_size == -1)
+        opt->spool_size = 64;
+
+    if (opt->spool_age == -1)
+        opt->spool_age = 0;
+
+    if (opt->spool_rate == -1)
+        opt->spool_rate = 65536;
+
+    if (opt->sink_buffer == -1)
+        opt->sink_buffer = 4 * 1024 * 1024;
+
+    if (opt->nb_sink == 0) {
+        /* The recorder */
+        opt->nb_sink = 1;
+        opt->sinks = g_new0(opt_sink_t, 1);
+        opt->sinks[0].type = OPT_SINK_STREAM;
+        opt->sinks[0].path = g_strdup(opt->socket_file);
+        opt->sinks[0].shm_file = g_strdup(opt->shm_file);
+    }
+
+    if (opt->flush_window == -1)
+        opt->flush_window = 0;
+
+    if (opt->flush_count == -1)
+        opt->flush_count = 0;
+
+    if (opt->coils == NULL)
+        opt->coils = g_strdup("");
+
+    if (opt->discrete_inputs == NULL)
+        opt->discrete_inputs = g_strdup("");
+
+    if (opt->holding_registers == NULL)
+        opt->holding_registers = g_strdup("0-399");
+
+    if (opt->input_registers == NULL)
+        opt->input_registers = g_strdup("");
+
+    if (opt->threads == -1)
+        opt->threads = 16;
+    else if (opt->threads < 1)
+        /* A pool without thread would never poll */
+        opt->threads = 1;
+
+    if (opt->gap == -1)
+        opt->gap = 0;
+
+    if (opt->pipeline == -1)
+        opt->pipeline = 1;
+
+    if (opt->heartbeat == -1)
+        opt->heartbeat = 0;
+
+    if (opt->breaker == -1)
+        opt->breaker = 3;
+
+    if (opt->probe == -1)
+        opt->probe = 30000;
+
+    /* Only reported in verbose mode by default */
+    if (opt->report == -1)
+        opt->report = opt->verbose ? 60000 : 0;
+
     if (opt->daemon && opt->pid_file == NULL)
         opt->pid_file = g_strdup("/var/run/mbcollect.pid");
 
@@ -19,6 +19,45 @@ typedef enum {
     OPT_BACKEND_TCP
 } opt_backend_t;
 
+/* Wire format to the recorder */
+typedef enum {
+    OPT_PROTOCOL_UNDEFINED,
+    OPT_PROTOCOL_TEXT,
+    OPT_PROTOCOL_BINARY
+} opt_protocol_t;
+
+/* What to do when the output queue is full */
+typedef enum {
+    OPT_OVERFLOW_UNDEFINED,
+    /* Wait for the output thread */
+    OPT_OVERFLOW_BLOCK,
+    /* Drop the oldest records */
+    OPT_OVERFLOW_DROP_OLDEST,
+    /* Keep the latest values of each address entry */
+    OPT_OVERFLOW_CONFLATE
+} opt_overflow_t;
+
+/* Transport of an output sink */
+typedef enum {
+    OPT_SINK_UNDEFINED,
+    /* Unix stream socket, or shared memory ring when available */
+    OPT_SINK_STREAM,
+    OPT_SINK_SEQPACKET,
+    OPT_SINK_DGRAM,
+    /* File or named pipe, the records are appended */
+    OPT_SINK_FILE
+} opt_sink_type_t;
+
+/* Destination of the records */
+typedef struct {
+    /* NULL for the recorder of the settings */
+    char *name;
+    opt_sink_type_t type;
+    char *path;
+    /* Stream - Shared memory ring tried before the socket (optional) */
+    char *shm_file;
+} opt_sink_t;
+
 typedef struct {
     opt_mode_t mode;
     opt_backend_t backend;
@@ -32,9 +71,74 @@ typedef struct {
     /* TCP */
     char *ip;
     int port;
-    /* Recorder */
+    /* Server - Max number of pending connections */
+    int backlog;
+    /* Server - Max number of connected clients (0 for no limit) */
+    int max_connections;
+    /* Server - Close connections without request since N ms (0 to never) */
+    int idle_timeout;
+    /* Server - Number of threads accepting and serving the clients */
+    int workers;
+    /* Server/slave - Coalesce the writes during N ms (0 to send each write) */
+    int flush_window;
+    /* Server/slave - Coalesce N writes (0 for no limit) */
+    int flush_count;
+    /* Server/slave - Declared ranges of addresses (eg. "0-399;1000-1099") */
+    char *coils;
+    char *discrete_inputs;
+    char *holding_registers;
+    char *input_registers;
+    /* Recorder - Polling interval in milliseconds */
     int interval;
+    /* Align the polling on multiples of the interval of the wall clock */
+    gboolean align;
     char *socket_file;
+    /* Shared memory ring of the recorder, the socket is used when unavailable */
+    char *shm_file;
+    opt_protocol_t protocol;
+    /* Send the buffered records when N bytes are reached */
+    int output_bytes;
+    /* Send the buffered records N ms after the first one (0 to wait the end
+       of cycle) */
+    int output_latency;
+    /* Send a marker at the end of each cycle */
+    gboolean cycle_marker;
+    /* Client/master - Number of records queued for the output thread (0 to
+       send from the polling threads) */
+    int queue_size;
+    opt_overflow_t overflow;
+    /* Directory of the records kept while the recorder is unavailable (NULL
+       to drop them) */
+    char *spool_dir;
+    /* Max size of the spool in MiB */
+    int spool_size;
+    /* Max age of the spooled records in ms (0 for no limit) */
+    int spool_age;
+    /* Replay of the spool in bytes by second */
+    int spool_rate;
+    /* Output sinks, the recorder of the settings when not defined */
+    int nb_sink;
+    opt_sink_t *sinks;
+    /* Max bytes pending for a slow sink */
+    int sink_buffer;
+    /* Client - Number of polling threads */
+    int threads;
+    /* Max number of unused registers read to merge two addresses */
+    int gap;
+    /* Client - Max number of outstanding requests per connection */
+    int pipeline;
+    /* Report by exception: only output changed values */
+    gboolean rbe;
+    /* Min change of floats, absolute or in percent (eg. 0.5 or 2%) */
+    char *deadband;
+    /* Output unchanged values every N polls (0 to never) */
+    int heartbeat;
+    /* Master - Number of consecutive timeouts to consider a slave dead (0 to never) */
+    int breaker;
+    /* Master - Interval between two probes of a dead slave (ms) */
+    int probe;
+    /* Master - Interval between two reports of the bus occupancy (ms, 0 to never) */
+    int report;
     /* System */
     gboolean daemon;
     char *pid_file;
@@ -46,6 +150,10 @@ option_t* option_new(void);
 void option_free(option_t *opt);
 void option_parse(option_t *opt, int argc, char **argv);
 opt_mode_t option_parse_mode(char *mode_string);
+opt_protocol_t option_parse_protocol(const char *protocol_string);
+opt_overflow_t option_parse_overflow(const char *overflow_string);
+opt_sink_type_t option_parse_sink_type(const char *type_string);
+int option_parse_interval(const char *interval_string);
 void option_set_mode(option_t *opt, opt_mode_t mode);
 int option_set_undefined(option_t *opt);
 
@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
@@ -10,62 +12,509 @@
 #include <modbus.h>
 
 #include "output.h"
+#include "proto.h"
 
-int output_connect(char* socket_file, gboolean verbose)
+/* Large enough for a line of 125 registers in steady state */
+#define OUTPUT_BUFFER_SIZE 4096
+/* Max length of a formatted value and its separator */
+#define OUTPUT_VALUE_LENGTH 32
+/* Max length of a message of the seqpacket and datagram sinks and of the
+   ring, cut between two records */
+#define OUTPUT_MESSAGE_SIZE (64 * 1024)
+/* Interval of the checks of the connections (us) */
+#define OUTPUT_PROBE_INTERVAL G_USEC_PER_SEC
+
+static void output_sink_init(output_sink_t *sink, const opt_sink_t *config)
 {
-    int s, len;
-    struct sockaddr_un remote;
+    sink->config = config;
+    conn_init(&(sink->conn));
+    sink->warned = FALSE;
+    sink->last_probe = 0;
+    sink->ring.header = NULL;
+    sink->size = OUTPUT_BUFFER_SIZE;
+    sink->buffer = g_malloc(sink->size);
+    sink->length = 0;
+    sink->partial = 0;
+    sink->dict_sent = NULL;
+    sink->nb_dict = 0;
+    sink->spool = NULL;
+    sink->spool_opened = FALSE;
+    g_atomic_int_set(&(sink->connected), 0);
+    g_atomic_int_set(&(sink->pending), 0);
+    g_atomic_int_set(&(sink->nb_overflow), 0);
+    g_atomic_int_set(&(sink->nb_connect), 0);
+}
 
-    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-        perror("socket");
-        return -1;
+void output_init(output_t *output, option_t *opt)
+{
+    int i;
+
+    output->nb_sink = opt->nb_sink;
+    output->sinks = g_new(output_sink_t, opt->nb_sink);
+    for (i = 0; i < opt->nb_sink; i++) {
+        output_sink_init(&(output->sinks[i]), &(opt->sinks[i]));
     }
+    output->binary = (opt->protocol == OPT_PROTOCOL_BINARY);
+    output->length = 0;
+    output->first_write = 0;
+    output->names = NULL;
+    output->nb_name = 0;
+}
 
-    if (verbose)
-        g_print("Trying to connect to recorder socket %s\n", socket_file);
+static const char* output_sink_name(output_sink_t *sink)
+{
+    return sink->config->name != NULL ? sink->config->name : "recorder";
+}
+
+static gboolean output_sink_is_connected(output_sink_t *sink)
+{
+    return sink->conn.state == CONN_CONNECTED;
+}
+
+static void output_sink_reserve(output_sink_t *sink, gsize needed)
+{
+    if (needed > sink->size) {
+        sink->size = needed;
+        sink->buffer = g_realloc(sink->buffer, sink->size);
+    }
+}
+
+/* Remove the first 'length' bytes of the buffer */
+static void output_sink_consume(output_sink_t *sink, gsize length)
+{
+    sink->length -= length;
+    memmove(sink->buffer, sink->buffer + length, sink->length);
+}
+
+/* Returns the length of the DICT frames of all the names */
+static gsize output_names_length(output_t *output)
+{
+    gsize length = 0;
+    int i;
 
+    for (i = 0; i < output->nb_name; i++) {
+        if (output->names[i] != NULL)
+            length += PROTO_HEADER_LENGTH + 2 + strlen(output->names[i]);
+    }
+
+    return length;
+}
+
+/* Write the DICT frames of all the names in 'p' and mark them as sent */
+static void output_put_names(output_t *output, output_sink_t *sink, uint8_t *p)
+{
+    int i;
+
+    for (i = 0; i < output->nb_name; i++) {
+        int name_length;
+
+        if (output->names[i] == NULL)
+            continue;
+
+        name_length = strlen(output->names[i]);
+        p = proto_put_header(p, PROTO_TYPE_DICT, 2 + name_length);
+        p = proto_put_u16(p, i);
+        memcpy(p, output->names[i], name_length);
+        p += name_length;
+    }
+
+    if (sink->nb_dict < output->nb_name) {
+        sink->dict_sent = g_realloc(sink->dict_sent, output->nb_name);
+        sink->nb_dict = output->nb_name;
+    }
+    for (i = 0; i < sink->nb_dict; i++) {
+        sink->dict_sent[i] = (i < output->nb_name && output->names[i] != NULL);
+    }
+}
+
+/* Binary protocol - The pending records may use names sent to a previous
+   connection so all the names are sent first */
+static void output_sink_prepend_names(output_t *output, output_sink_t *sink)
+{
+    gsize length;
+
+    if (!output->binary || sink->length == 0)
+        return;
+
+    length = output_names_length(output);
+    output_sink_reserve(sink, sink->length + length);
+    memmove(sink->buffer + length, sink->buffer, sink->length);
+    output_put_names(output, sink, (uint8_t *)sink->buffer);
+    sink->length += length;
+}
+
+/* Opened on first use so only the output sending the records replays the
+   backlog. Each sink has its own directory of the spool. */
+static spool_t* output_sink_get_spool(output_sink_t *sink, option_t *opt)
+{
+    if (!sink->spool_opened && opt->spool_dir != NULL) {
+        char *dir;
+
+        if (sink->config->name != NULL)
+            dir = g_build_filename(opt->spool_dir, sink->config->name, NULL);
+        else
+            dir = g_strdup(opt->spool_dir);
+
+        sink->spool = spool_open(dir, opt->protocol == OPT_PROTOCOL_BINARY, (gint64)opt->spool_size * 1024 * 1024,
+                                 (gint64)opt->spool_age * 1000, opt->spool_rate);
+        if (sink->spool != NULL && opt->verbose)
+            spool_report(sink->spool);
+        g_free(dir);
+    }
+    sink->spool_opened = TRUE;
+
+    return sink->spool;
+}
+
+/* Keep the pending records on disk, or drop them without spool. The record
+   partially sent is kept to be completed. */
+static void output_sink_spool(output_t *output, output_sink_t *sink, spool_t *spool)
+{
+    gsize length = sink->length - sink->partial;
+
+    if (spool != NULL && length > 0) {
+        if (output->binary) {
+            /* Each block of the spool carries its names so it can be
+               replayed after the removal of the previous segments */
+            gsize names_length = output_names_length(output);
+            guint8 *block = g_malloc(names_length + length);
+
+            output_put_names(output, sink, block);
+            memcpy(block + names_length, sink->buffer + sink->partial, length);
+            spool_append(spool, block, names_length + length);
+            g_free(block);
+        } else {
+            spool_append(spool, sink->buffer + sink->partial, length);
+        }
+    }
+
+    /* The names are sent again with the next records */
+    if (sink->nb_dict > 0)
+        memset(sink->dict_sent, 0, sink->nb_dict);
+    sink->length = sink->partial;
+}
+
+/* Open the socket or the file of the sink, the writes never block. Returns
+   -1 on error. */
+static int output_sink_open(const opt_sink_t *config)
+{
+    struct sockaddr_un remote;
+    int type;
+    int s;
+
+    if (config->type == OPT_SINK_FILE)
+        return open(config->path, O_WRONLY | O_APPEND | O_CREAT | O_NONBLOCK | O_CLOEXEC, 0640);
+
+    if (config->type == OPT_SINK_SEQPACKET)
+        type = SOCK_SEQPACKET;
+    else if (config->type == OPT_SINK_DGRAM)
+        type = SOCK_DGRAM;
+    else
+        type = SOCK_STREAM;
+
+    if ((s = socket(AF_UNIX, type | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+
+    memset(&remote, 0, sizeof(remote));
     remote.sun_family = AF_UNIX;
-    strcpy(remote.sun_path, socket_file);
-    len = strlen(remote.sun_path) + sizeof(remote.sun_family);
-    if (connect(s, (struct sockaddr *)&remote, len) == -1) {
-        perror("connect");
+    g_strlcpy(remote.sun_path, config->path, sizeof(remote.sun_path));
+    if (connect(s, (struct sockaddr *)&remote, sizeof(remote)) == -1) {
+        int error = errno;
+
+        close(s);
+        errno = error;
         return -1;
     }
-
-    if (verbose)
-        g_print("Connected to recorder\n");
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
 
     return s;
 }
 
-void output_close(int *s)
+/* Attach to the shared memory ring of the recorder when set, with the socket
+   as fallback. Nothing is done before the next attempt is due, a failure
+   delays it with a backoff and is only reported once. */
+static void output_sink_connect(output_t *output, output_sink_t *sink, gboolean verbose, gint64 now)
 {
-    if (*s != -1) {
-        close(*s);
-        *s = -1;
+    const opt_sink_t *config = sink->config;
+    int s = -1;
+
+    if (now < sink->conn.deadline)
+        return;
+
+    if (config->shm_file != NULL && ring_attach(&(sink->ring), config->shm_file) == 0) {
+        if (verbose)
+            g_print("Attached to %s ring %s\n", output_sink_name(sink), config->shm_file);
+    } else {
+        if (config->shm_file != NULL && verbose)
+            g_print("Ring %s of %s unavailable\n", config->shm_file, output_sink_name(sink));
+
+        s = output_sink_open(config);
+        if (s == -1) {
+            int error = errno;
+
+            conn_failed(&(sink->conn), now);
+            if (!sink->warned) {
+                g_warning("Unable to connect to %s %s: %s", output_sink_name(sink), config->path, strerror(error));
+                sink->warned = TRUE;
+            } else if (verbose) {
+                g_print("Unable to connect to %s, next attempt in %" G_GINT64_FORMAT " ms\n",
+                        output_sink_name(sink), (sink->conn.deadline - now) / 1000);
+            }
+            return;
+        }
+
+        if (verbose)
+            g_print("Connected to %s %s\n", output_sink_name(sink), config->path);
     }
+
+    if (sink->warned) {
+        g_print("Connection to %s restored\n", output_sink_name(sink));
+        sink->warned = FALSE;
+    }
+
+    conn_established(&(sink->conn), s);
+    sink->last_probe = now;
+    g_atomic_int_set(&(sink->connected), 1);
+    g_atomic_int_inc(&(sink->nb_connect));
+    output_sink_prepend_names(output, sink);
 }
 
-gboolean output_is_connected(int s)
+/* The next attempt is immediate, then delayed if it fails */
+static void output_sink_close(output_sink_t *sink, gint64 now)
 {
-    return s > 0 ? TRUE : FALSE;
+    ring_detach(&(sink->ring));
+
+    if (sink->conn.fd != -1)
+        close(sink->conn.fd);
+    conn_reset(&(sink->conn), now);
+    g_atomic_int_set(&(sink->connected), 0);
+
+    /* The rest of a record partially sent is useless to the next connection
+       and the names are sent again */
+    output_sink_consume(sink, sink->partial);
+    sink->partial = 0;
+    if (sink->nb_dict > 0)
+        memset(sink->dict_sent, 0, sink->nb_dict);
 }
 
-int output_write(int s, option_t *opt, char *name, int addr, int nb_reg, char *type, uint16_t *tab_reg, gboolean verbose)
+/* Check of the connection between the writes, the recorder never sends
+   anything so a readable stream is closed. The datagram sockets and the
+   files are only checked by the writes. */
+static gboolean output_sink_probe(output_sink_t *sink)
+{
+    struct pollfd pfd;
+
+    if (sink->ring.header != NULL)
+        return ring_has_consumer(&(sink->ring));
+
+    if (sink->config->type != OPT_SINK_STREAM && sink->config->type != OPT_SINK_SEQPACKET)
+        return TRUE;
+
+    pfd.fd = sink->conn.fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    return poll(&pfd, 1, 0) != 1;
+}
+
+/* The pending records are spooled when possible */
+void output_clear(output_t *output)
+{
+    int i;
+
+    for (i = 0; i < output->nb_sink; i++) {
+        output_sink_t *sink = &(output->sinks[i]);
+
+        output_sink_close(sink, g_get_monotonic_time());
+        output_sink_spool(output, sink, sink->spool);
+        g_free(sink->buffer);
+        g_free(sink->dict_sent);
+        spool_close(sink->spool);
+    }
+    g_free(output->sinks);
+    output->sinks = NULL;
+    output->nb_sink = 0;
+
+    for (i = 0; i < output->nb_name; i++) {
+        g_free(output->names[i]);
+    }
+    g_free(output->names);
+    output->names = NULL;
+    output->nb_name = 0;
+}
+
+/* Whether a sink didn't accept all the records of the last flush */
+gboolean output_is_pending(output_t *output)
+{
+    int i;
+
+    for (i = 0; i < output->nb_sink; i++) {
+        if (g_atomic_int_get(&(output->sinks[i].pending)) > 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+output_type_t output_get_type(const char *type)
+{
+    if (type == NULL || strcmp(type, "int") == 0)
+        return OUTPUT_TYPE_INT;
+    else if (strcmp(type, "floatlsb") == 0)
+        return OUTPUT_TYPE_FLOAT_LSB;
+    else
+        return OUTPUT_TYPE_FLOAT;
+}
+
+/* Write the decimal digits of value and returns the end */
+static char* output_format_uint(char *p, unsigned int value)
+{
+    char digits[10];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+
+    while (n > 0)
+        *p++ = digits[--n];
+
+    return p;
+}
+
+/* The prefixes of all the registers of the entry are stored in one block */
+output_prefixes_t* output_prefixes_new(int server, const char *name, int addr, int nb_reg)
+{
+    output_prefixes_t *prefixes = g_new(output_prefixes_t, 1);
+    /* "mb_", name, '_', address and ' ' */
+    int max_len = strlen(name) + 11;
+    char *p;
+    int i;
+
+    prefixes->server = server;
+    prefixes->name = g_strdup(name);
+    prefixes->nb = nb_reg;
+    prefixes->offsets = g_new(int, nb_reg + 1);
+    prefixes->text = g_malloc(nb_reg * max_len + 1);
+
+    p = prefixes->text;
+    for (i = 0; i < nb_reg; i++) {
+        prefixes->offsets[i] = p - prefixes->text;
+        p += sprintf(p, "mb_%s_%d ", name, addr + i);
+    }
+    prefixes->offsets[nb_reg] = p - prefixes->text;
+
+    return prefixes;
+}
+
+void output_prefixes_free(output_prefixes_t *prefixes)
+{
+    if (prefixes == NULL)
+        return;
+
+    g_free(prefixes->name);
+    g_free(prefixes->offsets);
+    g_free(prefixes->text);
+    g_free(prefixes);
+}
+
+/* Binary protocol - Keep the name of the server to send it again to a new
+   connection or with the spooled records */
+static void output_set_name(output_t *output, int server, const char *name)
+{
+    int i;
+
+    if (server >= output->nb_name) {
+        output->names = g_realloc(output->names, (server + 1) * sizeof(char *));
+        memset(output->names + output->nb_name, 0, (server + 1 - output->nb_name) * sizeof(char *));
+        output->nb_name = server + 1;
+    }
+
+    if (output->names[server] != NULL && strcmp(output->names[server], name) == 0)
+        return;
+
+    /* New name of the index after a reload */
+    g_free(output->names[server]);
+    output->names[server] = g_strdup(name);
+    for (i = 0; i < output->nb_sink; i++) {
+        if (server < output->sinks[i].nb_dict)
+            output->sinks[i].dict_sent[server] = 0;
+    }
+}
+
+/* Binary frames of the runs of values set in 'mask' */
+static int output_write_binary(output_sink_t *sink, const output_prefixes_t *prefixes, int addr, int nb_reg,
+                               output_type_t type, const uint16_t *tab_reg, const guint8 *mask, gint64 timestamp)
+{
+    int server = prefixes != NULL ? prefixes->server : 0;
+    const char *name = prefixes != NULL ? prefixes->name : "";
+    int width = (type == OUTPUT_TYPE_INT) ? 1 : 2;
+    int name_length = strlen(name);
+    uint8_t *p;
+    int i;
+
+    /* Worst case of a frame by value */
+    output_sink_reserve(sink, sink->length + PROTO_HEADER_LENGTH + 2 + name_length +
+                        (nb_reg / width) * (PROTO_HEADER_LENGTH + PROTO_DATA_HEADER_LENGTH) + nb_reg * 2);
+    p = (uint8_t *)sink->buffer + sink->length;
+
+    if (server >= sink->nb_dict) {
+        sink->dict_sent = g_realloc(sink->dict_sent, server + 1);
+        memset(sink->dict_sent + sink->nb_dict, 0, server + 1 - sink->nb_dict);
+        sink->nb_dict = server + 1;
+    }
+
+    if (!sink->dict_sent[server]) {
+        p = proto_put_header(p, PROTO_TYPE_DICT, 2 + name_length);
+        p = proto_put_u16(p, server);
+        memcpy(p, name, name_length);
+        p += name_length;
+        sink->dict_sent[server] = 1;
+    }
+    for (i = 0; i < nb_reg / width;) {
+        int start;
+        int j;
+
+        if (mask != NULL && !mask[i]) {
+            i++;
+            continue;
+        }
+
+        /* Run of reported values */
+        start = i;
+        while (i < nb_reg / width && (mask == NULL || mask[i]))
+            i++;
+
+        p = proto_put_header(p, PROTO_TYPE_DATA, PROTO_DATA_HEADER_LENGTH + (i - start) * width * 2);
+        p = proto_put_i64(p, timestamp);
+        p = proto_put_u16(p, server);
+        p = proto_put_u16(p, addr + start * width);
+        *p++ = type;
+        *p++ = 0;
+        p = proto_put_u16(p, (i - start) * width);
+        for (j = start * width; j < i * width; j++) {
+            p = proto_put_u16(p, tab_reg[j]);
+        }
+    }
+
+    return p - ((uint8_t *)sink->buffer + sink->length);
+}
+
+/* Returns the length of the line of text */
+static int output_write_text(output_sink_t *sink, option_t *opt, const output_prefixes_t *prefixes, int addr,
+                             int nb_reg, output_type_t type, const uint16_t *tab_reg, const guint8 *mask,
+                             gboolean verbose)
 {
-    int rc;
     int i, j;
     int nb;
-    char *output = NULL;
-    /* A string for each value */
-    char **out_array = NULL;
+    gsize needed;
+    char *start;
+    char *p;
     gboolean is_integer;
-    gboolean is_lsb = FALSE;
-    gboolean is_server;
-
-    is_server = (opt->mode == OPT_MODE_SLAVE || opt->mode == OPT_MODE_SERVER);
+    gboolean is_server = (opt->mode == OPT_MODE_SLAVE || opt->mode == OPT_MODE_SERVER);
 
-    if (is_server || strcmp(type, "int") == 0) {
+    if (type == OUTPUT_TYPE_INT) {
         /* Integer */
         is_integer = TRUE;
         nb = nb_reg;
@@ -73,50 +522,618 @@ int output_write(int s, option_t *opt, char *name, int addr, int nb_reg, char *t
         /* Float */
         is_integer = FALSE;
         nb = nb_reg / 2;
-        is_lsb = (strcmp(type, "floatlsb") == 0);
     }
 
-    /* nb and NULL marker */
-    out_array = g_new(char*, nb + 1);
+    /* Only grows on the first writes of large blocks */
+    needed = nb * OUTPUT_VALUE_LENGTH + 1;
+    if (!is_server)
+        needed += prefixes->offsets[nb_reg];
+    output_sink_reserve(sink, sink->length + needed);
+
+    start = sink->buffer + sink->length;
+    p = start;
+    for (i = 0, j = 0; i < nb; i++, j += is_integer ? 1 : 2) {
+        if (mask != NULL && !mask[i])
+            continue;
 
-    for (i = 0, j = 0; i < nb; i++) {
         if (!is_server) {
             /* Type is only handled in this mode */
+            int len = prefixes->offsets[j + 1] - prefixes->offsets[j];
+
+            memcpy(p, prefixes->text + prefixes->offsets[j], len);
+            p += len;
             if (is_integer) {
-                out_array[i] = g_strdup_printf("mb_%s_%d %d|", name, addr + i, tab_reg[i]);
+                p = output_format_uint(p, tab_reg[i]);
             } else {
                 float value;
 
-                if (is_lsb) {
+                if (type == OUTPUT_TYPE_FLOAT_LSB) {
                     value = modbus_get_float_dcba(tab_reg + j);
                 } else {
                     value = modbus_get_float(tab_reg + j);
                 }
-                out_array[i] = g_strdup_printf("mb_%s_%d %f|", name, addr + j, value);
-                j += 2;
+                p += proto_format_float(p, value);
             }
         } else {
-            out_array[i] = g_strdup_printf("mb_%d %d|", addr + i, tab_reg[i]);
+            memcpy(p, "mb_", 3);
+            p = output_format_uint(p + 3, addr + i);
+            *p++ = ' ';
+            p = output_format_uint(p, tab_reg[i]);
         }
+        *p++ = '|';
     }
 
-    /* Set final marker of the array */
-    out_array[i] = NULL;
-    output = g_strjoinv(NULL, out_array);
+    if (p == start) {
+        /* Nothing to report */
+        return 0;
+    }
 
     /* Replace final '|' by '\n' */
-    output[strlen(output) - 1] = '\n';
+    p[-1] = '\n';
+
+    if (verbose) {
+        *p = '\0';
+        g_print("%s\n", start);
+    }
+
+    return p - start;
+}
+
+/* Length of the next message of at most OUTPUT_MESSAGE_SIZE, cut between two
+   records. A larger record is sent alone. */
+static gsize output_message_length(output_t *output, const char *data, gsize length)
+{
+    long n;
+
+    if (length <= OUTPUT_MESSAGE_SIZE)
+        return length;
+
+    n = proto_records_length((const uint8_t *)data, OUTPUT_MESSAGE_SIZE, output->binary);
+    if (n <= 0)
+        n = proto_record_length((const uint8_t *)data, length, output->binary);
+
+    return n > 0 ? (gsize)n : length;
+}
 
-    if (verbose)
-        g_print("%s\n", output);
+/* Send the pending records without blocking, as messages of complete records
+   to the ring and the message sockets. Returns the number of bytes sent or
+   -1 on error. */
+static gssize output_sink_send(output_t *output, output_sink_t *sink)
+{
+    opt_sink_type_t type = sink->config->type;
+    gsize sent = 0;
+
+    while (sent < sink->length) {
+        const char *data = sink->buffer + sent;
+        gsize length = sink->length - sent;
+        gssize rc;
 
-    rc = send(s, output, strlen(output), MSG_NOSIGNAL);
+        if (sink->ring.header != NULL) {
+            length = output_message_length(output, data, length);
+            rc = ring_write(&(sink->ring), data, length);
+            if (rc == -1) {
+                g_warning("Unable to write %" G_GSIZE_FORMAT " bytes to the ring of %s", length,
+                          output_sink_name(sink));
+                return -1;
+            }
+            if (rc == 0)
+                /* Full */
+                break;
+        } else if (type == OPT_SINK_FILE) {
+            rc = write(sink->conn.fd, data, length);
+        } else {
+            if (type == OPT_SINK_SEQPACKET || type == OPT_SINK_DGRAM)
+                length = output_message_length(output, data, length);
+            rc = send(sink->conn.fd, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
 
-    for (i = 0; i < nb; i++) {
-        g_free(out_array[i]);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            g_warning("Unable to send to %s: %s", output_sink_name(sink), strerror(errno));
+            return -1;
+        }
+        sent += rc;
+    }
+
+    return sent;
+}
+
+/* Track the record partially sent by a stream after 'sent' bytes */
+static void output_sink_sent(output_t *output, output_sink_t *sink, gsize sent)
+{
+    if (sent < sink->partial) {
+        sink->partial -= sent;
+    } else {
+        gsize offset = sink->partial;
+        long complete = proto_records_length((const uint8_t *)sink->buffer + offset, sent - offset,
+                                             output->binary);
+
+        sink->partial = 0;
+        if (complete >= 0 && offset + complete < sent) {
+            /* The buffer only holds complete records after the partial one */
+            long record = proto_record_length((const uint8_t *)sink->buffer + offset + complete,
+                                              sink->length - offset - complete, output->binary);
+
+            if (record > 0)
+                sink->partial = offset + complete + record - sent;
+        }
+    }
+
+    output_sink_consume(sink, sent);
+}
+
+/* spool_send_t - The replayed records are queued after the live ones */
+static int output_sink_replay(gpointer data, const guint8 *buffer, gsize length)
+{
+    output_sink_t *sink = data;
+
+    output_sink_reserve(sink, sink->length + length);
+    memcpy(sink->buffer + sink->length, buffer, length);
+    sink->length += length;
+
+    return 0;
+}
+
+static void output_sink_flush(output_t *output, output_sink_t *sink, option_t *opt)
+{
+    spool_t *spool = output_sink_get_spool(sink, opt);
+    gint64 now = g_get_monotonic_time();
+    gssize sent;
+
+    if (output_sink_is_connected(sink) && now - sink->last_probe >= OUTPUT_PROBE_INTERVAL) {
+        sink->last_probe = now;
+        if (!output_sink_probe(sink)) {
+            g_warning("Connection to %s lost", output_sink_name(sink));
+            sink->warned = TRUE;
+            output_sink_close(sink, now);
+        }
+    }
+
+    if (!output_sink_is_connected(sink))
+        output_sink_connect(output, sink, opt->verbose, now);
+
+    if (!output_sink_is_connected(sink)) {
+        output_sink_spool(output, sink, spool);
+        g_atomic_int_set(&(sink->pending), 0);
+        return;
+    }
+
+    sent = output_sink_send(output, sink);
+    if (sent != -1) {
+        output_sink_sent(output, sink, sent);
+
+        /* The backlog is replayed once the live records are sent */
+        if (spool != NULL && sink->length == 0 && !spool_is_empty(spool)) {
+            /* The spooled blocks start with their names */
+            if (sink->nb_dict > 0)
+                memset(sink->dict_sent, 0, sink->nb_dict);
+            spool_replay(spool, output_sink_replay, sink);
+
+            sent = output_sink_send(output, sink);
+            if (sent != -1)
+                output_sink_sent(output, sink, sent);
+        }
+    }
+
+    if (sent == -1) {
+        /* Only this sink is closed, its records are spooled */
+        sink->warned = TRUE;
+        output_sink_close(sink, now);
+        output_sink_spool(output, sink, spool);
+        g_atomic_int_set(&(sink->pending), 0);
+        return;
+    }
+
+    if (sink->length > (gsize)opt->sink_buffer) {
+        /* Too slow, the other sinks and the poller are not delayed */
+        g_atomic_int_inc(&(sink->nb_overflow));
+        output_sink_spool(output, sink, spool);
+    }
+
+    g_atomic_int_set(&(sink->pending), sink->length);
+}
+
+/* Send the buffered records of each sink, with the end of cycle marker when
+   'end_of_cycle' is set. A sink never blocks: the records it doesn't accept
+   stay in its buffer, up to opt->sink_buffer bytes, and are spooled when it
+   is unavailable. The spooled ones are replayed after the live records. */
+void output_flush(output_t *output, option_t *opt, gboolean end_of_cycle, gint64 timestamp)
+{
+    int i;
+
+    for (i = 0; i < output->nb_sink; i++) {
+        output_sink_t *sink = &(output->sinks[i]);
+
+        if (end_of_cycle && opt->cycle_marker) {
+            output_sink_reserve(sink, sink->length + PROTO_HEADER_LENGTH + 8 + OUTPUT_VALUE_LENGTH);
+            if (output->binary) {
+                uint8_t *p = (uint8_t *)sink->buffer + sink->length;
+
+                p = proto_put_header(p, PROTO_TYPE_END, 8);
+                proto_put_i64(p, timestamp);
+                sink->length += PROTO_HEADER_LENGTH + 8;
+            } else {
+                sink->length += sprintf(sink->buffer + sink->length, "#cycle %" G_GINT64_FORMAT "\n", timestamp);
+            }
+        }
+
+        output_sink_flush(output, sink, opt);
+    }
+    output->length = 0;
+}
+
+/* Write the values of the registers, only the values set in 'mask' are
+   written when not NULL. The names are taken from 'prefixes' in client
+   mode and built from the address in server mode. The records are buffered
+   until output_flush() or until a budget of opt is reached. Returns the
+   length of the records. */
+int output_write(output_t *output, option_t *opt, const output_prefixes_t *prefixes, int addr, int nb_reg,
+                 output_type_t type, const uint16_t *tab_reg, const guint8 *mask, gint64 timestamp,
+                 gboolean verbose)
+{
+    int length = 0;
+    int i;
+
+    if (output->nb_sink == 0)
+        return 0;
+
+    if (opt->mode == OPT_MODE_SLAVE || opt->mode == OPT_MODE_SERVER)
+        type = OUTPUT_TYPE_INT;
+
+    if (output->binary) {
+        /* The names are sent to each sink on its own */
+        if (prefixes != NULL)
+            output_set_name(output, prefixes->server, prefixes->name);
+        else
+            output_set_name(output, 0, "");
+
+        for (i = 0; i < output->nb_sink; i++) {
+            output_sink_t *sink = &(output->sinks[i]);
+            int sink_length = output_write_binary(sink, prefixes, addr, nb_reg, type, tab_reg, mask, timestamp);
+
+            sink->length += sink_length;
+            length = MAX(length, sink_length);
+        }
+        if (length > 0 && verbose)
+            g_print("Binary records of %d bytes\n", length);
+    } else {
+        /* Formatted once and copied to the other sinks */
+        output_sink_t *first = &(output->sinks[0]);
+
+        length = output_write_text(first, opt, prefixes, addr, nb_reg, type, tab_reg, mask, verbose);
+        first->length += length;
+        for (i = 1; i < output->nb_sink && length > 0; i++) {
+            output_sink_t *sink = &(output->sinks[i]);
+
+            output_sink_reserve(sink, sink->length + length);
+            memcpy(sink->buffer + sink->length, first->buffer + first->length - length, length);
+            sink->length += length;
+        }
+    }
+
+    if (length == 0) {
+        /* Nothing to report */
+        return 0;
+    }
+
+    if (output->length == 0)
+        output->first_write = g_get_monotonic_time();
+    output->length += length;
+
+    /* Send the records of the cycle at once unless a budget is reached */
+    if (output->length >= (gsize)opt->output_bytes ||
+        (opt->output_latency > 0 && g_get_monotonic_time() - output->first_write >= (gint64)opt->output_latency * 1000))
+        output_flush(output, opt, FALSE, timestamp);
+
+    return length;
+}
+
+void output_report(output_t *output)
+{
+    int i;
+
+    for (i = 0; i < output->nb_sink; i++) {
+        output_sink_t *sink = &(output->sinks[i]);
+
+        g_print("Sink %s: %s, %d connections, %d bytes pending, %d overflows\n", output_sink_name(sink),
+                g_atomic_int_get(&(sink->connected)) ? "connected" : "unavailable",
+                g_atomic_int_get(&(sink->nb_connect)), g_atomic_int_get(&(sink->pending)),
+                g_atomic_int_get(&(sink->nb_overflow)));
+    }
+}
+
+static void output_queue_handle(output_queue_t *oq, const output_record_t *record)
+{
+    option_t *opt = oq->opt;
+
+    if (record->prefixes == NULL) {
+        output_flush(&(oq->output), opt, TRUE, record->timestamp);
+    } else {
+        output_write(&(oq->output), opt, record->prefixes, record->addr, record->nb_reg, record->type,
+                     record->tab_reg, record->masked ? record->mask : NULL, record->timestamp, opt->verbose);
+    }
+}
+
+/* Send the conflated records then the markers of the cycles ended after
+   them, returns FALSE if none */
+static gboolean output_queue_drain(output_queue_t *oq)
+{
+    GHashTableIter iter;
+    gpointer value;
+    GPtrArray *records;
+    GArray *markers;
+    guint i;
+
+    g_mutex_lock(&(oq->overflow_mutex));
+    if (g_atomic_int_get(&(oq->nb_overflow)) == 0) {
+        g_mutex_unlock(&(oq->overflow_mutex));
+        return FALSE;
+    }
+
+    records = g_ptr_array_new_with_free_func(g_free);
+    g_hash_table_iter_init(&iter, oq->conflated);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_ptr_array_add(records, value);
+        g_hash_table_iter_steal(&iter);
+    }
+    markers = oq->markers;
+    oq->markers = g_array_new(FALSE, FALSE, sizeof(gint64));
+    g_atomic_int_set(&(oq->nb_overflow), 0);
+    g_mutex_init(&(oq->room_mutex));
+    g_cond_init(&(oq->room_cond));
+    g_atomic_int_set(&(oq->nb_blocked), 0);
+    g_mutex_unlock(&(oq->overflow_mutex));
+
+    for (i = 0; i < records->len; i++) {
+        output_queue_handle(oq, g_ptr_array_index(records, i));
+    }
+    for (i = 0; i < markers->len; i++) {
+        output_flush(&(oq->output), oq->opt, TRUE, g_array_index(markers, gint64, i));
+    }
+    g_ptr_array_free(records, TRUE);
+    g_array_free(markers, TRUE);
+
+    return TRUE;
+}
+
+/* Drop oldest - The markers popped by the producers to make room are older
+   than the records still queued so they are handled first. The lock orders
+   the pops of the output thread with the ones of the producers. */
+static gboolean output_queue_pop(output_queue_t *oq, output_record_t *record)
+{
+    gboolean popped;
+
+    if (oq->opt->overflow != OPT_OVERFLOW_DROP_OLDEST) {
+        popped = queue_pop(oq->queue, record);
+        /* Block - Wake up the producers waiting for room */
+        if (popped && g_atomic_int_get(&(oq->nb_blocked)) > 0) {
+            g_mutex_lock(&(oq->room_mutex));
+            g_cond_broadcast(&(oq->room_cond));
+            g_mutex_unlock(&(oq->room_mutex));
+        }
+        return popped;
+    }
+
+    g_mutex_lock(&(oq->overflow_mutex));
+    if (oq->markers->len > 0) {
+        record->prefixes = NULL;
+        record->nb_reg = 0;
+        record->timestamp = g_array_index(oq->markers, gint64, 0);
+        g_array_remove_index(oq->markers, 0);
+        popped = TRUE;
+    } else {
+        popped = queue_pop(oq->queue, record);
+    }
+    g_mutex_unlock(&(oq->overflow_mutex));
+
+    return popped;
+}
+
+static gpointer output_queue_thread(gpointer data)
+{
+    output_queue_t *oq = data;
+    option_t *opt = oq->opt;
+    output_record_t record;
+
+    for (;;) {
+        if (output_queue_pop(oq, &record)) {
+            output_queue_handle(oq, &record);
+            continue;
+        }
+
+        if (output_queue_drain(oq))
+            continue;
+
+        if (g_atomic_int_get(&(oq->stop)))
+            break;
+
+        queue_wait(oq->queue, g_get_monotonic_time() + 100000);
+
+        /* Latency budget of the buffered records and retry of the slow
+           sinks */
+        if ((oq->output.length > 0 && opt->output_latency > 0 &&
+             g_get_monotonic_time() - oq->output.first_write >= (gint64)opt->output_latency * 1000) ||
+            output_is_pending(&(oq->output)))
+            output_flush(&(oq->output), opt, FALSE, 0);
+    }
+
+    output_flush(&(oq->output), opt, FALSE, 0);
+
+    return NULL;
+}
+
+output_queue_t* output_queue_new(option_t *opt)
+{
+    output_queue_t *oq = g_new(output_queue_t, 1);
+
+    oq->opt = opt;
+    oq->queue = queue_new(opt->queue_size, sizeof(output_record_t));
+    output_init(&(oq->output), opt);
+    g_atomic_int_set(&(oq->stop), 0);
+    g_atomic_int_set(&(oq->max_depth), 0);
+    g_atomic_int_set(&(oq->nb_drop), 0);
+    g_atomic_int_set(&(oq->nb_conflate), 0);
+    g_mutex_init(&(oq->overflow_mutex));
+    oq->conflated = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    oq->markers = g_array_new(FALSE, FALSE, sizeof(gint64));
+    g_atomic_int_set(&(oq->nb_overflow), 0);
+    g_mutex_init(&(oq->room_mutex));
+    g_cond_init(&(oq->room_cond));
+    g_atomic_int_set(&(oq->nb_blocked), 0);
+    oq->thread = g_thread_new("output", output_queue_thread, oq);
+
+    return oq;
+}
+
+/* The queued records are sent before returning */
+void output_queue_free(output_queue_t *oq)
+{
+    if (oq == NULL)
+        return;
+
+    g_atomic_int_set(&(oq->stop), 1);
+    g_thread_join(oq->thread);
+
+    g_hash_table_destroy(oq->conflated);
+    g_array_free(oq->markers, TRUE);
+    g_mutex_clear(&(oq->overflow_mutex));
+    g_mutex_clear(&(oq->room_mutex));
+    g_cond_clear(&(oq->room_cond));
+    output_clear(&(oq->output));
+    queue_free(oq->queue);
+    g_free(oq);
+}
+
+/* Merge the record with the latest values of its address entry, the markers
+   are kept in order after the conflated records */
+static void output_queue_conflate(output_queue_t *oq, const output_record_t *record)
+{
+    output_record_t *latest;
+    int width = (record->type == OUTPUT_TYPE_INT) ? 1 : 2;
+    int i;
+
+    g_mutex_lock(&(oq->overflow_mutex));
+    if (record->prefixes == NULL) {
+        g_array_append_val(oq->markers, record->timestamp);
+        g_atomic_int_inc(&(oq->nb_overflow));
+        g_mutex_unlock(&(oq->overflow_mutex));
+        return;
+    }
+
+    latest = g_hash_table_lookup(oq->conflated, record->prefixes);
+    if (latest == NULL) {
+        latest = g_new(output_record_t, 1);
+        *latest = *record;
+        g_hash_table_insert(oq->conflated, (gpointer)record->prefixes, latest);
+        g_atomic_int_inc(&(oq->nb_overflow));
+    } else {
+        for (i = 0; i < record->nb_reg / width; i++) {
+            if (record->masked && !record->mask[i])
+                continue;
+
+            memcpy(latest->tab_reg + i * width, record->tab_reg + i * width, width * sizeof(uint16_t));
+            latest->mask[i] = 1;
+        }
+        latest->timestamp = record->timestamp;
+        g_atomic_int_inc(&(oq->nb_conflate));
+    }
+    g_mutex_unlock(&(oq->overflow_mutex));
+}
+
+/* Drop oldest - Make room for a record, the popped marker is kept for the
+   output thread */
+static void output_queue_drop(output_queue_t *oq)
+{
+    output_record_t oldest;
+
+    g_mutex_lock(&(oq->overflow_mutex));
+    if (queue_pop(oq->queue, &oldest)) {
+        if (oldest.prefixes == NULL)
+            g_array_append_val(oq->markers, oldest.timestamp);
+        else
+            g_atomic_int_inc(&(oq->nb_drop));
+    }
+    g_mutex_unlock(&(oq->overflow_mutex));
+}
+
+/* Block - Push the record once the output thread has popped another one, the
+   counter is raised under the lock so the wake up can't be missed */
+static void output_queue_wait_room(output_queue_t *oq, const output_record_t *record)
+{
+    g_mutex_lock(&(oq->room_mutex));
+    g_atomic_int_inc(&(oq->nb_blocked));
+    while (!queue_push(oq->queue, record))
+        g_cond_wait(&(oq->room_cond), &(oq->room_mutex));
+    g_atomic_int_add(&(oq->nb_blocked), -1);
+    g_mutex_unlock(&(oq->room_mutex));
+}
+
+static void output_queue_push(output_queue_t *oq, const output_record_t *record)
+{
+    gint depth;
+
+    /* Conflate - The records follow the conflated ones until they are sent,
+       so the latest values of an address are never sent before older ones */
+    if (oq->opt->overflow == OPT_OVERFLOW_CONFLATE && g_atomic_int_get(&(oq->nb_overflow)) > 0) {
+        output_queue_conflate(oq, record);
+        return;
+    }
+
+    while (!queue_push(oq->queue, record)) {
+        if (oq->opt->overflow == OPT_OVERFLOW_DROP_OLDEST) {
+            output_queue_drop(oq);
+        } else if (oq->opt->overflow == OPT_OVERFLOW_CONFLATE) {
+            output_queue_conflate(oq, record);
+            return;
+        } else {
+            output_queue_wait_room(oq, record);
+            break;
+        }
+    }
+
+    depth = queue_depth(oq->queue);
+    if (depth > g_atomic_int_get(&(oq->max_depth)))
+        g_atomic_int_set(&(oq->max_depth), depth);
+}
+
+/* Same arguments as output_write(), the values are copied */
+void output_queue_write(output_queue_t *oq, const output_prefixes_t *prefixes, int addr, int nb_reg,
+                        output_type_t type, const uint16_t *tab_reg, const guint8 *mask, gint64 timestamp)
+{
+    output_record_t record;
+    int i;
+
+    record.prefixes = prefixes;
+    record.addr = addr;
+    record.nb_reg = nb_reg;
+    record.type = type;
+    record.timestamp = timestamp;
+    record.masked = (mask != NULL);
+    memcpy(record.tab_reg, tab_reg, nb_reg * sizeof(uint16_t));
+    for (i = 0; i < nb_reg; i++) {
+        record.mask[i] = (mask == NULL) || mask[i];
     }
-    g_free(out_array);
-    g_free(output);
 
-    return rc;
+    output_queue_push(oq, &record);
+}
+
+void output_queue_end_cycle(output_queue_t *oq, gint64 timestamp)
+{
+    output_record_t record;
+
+    record.prefixes = NULL;
+    record.nb_reg = 0;
+    record.timestamp = timestamp;
+    output_queue_push(oq, &record);
+}
+
+void output_queue_report(output_queue_t *oq)
+{
+    g_print("Output queue: %u records (max %d), %d dropped, %d conflated\n", queue_depth(oq->queue),
+            g_atomic_int_get(&(oq->max_depth)), g_atomic_int_get(&(oq->nb_drop)),
+            g_atomic_int_get(&(oq->nb_conflate)));
+    output_report(&(oq->output));
 }
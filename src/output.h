@@ -3,13 +3,133 @@
 
 #include <glib.h>
 #include <inttypes.h>
+#include <modbus.h>
 
+#include "conn.h"
 #include "option.h"
+#include "queue.h"
+#include "ring.h"
+#include "spool.h"
 
-int output_connect(char* socket_file, gboolean verbose);
-void output_close(int *s);
-int output_write(int s, option_t *opt, char *name, int addr, int nb_reg, char *type, uint16_t *tab_reg,
+typedef enum {
+    OUTPUT_TYPE_INT = 0,
+    OUTPUT_TYPE_FLOAT,
+    OUTPUT_TYPE_FLOAT_LSB
+} output_type_t;
+
+/* Formatted names of the registers of an address entry ("mb_<name>_<addr> ") */
+typedef struct {
+    /* Index and name of the server in the binary protocol */
+    int server;
+    char *name;
+    int nb;
+    /* nb + 1 offsets in text */
+    int *offsets;
+    char *text;
+} output_prefixes_t;
+
+/* Destination of the records with its own buffer, so a slow or failed sink
+   doesn't delay the others */
+typedef struct {
+    const opt_sink_t *config;
+    /* Socket or file, the attempts are delayed with a backoff while the sink
+       is unavailable */
+    conn_t conn;
+    /* Whether the unavailability has been reported */
+    gboolean warned;
+    /* Last check of the connection without records to send (us) */
+    gint64 last_probe;
+    /* Shared memory ring of the recorder, used instead of the socket when
+       attached */
+    ring_t ring;
+    /* Records not yet sent */
+    char *buffer;
+    gsize length;
+    gsize size;
+    /* Bytes of a record partially sent at the start of the buffer */
+    gsize partial;
+    /* Binary protocol - Whether the name of each server has been sent */
+    guint8 *dict_sent;
+    int nb_dict;
+    /* Records kept while the sink is unavailable (NULL if disabled) */
+    spool_t *spool;
+    gboolean spool_opened;
+    /* Counters */
+    volatile gint connected;
+    volatile gint pending;
+    volatile gint nb_overflow;
+    volatile gint nb_connect;
+} output_sink_t;
+
+/* Records written to each sink */
+typedef struct {
+    int nb_sink;
+    output_sink_t *sinks;
+    gboolean binary;
+    /* Bytes written since the last flush */
+    gsize length;
+    gint64 first_write;
+    /* Binary protocol - Names of the servers by index */
+    char **names;
+    int nb_name;
+} output_t;
+
+/* Block of values queued for the output thread */
+typedef struct {
+    /* NULL for the end of a cycle */
+    const output_prefixes_t *prefixes;
+    int addr;
+    int nb_reg;
+    output_type_t type;
+    gint64 timestamp;
+    gboolean masked;
+    uint16_t tab_reg[MODBUS_MAX_READ_REGISTERS];
+    guint8 mask[MODBUS_MAX_READ_REGISTERS];
+} output_record_t;
+
+/* Output thread sending the records pushed by the polling threads, so a slow
+   recorder doesn't delay the polling */
+typedef struct {
+    option_t *opt;
+    queue_t *queue;
+    output_t output;
+    GThread *thread;
+    volatile gint stop;
+    /* Counters */
+    volatile gint max_depth;
+    volatile gint nb_drop;
+    volatile gint nb_conflate;
+    GMutex overflow_mutex;
+    /* Conflate - Latest values of each address entry which didn't fit in the
+       queue */
+    GHashTable *conflated;
+    /* Timestamps of the end of cycle markers which didn't fit in the queue
+       (conflate) or popped to make room (drop oldest), never dropped */
+    GArray *markers;
+    /* Conflate - Number of conflated records and markers */
+    volatile gint nb_overflow;
+    /* Block - Producers waiting for room in the queue */
+    GMutex room_mutex;
+    GCond room_cond;
+    volatile gint nb_blocked;
+} output_queue_t;
+
+void output_init(output_t *output, option_t *opt);
+void output_clear(output_t *output);
+gboolean output_is_pending(output_t *output);
+output_type_t output_get_type(const char *type);
+output_prefixes_t* output_prefixes_new(int server, const char *name, int addr, int nb_reg);
+void output_prefixes_free(output_prefixes_t *prefixes);
+int output_write(output_t *output, option_t *opt, const output_prefixes_t *prefixes, int addr, int nb_reg,
+                 output_type_t type, const uint16_t *tab_reg, const guint8 *mask, gint64 timestamp,
                  gboolean verbose);
-gboolean output_is_connected(int s);
+void output_flush(output_t *output, option_t *opt, gboolean end_of_cycle, gint64 timestamp);
+void output_report(output_t *output);
+output_queue_t* output_queue_new(option_t *opt);
+void output_queue_free(output_queue_t *oq);
+void output_queue_write(output_queue_t *oq, const output_prefixes_t *prefixes, int addr, int nb_reg,
+                        output_type_t type, const uint16_t *tab_reg, const guint8 *mask, gint64 timestamp);
+void output_queue_end_cycle(output_queue_t *oq, gint64 timestamp);
+void output_queue_report(output_queue_t *oq);
 
 #endif /* _OUTPUT_H_ */
@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <modbus.h>
+
+#include "parser.h"
+#include "proto.h"
+
+/* Larger addresses are invalid */
+#define PARSER_MAX_ADDR 1000000
+
+parser_names_t* parser_names_new(void)
+{
+    parser_names_t *names = g_new(parser_names_t, 1);
+
+    g_mutex_init(&(names->mutex));
+    /* The keys are owned by the array */
+    names->ids = g_hash_table_new(g_str_hash, g_str_equal);
+    names->names = g_ptr_array_new_with_free_func(g_free);
+
+    return names;
+}
+
+void parser_names_free(parser_names_t *names)
+{
+    if (names == NULL)
+        return;
+
+    g_hash_table_destroy(names->ids);
+    g_ptr_array_free(names->names, TRUE);
+    g_mutex_clear(&(names->mutex));
+    g_free(names);
+}
+
+/* Returns the id of the name, a new one the first time */
+guint32 parser_names_intern(parser_names_t *names, const char *name, gsize length)
+{
+    char buffer[PARSER_NAME_MAX];
+    char *key = length < sizeof(buffer) ? buffer : g_malloc(length + 1);
+    gpointer value;
+    guint32 id;
+
+    memcpy(key, name, length);
+    key[length] = '\0';
+
+    g_mutex_lock(&(names->mutex));
+    value = g_hash_table_lookup(names->ids, key);
+    if (value != NULL) {
+        id = GPOINTER_TO_UINT(value) - 1;
+    } else {
+        char *copy = g_strdup(key);
+
+        id = names->names->len;
+        g_ptr_array_add(names->names, copy);
+        g_hash_table_insert(names->ids, copy, GUINT_TO_POINTER(id + 1));
+    }
+    g_mutex_unlock(&(names->mutex));
+
+    if (key != buffer)
+        g_free(key);
+
+    return id;
+}
+
+/* The names are kept until parser_names_free() */
+const char* parser_names_get(parser_names_t *names, guint32 id)
+{
+    const char *name = NULL;
+
+    g_mutex_lock(&(names->mutex));
+    if (id < names->names->len)
+        name = g_ptr_array_index(names->names, id);
+    g_mutex_unlock(&(names->mutex));
+
+    return name;
+}
+
+guint parser_names_count(parser_names_t *names)
+{
+    guint count;
+
+    g_mutex_lock(&(names->mutex));
+    count = names->names->len;
+    g_mutex_unlock(&(names->mutex));
+
+    return count;
+}
+
+void parser_init(parser_t *parser, parser_names_t *names, parser_record_func_t func, gpointer data)
+{
+    parser->names = names;
+    parser->func = func;
+    parser->data = data;
+    parser->last_length = 0;
+    parser->last_id = -1;
+    parser->server_ids = NULL;
+    parser->nb_server = 0;
+    parser->nb_record = 0;
+    parser->nb_invalid = 0;
+}
+
+void parser_clear(parser_t *parser)
+{
+    g_free(parser->server_ids);
+    parser->server_ids = NULL;
+    parser->nb_server = 0;
+}
+
+/* Only the names which differ from the previous one are looked up */
+static guint32 parser_intern(parser_t *parser, const guint8 *name, gsize length)
+{
+    guint32 id;
+
+    if (parser->last_id >= 0 && length == parser->last_length && memcmp(name, parser->last_name, length) == 0)
+        return parser->last_id;
+
+    id = parser_names_intern(parser->names, (const char *)name, length);
+    if (length <= PARSER_NAME_MAX) {
+        memcpy(parser->last_name, name, length);
+        parser->last_length = length;
+        parser->last_id = id;
+    }
+
+    return id;
+}
+
+/* The records are only counted without function */
+static void parser_emit(parser_t *parser, const parser_record_t *record)
+{
+    parser->nb_record++;
+    if (parser->func != NULL)
+        parser->func(parser->data, record);
+}
+
+/* Value between 'p' and 'end', integers are parsed without strtod(). The
+   value is followed by '|' or '\n' so strtod() stops before 'end'. */
+static gboolean parser_text_number(const guint8 *p, const guint8 *end, parser_record_t *record)
+{
+    const guint8 *q = p;
+    gboolean negative = FALSE;
+    gint64 integer = 0;
+    char *stop;
+
+    if (q < end && *q == '-') {
+        negative = TRUE;
+        q++;
+    }
+
+    while (q < end && g_ascii_isdigit(*q) && integer < G_MAXINT32) {
+        integer = integer * 10 + (*q - '0');
+        q++;
+    }
+
+    if (q == end && q > p + negative) {
+        record->type = PARSER_VALUE_INT;
+        record->value = negative ? -integer : integer;
+        return TRUE;
+    }
+
+    record->type = PARSER_VALUE_FLOAT;
+    record->value = g_ascii_strtod((const char *)p, &stop);
+
+    return p < end && (const guint8 *)stop == end;
+}
+
+/* Decode "mb_<name>_<addr> <value>" or "mb_<addr> <value>" (server mode),
+   the name may contain '_'. Returns FALSE if invalid. */
+static gboolean parser_text_value(parser_t *parser, const guint8 *p, const guint8 *end, gint64 timestamp)
+{
+    parser_record_t record;
+    const guint8 *space;
+    const guint8 *digits;
+    const guint8 *q;
+    gsize name_length;
+    int addr = 0;
+
+    if (end - p < 6 || memcmp(p, "mb_", 3) != 0)
+        return FALSE;
+    p += 3;
+
+    space = memchr(p, ' ', end - p);
+    if (space == NULL)
+        return FALSE;
+
+    /* The address follows the last '_' */
+    for (digits = space; digits > p && g_ascii_isdigit(digits[-1]); digits--);
+    if (digits == space || space - digits > 7)
+        return FALSE;
+
+    if (digits == p)
+        name_length = 0;
+    else if (digits[-1] == '_')
+        name_length = digits - 1 - p;
+    else
+        return FALSE;
+
+    for (q = digits; q < space; q++) {
+        addr = addr * 10 + (*q - '0');
+    }
+    if (addr > PARSER_MAX_ADDR)
+        return FALSE;
+
+    if (!parser_text_number(space + 1, end, &record))
+        return FALSE;
+
+    record.name = parser_intern(parser, p, name_length);
+    record.addr = addr;
+    record.timestamp = timestamp;
+    parser_emit(parser, &record);
+
+    return TRUE;
+}
+
+/* Decode the complete lines of data in place, the values of a line are split
+   on '|'. The other lines ('#cycle' markers) are skipped. Returns the number
+   of bytes of the complete lines. */
+gsize parser_text(parser_t *parser, const guint8 *data, gsize length, gint64 timestamp)
+{
+    const guint8 *p = data;
+    const guint8 *end = data + length;
+    const guint8 *eol;
+
+    while (p < end && (eol = memchr(p, '\n', end - p)) != NULL) {
+        if (p[0] == 'm') {
+            while (p < eol) {
+                const guint8 *separator = memchr(p, '|', eol - p);
+
+                if (separator == NULL)
+                    separator = eol;
+
+                if (!parser_text_value(parser, p, separator, timestamp))
+                    parser->nb_invalid++;
+                p = separator + 1;
+            }
+        } else if (p[0] != '#' && p != eol) {
+            parser->nb_invalid++;
+        }
+        p = eol + 1;
+    }
+
+    return p - data;
+}
+
+/* Binary protocol - DICT frame */
+void parser_set_server(parser_t *parser, int server, const guint8 *name, gsize length)
+{
+    if (server >= parser->nb_server) {
+        parser->server_ids = g_renew(guint32, parser->server_ids, server + 1);
+        while (parser->nb_server <= server)
+            parser->server_ids[parser->nb_server++] = G_MAXUINT32;
+    }
+
+    parser->server_ids[server] = parser_intern(parser, name, length);
+}
+
+/* Binary protocol - Payload of a DATA frame */
+void parser_data(parser_t *parser, const guint8 *payload, guint32 length)
+{
+    parser_record_t record;
+    int server;
+    int addr;
+    int type;
+    int width;
+    int nb;
+    int i;
+
+    if (length < PROTO_DATA_HEADER_LENGTH) {
+        parser->nb_invalid++;
+        return;
+    }
+
+    server = proto_get_u16(payload + 8);
+    addr = proto_get_u16(payload + 10);
+    type = payload[12];
+    width = (type == PROTO_VALUE_INT) ? 1 : 2;
+    nb = proto_get_u16(payload + 14);
+    if (length != PROTO_DATA_HEADER_LENGTH + (guint32)nb * 2) {
+        parser->nb_invalid++;
+        return;
+    }
+
+    if (server >= parser->nb_server || parser->server_ids[server] == G_MAXUINT32)
+        /* Name not received */
+        parser_set_server(parser, server, (const guint8 *)"", 0);
+
+    record.name = parser->server_ids[server];
+    record.timestamp = proto_get_i64(payload);
+    payload += PROTO_DATA_HEADER_LENGTH;
+
+    for (i = 0; i + width <= nb; i += width) {
+        record.addr = addr + i;
+        if (type == PROTO_VALUE_INT) {
+            record.type = PARSER_VALUE_INT;
+            record.value = proto_get_u16(payload + 2 * i);
+        } else {
+            uint16_t tab_reg[2];
+
+            tab_reg[0] = proto_get_u16(payload + 2 * i);
+            tab_reg[1] = proto_get_u16(payload + 2 * i + 2);
+            record.type = PARSER_VALUE_FLOAT;
+            if (type == PROTO_VALUE_FLOAT_LSB)
+                record.value = modbus_get_float_dcba(tab_reg);
+            else
+                record.value = modbus_get_float(tab_reg);
+        }
+        parser_emit(parser, &record);
+    }
+}
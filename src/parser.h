@@ -0,0 +1,65 @@
+#ifndef _PARSER_H_
+#define _PARSER_H_
+
+#include <glib.h>
+
+/* Longest name kept by the cache of the last name */
+#define PARSER_NAME_MAX 128
+
+typedef enum {
+    PARSER_VALUE_INT = 0,
+    PARSER_VALUE_FLOAT
+} parser_value_t;
+
+/* Interned names of the points ("mb_<name>_<addr>" without the address),
+   shared by the connections of the recorder */
+typedef struct {
+    GMutex mutex;
+    /* Name to id + 1 */
+    GHashTable *ids;
+    /* Names by id */
+    GPtrArray *names;
+} parser_names_t;
+
+/* Value of a register (or of two registers for a float) */
+typedef struct {
+    guint32 name;
+    int addr;
+    parser_value_t type;
+    double value;
+    /* Receive time in text or time of the cycle in binary (us since Epoch) */
+    gint64 timestamp;
+} parser_record_t;
+
+typedef void (*parser_record_func_t)(gpointer data, const parser_record_t *record);
+
+/* Decoder of the records of one connection, in place and without allocation
+   once the names are interned */
+typedef struct {
+    parser_names_t *names;
+    parser_record_func_t func;
+    gpointer data;
+    /* Cache of the last name, the values of a line have the same name */
+    char last_name[PARSER_NAME_MAX];
+    gsize last_length;
+    gint64 last_id;
+    /* Binary protocol - Ids of the names by index of server */
+    guint32 *server_ids;
+    int nb_server;
+    /* Counters */
+    guint64 nb_record;
+    guint64 nb_invalid;
+} parser_t;
+
+parser_names_t* parser_names_new(void);
+void parser_names_free(parser_names_t *names);
+guint32 parser_names_intern(parser_names_t *names, const char *name, gsize length);
+const char* parser_names_get(parser_names_t *names, guint32 id);
+guint parser_names_count(parser_names_t *names);
+void parser_init(parser_t *parser, parser_names_t *names, parser_record_func_t func, gpointer data);
+void parser_clear(parser_t *parser);
+gsize parser_text(parser_t *parser, const guint8 *data, gsize length, gint64 timestamp);
+void parser_set_server(parser_t *parser, int server, const guint8 *name, gsize length);
+void parser_data(parser_t *parser, const guint8 *payload, guint32 length);
+
+#endif /* _PARSER_H_ */
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include <modbus.h>
+
+#include "chrono.h"
+#include "pipeline.h"
+
+/* MBAP header (transaction ID, protocol ID, length and unit ID) */
+#define PIPELINE_HEADER_LENGTH 7
+#define PIPELINE_REQUEST_LENGTH 12
+
+typedef struct {
+    /* Read of the plan or -1 when the slot is free */
+    int r;
+    uint16_t tid;
+    gint64 deadline;
+} pipeline_slot_t;
+
+static int pipeline_send(int s, int unit_id, uint16_t tid, plan_read_t *read)
+{
+    uint8_t req[PIPELINE_REQUEST_LENGTH];
+
+    /* MBAP header: transaction ID, protocol ID and length of the remaining bytes */
+    req[0] = tid >> 8;
+    req[1] = tid & 0xFF;
+    req[2] = 0;
+    req[3] = 0;
+    req[4] = 0;
+    req[5] = 6;
+    req[6] = unit_id;
+    /* PDU: Read Holding Registers */
+    req[7] = 0x03;
+    req[8] = read->addr >> 8;
+    req[9] = read->addr & 0xFF;
+    req[10] = read->nb >> 8;
+    req[11] = read->nb & 0xFF;
+
+    if (send(s, req, sizeof(req), MSG_NOSIGNAL) != sizeof(req))
+        return -1;
+
+    return 0;
+}
+
+/* Handle a complete response, returns the status of the exchange */
+static pipeline_status_t pipeline_receive(plan_t *plan, pipeline_slot_t *slots, int depth, int *outstanding,
+                                          int unit_id, uint8_t *rsp, int length, const char *name)
+{
+    uint16_t tid = (rsp[0] << 8) | rsp[1];
+    plan_read_t *read;
+    int i;
+    int k;
+
+    if (rsp[2] != 0 || rsp[3] != 0 || rsp[6] != unit_id) {
+        /* Not a response to our requests, they time out */
+        g_warning("Name: %s, response of protocol %d and unit %d ignored\n", name, (rsp[2] << 8) | rsp[3],
+                  rsp[6]);
+        return PIPELINE_OK;
+    }
+
+    for (k = 0; k < depth; k++) {
+        if (slots[k].r != -1 && slots[k].tid == tid)
+            break;
+    }
+
+    if (k == depth) {
+        /* Late response of a timed out request */
+        return PIPELINE_OK;
+    }
+
+    read = &(plan->reads[slots[k].r]);
+    slots[k].r = -1;
+    (*outstanding)--;
+
+    if (rsp[7] & 0x80) {
+        g_warning("Name: %s, addr:%d l:%d %s\n", name, read->addr, read->nb,
+                  modbus_strerror(MODBUS_ENOBASE + rsp[8]));
+        if (rsp[8] == MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY)
+            return PIPELINE_BUSY;
+        return PIPELINE_OK;
+    }
+
+    if (rsp[7] != 0x03 || length < PIPELINE_HEADER_LENGTH + 2 + read->nb * 2 || rsp[8] != read->nb * 2) {
+        g_warning("Name: %s, addr:%d l:%d %s\n", name, read->addr, read->nb, modbus_strerror(EMBBADDATA));
+        return PIPELINE_OK;
+    }
+
+    for (i = 0; i < read->nb; i++) {
+        plan->tab_reg[read->offset + i] = (rsp[9 + (i << 1)] << 8) | rsp[10 + (i << 1)];
+    }
+    read->ok = TRUE;
+
+    return PIPELINE_OK;
+}
+
+/* Read the due reads of the plan with up to 'depth' outstanding requests on
+   the connection of the TCP context. The responses are matched to their
+   request by the transaction, protocol and unit IDs of the MBAP header. */
+pipeline_status_t pipeline_read(modbus_t *ctx, int unit_id, uint16_t *tid, plan_t *plan, int depth,
+                                const char *name, gboolean verbose)
+{
+    pipeline_slot_t slots[PIPELINE_MAX_DEPTH];
+    /* Room for a few responses received at once */
+    uint8_t buf[MODBUS_TCP_MAX_ADU_LENGTH * 4];
+    int buf_length = 0;
+    pipeline_status_t status = PIPELINE_OK;
+    uint32_t to_sec;
+    uint32_t to_usec;
+    gint64 timeout;
+    int s = modbus_get_socket(ctx);
+    int outstanding = 0;
+    int r = 0;
+    int k;
+
+    depth = CLAMP(depth, 1, PIPELINE_MAX_DEPTH);
+    for (k = 0; k < depth; k++) {
+        slots[k].r = -1;
+    }
+
+    modbus_get_response_timeout(ctx, &to_sec, &to_usec);
+    timeout = (gint64)to_sec * G_USEC_PER_SEC + to_usec;
+
+    for (;;) {
+        struct pollfd pfd;
+        gint64 now;
+        gint64 deadline = -1;
+        int rc;
+        int length;
+
+        /* Fill the free slots with the next due reads */
+        for (k = 0; k < depth && r < plan->nb_read; k++) {
+            plan_read_t *read;
+
+            if (slots[k].r != -1)
+                continue;
+
+            while (r < plan->nb_read && !plan->reads[r].due)
+                r++;
+            if (r == plan->nb_read)
+                break;
+
+            read = &(plan->reads[r]);
+            if (verbose) {
+                g_print("Name: %s, addr:%d l:%d (pipelined)\n", name, read->addr, read->nb);
+            }
+
+            (*tid)++;
+            if (pipeline_send(s, unit_id, *tid, read) == -1)
+                return PIPELINE_ERROR;
+
+            slots[k].r = r;
+            slots[k].tid = *tid;
+            slots[k].deadline = chrono_monotonic_us() + timeout;
+            outstanding++;
+            r++;
+        }
+
+        if (outstanding == 0)
+            break;
+
+        /* Wait for the oldest deadline */
+        for (k = 0; k < depth; k++) {
+            if (slots[k].r != -1 && (deadline == -1 || slots[k].deadline < deadline))
+                deadline = slots[k].deadline;
+        }
+
+        now = chrono_monotonic_us();
+        pfd.fd = s;
+        pfd.events = POLLIN;
+        rc = (deadline > now) ? poll(&pfd, 1, (deadline - now + 999) / 1000) : 0;
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            return PIPELINE_ERROR;
+        }
+
+        if (rc == 0) {
+            /* Give up the requests not answered in time */
+            now = chrono_monotonic_us();
+            for (k = 0; k < depth; k++) {
+                if (slots[k].r != -1 && slots[k].deadline <= now) {
+                    plan_read_t *read = &(plan->reads[slots[k].r]);
+
+                    g_warning("Name: %s, addr:%d l:%d %s\n", name, read->addr, read->nb,
+                              modbus_strerror(ETIMEDOUT));
+                    slots[k].r = -1;
+                    outstanding--;
+                    status = PIPELINE_TIMEOUT;
+                }
+            }
+            continue;
+        }
+
+        rc = recv(s, buf + buf_length, sizeof(buf) - buf_length, 0);
+        if (rc <= 0) {
+            if (rc == 0)
+                errno = ECONNRESET;
+            return PIPELINE_ERROR;
+        }
+        buf_length += rc;
+
+        /* Consume the complete responses */
+        while (buf_length >= PIPELINE_HEADER_LENGTH) {
+            length = 6 + ((buf[4] << 8) | buf[5]);
+            if (length > MODBUS_TCP_MAX_ADU_LENGTH || length < PIPELINE_HEADER_LENGTH + 2) {
+                /* Lost in the stream */
+                errno = EMBBADDATA;
+                return PIPELINE_ERROR;
+            }
+            if (buf_length < length)
+                break;
+
+            if (pipeline_receive(plan, slots, depth, &outstanding, unit_id, buf, length, name) == PIPELINE_BUSY)
+                status = PIPELINE_BUSY;
+
+            buf_length -= length;
+            memmove(buf, buf + length, buf_length);
+        }
+    }
+
+    if (buf_length > 0) {
+        /* The rest of a late response would desync the next exchange, let
+           the caller reconnect */
+        g_warning("Name: %s, %d bytes of a partial response left\n", name, buf_length);
+        errno = EMBBADDATA;
+        return PIPELINE_ERROR;
+    }
+
+    return status;
+}
@@ -0,0 +1,30 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <glib.h>
+#include <inttypes.h>
+#include <modbus.h>
+
+#include "plan.h"
+
+/* Max number of outstanding requests on a connection */
+#define PIPELINE_MAX_DEPTH 16
+/* Consecutive timed out exchanges before one request at a time */
+#define PIPELINE_MAX_LOSSES 3
+/* Delay before pipelining again (us) */
+#define PIPELINE_RETRY_INTERVAL (300 * G_USEC_PER_SEC)
+
+typedef enum {
+    PIPELINE_OK,
+    /* Some requests have not been answered in time */
+    PIPELINE_TIMEOUT,
+    /* The server is busy, it doesn't handle many requests at once */
+    PIPELINE_BUSY,
+    /* The connection is lost */
+    PIPELINE_ERROR
+} pipeline_status_t;
+
+pipeline_status_t pipeline_read(modbus_t *ctx, int unit_id, uint16_t *tid, plan_t *plan, int depth,
+                                const char *name, gboolean verbose);
+
+#endif /* _PIPELINE_H_ */
@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <glib.h>
+
+#include "plan.h"
+
+/* Address entry sorted by address */
+typedef struct {
+    int index;
+    int addr;
+    int nb;
+    int interval;
+} plan_entry_t;
+
+static int plan_entry_compare(const void *a, const void *b)
+{
+    const plan_entry_t *ea = a;
+    const plan_entry_t *eb = b;
+
+    /* Only entries polled at the same rate can be merged */
+    if (ea->interval != eb->interval)
+        return ea->interval - eb->interval;
+
+    if (ea->addr != eb->addr)
+        return ea->addr - eb->addr;
+
+    /* Longest first so the shortest are merged in the same read */
+    return eb->nb - ea->nb;
+}
+
+/* Merge adjacent and overlapping address entries in the fewest reads of
+   max_nb registers. Holes of up to 'gap' registers between two entries are
+   read too when it saves a request. 'intervals' is optional, entries with
+   different intervals are never merged. */
+plan_t* plan_new(int n, const int *addresses, const int *lengths, const int *intervals, int gap, int max_nb)
+{
+    plan_t *plan;
+    plan_entry_t *entries;
+    int i;
+    int r;
+    int offset;
+
+    plan = g_new0(plan_t, 1);
+    plan->n = n;
+    plan->entry_read = g_new(int, MAX(n, 1));
+    plan->reads = g_new(plan_read_t, MAX(n, 1));
+
+    entries = g_new(plan_entry_t, MAX(n, 1));
+    for (i = 0; i < n; i++) {
+        entries[i].index = i;
+        entries[i].addr = addresses[i];
+        entries[i].nb = lengths[i];
+        entries[i].interval = intervals ? intervals[i] : 0;
+    }
+    qsort(entries, n, sizeof(plan_entry_t), plan_entry_compare);
+
+    r = -1;
+    for (i = 0; i < n; i++) {
+        plan_entry_t *e = &(entries[i]);
+
+        if (r >= 0) {
+            plan_read_t *read = &(plan->reads[r]);
+            int end = read->addr + read->nb;
+            int new_end = MAX(end, e->addr + e->nb);
+
+            if (e->interval == read->interval && e->addr <= end + gap && new_end - read->addr <= max_nb) {
+                read->nb = new_end - read->addr;
+                plan->entry_read[e->index] = r;
+                continue;
+            }
+        }
+
+        /* New read */
+        r++;
+        plan->reads[r].addr = e->addr;
+        plan->reads[r].nb = e->nb;
+        plan->reads[r].interval = e->interval;
+        plan->reads[r].due = FALSE;
+        plan->reads[r].ok = FALSE;
+        plan->entry_read[e->index] = r;
+    }
+    plan->nb_read = r + 1;
+    g_free(entries);
+
+    offset = 0;
+    for (r = 0; r < plan->nb_read; r++) {
+        plan->reads[r].offset = offset;
+        offset += plan->reads[r].nb;
+    }
+    plan->tab_reg = g_new0(uint16_t, MAX(offset, 1));
+
+    return plan;
+}
+
+void plan_free(plan_t *plan)
+{
+    if (plan == NULL)
+        return;
+
+    g_free(plan->entry_read);
+    g_free(plan->reads);
+    g_free(plan->tab_reg);
+    g_free(plan);
+}
+
+/* Whether at least one read is due */
+gboolean plan_is_due(plan_t *plan)
+{
+    int r;
+
+    for (r = 0; r < plan->nb_read; r++) {
+        if (plan->reads[r].due)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+void plan_clear_due(plan_t *plan)
+{
+    int r;
+
+    for (r = 0; r < plan->nb_read; r++) {
+        plan->reads[r].due = FALSE;
+    }
+}
+
+/* Returns the registers of the address entry 'n' starting at 'address' */
+uint16_t* plan_entry_registers(plan_t *plan, int n, int address, gboolean *ok)
+{
+    plan_read_t *read = &(plan->reads[plan->entry_read[n]]);
+
+    *ok = read->ok;
+    return plan->tab_reg + read->offset + (address - read->addr);
+}
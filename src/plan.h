@@ -0,0 +1,38 @@
+#ifndef _PLAN_H_
+#define _PLAN_H_
+
+#include <glib.h>
+#include <inttypes.h>
+
+/* A Modbus request covering one or many address entries */
+typedef struct {
+    int addr;
+    int nb;
+    /* Offset of the registers of this read in tab_reg */
+    int offset;
+    /* Polling interval of the merged entries */
+    int interval;
+    /* Whether the read is due in the current cycle */
+    gboolean due;
+    /* Whether the last read has succeeded */
+    gboolean ok;
+} plan_read_t;
+
+typedef struct {
+    int nb_read;
+    plan_read_t *reads;
+    /* Number of address entries */
+    int n;
+    /* Index of the read covering each address entry */
+    int *entry_read;
+    /* Registers of all reads */
+    uint16_t *tab_reg;
+} plan_t;
+
+plan_t* plan_new(int n, const int *addresses, const int *lengths, const int *intervals, int gap, int max_nb);
+void plan_free(plan_t *plan);
+gboolean plan_is_due(plan_t *plan);
+void plan_clear_due(plan_t *plan);
+uint16_t* plan_entry_registers(plan_t *plan, int n, int address, gboolean *ok);
+
+#endif /* _PLAN_H_ */
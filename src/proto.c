@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "proto.h"
+
+uint8_t *proto_put_u16(uint8_t *p, uint16_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+    return p + 2;
+}
+
+uint8_t *proto_put_u32(uint8_t *p, uint32_t value)
+{
+    p = proto_put_u16(p, value & 0xFFFF);
+    return proto_put_u16(p, value >> 16);
+}
+
+uint8_t *proto_put_i64(uint8_t *p, int64_t value)
+{
+    p = proto_put_u32(p, (uint64_t)value & 0xFFFFFFFF);
+    return proto_put_u32(p, (uint64_t)value >> 32);
+}
+
+uint16_t proto_get_u16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+uint32_t proto_get_u32(const uint8_t *p)
+{
+    return proto_get_u16(p) | ((uint32_t)proto_get_u16(p + 2) << 16);
+}
+
+int64_t proto_get_i64(const uint8_t *p)
+{
+    return (int64_t)(proto_get_u32(p) | ((uint64_t)proto_get_u32(p + 4) << 32));
+}
+
+/* Shortest text representation read back as the same float, 'str' must hold
+   32 bytes. Returns the length. */
+int proto_format_float(char *str, float value)
+{
+    int precision;
+    int len = 0;
+
+    for (precision = 6; precision <= 9; precision++) {
+        len = snprintf(str, 32, "%.*g", precision, value);
+        if (strtof(str, NULL) == value)
+            break;
+    }
+
+    return len;
+}
+
+/* Length of the first record of data, a line of text or a binary frame.
+   Returns 0 if the record is incomplete or -1 if the frame is invalid. */
+long proto_record_length(const uint8_t *data, size_t length, int binary)
+{
+    uint32_t frame_length;
+
+    if (!binary) {
+        const uint8_t *end = memchr(data, '\n', length);
+
+        return end != NULL ? end - data + 1 : 0;
+    }
+
+    if (length < PROTO_HEADER_LENGTH)
+        return 0;
+
+    if (data[0] != PROTO_MAGIC_0 || data[1] != PROTO_MAGIC_1 || data[2] != PROTO_VERSION)
+        return -1;
+
+    frame_length = proto_get_u32(data + 4);
+    if (frame_length > PROTO_MAX_LENGTH)
+        return -1;
+
+    return length >= PROTO_HEADER_LENGTH + frame_length ? PROTO_HEADER_LENGTH + frame_length : 0;
+}
+
+/* Length of the complete records at the start of data or -1 if a frame is
+   invalid */
+long proto_records_length(const uint8_t *data, size_t length, int binary)
+{
+    size_t offset = 0;
+    long record_length;
+
+    if (!binary) {
+        /* Up to the last line */
+        while (length > 0 && data[length - 1] != '\n')
+            length--;
+        return length;
+    }
+
+    while ((record_length = proto_record_length(data + offset, length - offset, binary)) > 0)
+        offset += record_length;
+
+    return record_length == -1 ? -1 : (long)offset;
+}
+
+/* Returns the position of the payload */
+uint8_t *proto_put_header(uint8_t *p, uint8_t type, uint32_t length)
+{
+    p[0] = PROTO_MAGIC_0;
+    p[1] = PROTO_MAGIC_1;
+    p[2] = PROTO_VERSION;
+    p[3] = type;
+    return proto_put_u32(p + 4, length);
+}
@@ -0,0 +1,54 @@
+#ifndef _PROTO_H_
+#define _PROTO_H_
+
+/* Binary protocol between the collector and the recorder.
+
+   Each frame starts with a header of 8 bytes:
+     'M' 'B' version type length (uint32, payload length)
+   followed by the payload. The integers are little endian.
+
+   PROTO_TYPE_DICT: server (uint16) then the name (without NUL), sent once by
+   connection before the first data of the server. The name is empty in
+   server/slave modes.
+
+   PROTO_TYPE_DATA: timestamp (int64, us since Epoch), server (uint16),
+   address (uint16), type (uint8), reserved (uint8), number of registers
+   (uint16) then the raw registers (uint16 each).
+
+   PROTO_TYPE_END: timestamp (int64) of the cycle, sent at the end of each
+   cycle when enabled ('#cycle <timestamp>' line in the text protocol).
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTO_MAGIC_0 'M'
+#define PROTO_MAGIC_1 'B'
+#define PROTO_VERSION 1
+
+#define PROTO_HEADER_LENGTH 8
+#define PROTO_DATA_HEADER_LENGTH 16
+/* Max payload accepted by the recorder */
+#define PROTO_MAX_LENGTH 65536
+
+#define PROTO_TYPE_DICT 1
+#define PROTO_TYPE_DATA 2
+#define PROTO_TYPE_END 3
+
+/* Same values as output_type_t */
+#define PROTO_VALUE_INT 0
+#define PROTO_VALUE_FLOAT 1
+#define PROTO_VALUE_FLOAT_LSB 2
+
+uint8_t *proto_put_u16(uint8_t *p, uint16_t value);
+uint8_t *proto_put_u32(uint8_t *p, uint32_t value);
+uint8_t *proto_put_i64(uint8_t *p, int64_t value);
+uint16_t proto_get_u16(const uint8_t *p);
+uint32_t proto_get_u32(const uint8_t *p);
+int64_t proto_get_i64(const uint8_t *p);
+int proto_format_float(char *str, float value);
+long proto_record_length(const uint8_t *data, size_t length, int binary);
+long proto_records_length(const uint8_t *data, size_t length, int binary);
+uint8_t *proto_put_header(uint8_t *p, uint8_t type, uint32_t length);
+
+#endif /* _PROTO_H_ */
@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "block.h"
+#include "proto.h"
+
+/* Segment of the store, the files are mapped read only */
+typedef struct {
+    guint64 seq;
+    /* Entries of the index, sorted by point once the segment is complete */
+    const guint8 *entries;
+    gsize nb_entry;
+    gboolean sorted;
+    gsize index_size;
+    const guint8 *blocks;
+    gsize nb_block;
+    gsize data_size;
+} query_segment_t;
+
+/* Block overlapping the range */
+typedef struct {
+    const guint8 *data;
+    gint64 first;
+} query_block_t;
+
+typedef struct {
+    gint64 timestamp;
+    double value;
+    guint8 type;
+} query_sample_t;
+
+static gboolean verbose = FALSE;
+static guint64 nb_decoded = 0;
+
+/* Returns NULL if the file is missing or empty */
+static const guint8* query_map(const char *path, gsize *size)
+{
+    struct stat st;
+    void *data;
+    int fd;
+
+    *size = 0;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        g_warning("Unable to map %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    *size = st.st_size;
+
+    return data;
+}
+
+static void query_segment_free(gpointer data)
+{
+    query_segment_t *segment = data;
+
+    if (segment->entries != NULL)
+        munmap((void *)segment->entries, segment->index_size);
+    if (segment->blocks != NULL)
+        munmap((void *)segment->blocks, segment->data_size);
+    g_free(segment);
+}
+
+static gint query_compare_segments(gconstpointer a, gconstpointer b)
+{
+    const query_segment_t *segment_a = *(query_segment_t * const *)a;
+    const query_segment_t *segment_b = *(query_segment_t * const *)b;
+
+    if (segment_a->seq == segment_b->seq)
+        return 0;
+    return segment_a->seq < segment_b->seq ? -1 : 1;
+}
+
+/* Segments ordered by sequence number. Returns NULL if the directory can't
+   be read. */
+static GPtrArray* query_open_segments(const char *dir)
+{
+    GPtrArray *segments;
+    const char *name;
+    GDir *gdir;
+
+    gdir = g_dir_open(dir, 0, NULL);
+    if (gdir == NULL) {
+        g_warning("Unable to open the store %s", dir);
+        return NULL;
+    }
+
+    segments = g_ptr_array_new_with_free_func(query_segment_free);
+    while ((name = g_dir_read_name(gdir)) != NULL) {
+        query_segment_t *segment;
+        char *end;
+        guint64 seq = g_ascii_strtoull(name, &end, 16);
+        char *path;
+
+        if (end != name + 16 || strcmp(end, ".blk") != 0)
+            continue;
+
+        segment = g_new0(query_segment_t, 1);
+        segment->seq = seq;
+
+        /* The sorted index only exists for the complete segments */
+        path = g_strdup_printf("%s/%016" G_GINT64_MODIFIER "x.pix", dir, seq);
+        segment->entries = query_map(path, &(segment->index_size));
+        g_free(path);
+        if (segment->entries != NULL) {
+            segment->sorted = TRUE;
+        } else {
+            path = g_strdup_printf("%s/%016" G_GINT64_MODIFIER "x.idx", dir, seq);
+            segment->entries = query_map(path, &(segment->index_size));
+            g_free(path);
+        }
+        segment->nb_entry = segment->index_size / BLOCK_INDEX_LENGTH;
+
+        path = g_build_filename(dir, name, NULL);
+        segment->blocks = query_map(path, &(segment->data_size));
+        g_free(path);
+        segment->nb_block = segment->data_size / BLOCK_SIZE;
+
+        g_ptr_array_add(segments, segment);
+    }
+    g_dir_close(gdir);
+
+    g_ptr_array_sort(segments, query_compare_segments);
+
+    return segments;
+}
+
+/* Number of the point in the store, -1 if unknown. Without 'name', all the
+   points are listed. */
+static gint64 query_find_point(const char *dir, const char *name, int addr)
+{
+    char *path = g_build_filename(dir, "points", NULL);
+    gint64 point = -1;
+    gchar *contents;
+    gchar **lines;
+    int i;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_warning("Unable to read %s", path);
+        g_free(path);
+        return -1;
+    }
+    g_free(path);
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i] != NULL && point == -1; i++) {
+        gchar **fields = g_strsplit(lines[i], "\t", 3);
+
+        if (g_strv_length(fields) == 3) {
+            if (name == NULL)
+                printf("%s\t%s\n", fields[2], fields[1]);
+            else if (strcmp(fields[2], name) == 0 && atoi(fields[1]) == addr)
+                point = strtoul(fields[0], NULL, 10);
+        }
+        g_strfreev(fields);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    return point;
+}
+
+static void query_add_block(const query_segment_t *segment, const guint8 *entry, GArray *blocks)
+{
+    guint32 block = proto_get_u32(entry + 4);
+    query_block_t found;
+
+    /* The index is written after the blocks */
+    if (block >= segment->nb_block)
+        return;
+
+    found.data = segment->blocks + (gsize)block * BLOCK_SIZE;
+    found.first = proto_get_i64(entry + 8);
+    g_array_append_val(blocks, found);
+}
+
+/* Blocks of the point of the segment overlapping [from, to] */
+static void query_find_blocks(const query_segment_t *segment, guint32 point, gint64 from, gint64 to,
+                              GArray *blocks)
+{
+    const guint8 *entries = segment->entries;
+    gsize low = 0;
+    gsize high = segment->nb_entry;
+    gsize i;
+
+    if (!segment->sorted) {
+        /* Segment being written, its index is small */
+        for (i = 0; i < segment->nb_entry; i++) {
+            const guint8 *entry = entries + i * BLOCK_INDEX_LENGTH;
+
+            if (proto_get_u32(entry) == point && proto_get_i64(entry + 8) <= to &&
+                proto_get_i64(entry + 16) >= from)
+                query_add_block(segment, entry, blocks);
+        }
+        return;
+    }
+
+    /* First entry of the point starting at 'from' or later */
+    while (low < high) {
+        gsize middle = low + (high - low) / 2;
+        const guint8 *entry = entries + middle * BLOCK_INDEX_LENGTH;
+        guint32 entry_point = proto_get_u32(entry);
+
+        if (entry_point < point || (entry_point == point && proto_get_i64(entry + 8) < from))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    /* The previous blocks may end after 'from' */
+    while (low > 0 && proto_get_u32(entries + (low - 1) * BLOCK_INDEX_LENGTH) == point &&
+           proto_get_i64(entries + (low - 1) * BLOCK_INDEX_LENGTH + 16) >= from)
+        low--;
+
+    for (i = low; i < segment->nb_entry; i++) {
+        const guint8 *entry = entries + i * BLOCK_INDEX_LENGTH;
+
+        if (proto_get_u32(entry) != point || proto_get_i64(entry + 8) > to)
+            break;
+        if (proto_get_i64(entry + 16) >= from)
+            query_add_block(segment, entry, blocks);
+    }
+}
+
+static gint query_compare_blocks(gconstpointer a, gconstpointer b)
+{
+    const query_block_t *block_a = a;
+    const query_block_t *block_b = b;
+
+    if (block_a->first == block_b->first)
+        return 0;
+    return block_a->first < block_b->first ? -1 : 1;
+}
+
+/* Append the samples of the block in [from, to] */
+static void query_decode(const query_block_t *block, guint32 point, gint64 from, gint64 to, GArray *samples)
+{
+    block_decoder_t decoder;
+    query_sample_t sample;
+    int rc;
+
+    if (block_decoder_init(&decoder, block->data) == -1 || decoder.point != point) {
+        g_warning("Invalid block of point %u", point);
+        return;
+    }
+    nb_decoded++;
+
+    sample.type = decoder.type;
+    while ((rc = block_decoder_next(&decoder, &(sample.timestamp), &(sample.value))) == 1) {
+        if (sample.timestamp >= from && sample.timestamp <= to)
+            g_array_append_val(samples, sample);
+    }
+
+    if (rc == -1)
+        g_warning("Corrupted block of point %u", point);
+}
+
+static void query_print(const query_sample_t *sample)
+{
+    char str[32];
+
+    if (sample->type == BLOCK_TYPE_INT)
+        snprintf(str, sizeof(str), "%lld", (long long)sample->value);
+    else
+        proto_format_float(str, sample->value);
+
+    printf("%lld.%03d\t%s\n", (long long)(sample->timestamp / 1000), (int)(sample->timestamp % 1000), str);
+}
+
+/* Seconds since Epoch or, when negative, relative to now. Returns ms. */
+static gint64 query_parse_time(const char *str)
+{
+    char *end;
+    double value = g_ascii_strtod(str, &end);
+
+    if (end == str || *end != '\0') {
+        fprintf(stderr, "Invalid time: %s\n", str);
+        exit(1);
+    }
+
+    if (value < 0)
+        return g_get_real_time() / 1000 + (gint64)(value * 1000);
+
+    return (gint64)(value * 1000);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s --store DIR [--from SEC] [--to SEC] [--last N] [--verbose] NAME ADDR\n"
+            "       %s --store DIR --list\n", name, name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        {"store", required_argument, NULL, 's'},
+        {"from", required_argument, NULL, 'f'},
+        {"to", required_argument, NULL, 't'},
+        {"last", required_argument, NULL, 'n'},
+        {"list", no_argument, NULL, 'l'},
+        {"verbose", no_argument, NULL, 'v'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *dir = NULL;
+    gint64 from = G_MININT64;
+    gint64 to = G_MAXINT64;
+    gboolean list = FALSE;
+    int last = 0;
+    GPtrArray *segments;
+    GArray *blocks;
+    GArray *samples;
+    gint64 start;
+    gint64 point;
+    guint i;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "s:f:t:n:lv", long_options, NULL)) != -1) {
+        if (c == 's')
+            dir = optarg;
+        else if (c == 'f')
+            from = query_parse_time(optarg);
+        else if (c == 't')
+            to = query_parse_time(optarg);
+        else if (c == 'n')
+            last = atoi(optarg);
+        else if (c == 'l')
+            list = TRUE;
+        else if (c == 'v')
+            verbose = TRUE;
+        else
+            usage(argv[0]);
+    }
+
+    if (dir == NULL)
+        usage(argv[0]);
+
+    if (list) {
+        query_find_point(dir, NULL, 0);
+        return 0;
+    }
+
+    if (optind + 2 != argc)
+        usage(argv[0]);
+
+    start = g_get_monotonic_time();
+    point = query_find_point(dir, argv[optind], atoi(argv[optind + 1]));
+    if (point == -1) {
+        fprintf(stderr, "Unknown point %s %s\n", argv[optind], argv[optind + 1]);
+        return 1;
+    }
+
+    segments = query_open_segments(dir);
+    if (segments == NULL)
+        return 1;
+
+    /* Only the blocks overlapping the range are decoded */
+    blocks = g_array_new(FALSE, FALSE, sizeof(query_block_t));
+    for (i = 0; i < segments->len; i++)
+        query_find_blocks(g_ptr_array_index(segments, i), point, from, to, blocks);
+    g_array_sort(blocks, query_compare_blocks);
+
+    samples = g_array_new(FALSE, FALSE, sizeof(query_sample_t));
+    if (last > 0) {
+        GArray *block_samples = g_array_new(FALSE, FALSE, sizeof(query_sample_t));
+
+        /* From the most recent block until enough samples */
+        for (i = blocks->len; i > 0 && samples->len < (guint)last; i--) {
+            guint needed = last - samples->len;
+
+            g_array_set_size(block_samples, 0);
+            query_decode(&g_array_index(blocks, query_block_t, i - 1), point, from, to, block_samples);
+            if (block_samples->len > needed)
+                g_array_remove_range(block_samples, 0, block_samples->len - needed);
+            g_array_prepend_vals(samples, block_samples->data, block_samples->len);
+        }
+        g_array_free(block_samples, TRUE);
+    } else {
+        for (i = 0; i < blocks->len; i++)
+            query_decode(&g_array_index(blocks, query_block_t, i), point, from, to, samples);
+    }
+
+    for (i = 0; i < samples->len; i++)
+        query_print(&g_array_index(samples, query_sample_t, i));
+
+    if (verbose)
+        fprintf(stderr, "%u samples, %llu blocks decoded of %u segments in %.3f ms\n", samples->len,
+                (unsigned long long)nb_decoded, segments->len, (g_get_monotonic_time() - start) / 1000.0);
+
+    g_array_free(samples, TRUE);
+    g_array_free(blocks, TRUE);
+    g_ptr_array_free(segments, TRUE);
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include <string.h>
+#include <glib.h>
+
+#include "queue.h"
+
+/* The sequence is stored at the start of each cell */
+#define QUEUE_CELL_HEADER 8
+
+static volatile gint* queue_sequence(queue_t *queue, guint pos)
+{
+    return (volatile gint *)(queue->cells + (pos & (queue->capacity - 1)) * queue->stride);
+}
+
+queue_t* queue_new(guint capacity, gsize element_size)
+{
+    queue_t *queue = g_new(queue_t, 1);
+    guint i;
+
+    /* Rounded up to a power of two */
+    queue->capacity = 2;
+    while (queue->capacity < capacity)
+        queue->capacity *= 2;
+
+    queue->element_size = element_size;
+    queue->stride = (QUEUE_CELL_HEADER + element_size + 7) & ~((gsize)7);
+    queue->cells = g_malloc(queue->capacity * queue->stride);
+    for (i = 0; i < queue->capacity; i++) {
+        g_atomic_int_set(queue_sequence(queue, i), i);
+    }
+
+    g_atomic_int_set(&(queue->enqueue_pos), 0);
+    g_atomic_int_set(&(queue->dequeue_pos), 0);
+    g_atomic_int_set(&(queue->sleeping), 0);
+    g_mutex_init(&(queue->mutex));
+    g_cond_init(&(queue->cond));
+
+    return queue;
+}
+
+void queue_free(queue_t *queue)
+{
+    if (queue == NULL)
+        return;
+
+    g_mutex_clear(&(queue->mutex));
+    g_cond_clear(&(queue->cond));
+    g_free(queue->cells);
+    g_free(queue);
+}
+
+/* Returns FALSE when the queue is full */
+gboolean queue_push(queue_t *queue, const void *element)
+{
+    guint pos = g_atomic_int_get(&(queue->enqueue_pos));
+    volatile gint *sequence;
+
+    for (;;) {
+        gint diff;
+
+        sequence = queue_sequence(queue, pos);
+        diff = (gint)((guint)g_atomic_int_get(sequence) - pos);
+        if (diff == 0) {
+            /* Free cell, claim the position */
+            if (g_atomic_int_compare_and_exchange(&(queue->enqueue_pos), pos, pos + 1))
+                break;
+            pos = g_atomic_int_get(&(queue->enqueue_pos));
+        } else if (diff < 0) {
+            /* Not yet consumed since the last round */
+            return FALSE;
+        } else {
+            /* Claimed by another producer */
+            pos = g_atomic_int_get(&(queue->enqueue_pos));
+        }
+    }
+
+    memcpy((guint8 *)sequence + QUEUE_CELL_HEADER, element, queue->element_size);
+    g_atomic_int_set(sequence, pos + 1);
+
+    if (g_atomic_int_get(&(queue->sleeping))) {
+        g_mutex_lock(&(queue->mutex));
+        g_cond_signal(&(queue->cond));
+        g_mutex_unlock(&(queue->mutex));
+    }
+
+    return TRUE;
+}
+
+/* Returns FALSE when the queue is empty */
+gboolean queue_pop(queue_t *queue, void *element)
+{
+    guint pos = g_atomic_int_get(&(queue->dequeue_pos));
+    volatile gint *sequence;
+
+    for (;;) {
+        gint diff;
+
+        sequence = queue_sequence(queue, pos);
+        diff = (gint)((guint)g_atomic_int_get(sequence) - (pos + 1));
+        if (diff == 0) {
+            if (g_atomic_int_compare_and_exchange(&(queue->dequeue_pos), pos, pos + 1))
+                break;
+            pos = g_atomic_int_get(&(queue->dequeue_pos));
+        } else if (diff < 0) {
+            return FALSE;
+        } else {
+            pos = g_atomic_int_get(&(queue->dequeue_pos));
+        }
+    }
+
+    memcpy(element, (guint8 *)sequence + QUEUE_CELL_HEADER, queue->element_size);
+    /* Free for the producer of the next round */
+    g_atomic_int_set(sequence, pos + queue->capacity);
+
+    return TRUE;
+}
+
+guint queue_depth(queue_t *queue)
+{
+    return (guint)g_atomic_int_get(&(queue->enqueue_pos)) - (guint)g_atomic_int_get(&(queue->dequeue_pos));
+}
+
+/* Wait for an element until end_time (monotonic time) */
+void queue_wait(queue_t *queue, gint64 end_time)
+{
+    g_mutex_lock(&(queue->mutex));
+    g_atomic_int_set(&(queue->sleeping), 1);
+    if (queue_depth(queue) == 0)
+        g_cond_wait_until(&(queue->cond), &(queue->mutex), end_time);
+    g_atomic_int_set(&(queue->sleeping), 0);
+    g_mutex_unlock(&(queue->mutex));
+}
@@ -0,0 +1,31 @@
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include <glib.h>
+
+/* Bounded lock-free queue of fixed size elements for many producers and
+   consumers (Dmitry Vyukov's algorithm). Each cell has a sequence number
+   telling whether it is free for the producer of a position or filled for its
+   consumer. */
+typedef struct {
+    /* Power of two */
+    guint capacity;
+    gsize element_size;
+    gsize stride;
+    guint8 *cells;
+    volatile gint enqueue_pos;
+    volatile gint dequeue_pos;
+    /* Wake up of a waiting consumer */
+    volatile gint sleeping;
+    GMutex mutex;
+    GCond cond;
+} queue_t;
+
+queue_t* queue_new(guint capacity, gsize element_size);
+void queue_free(queue_t *queue);
+gboolean queue_push(queue_t *queue, const void *element);
+gboolean queue_pop(queue_t *queue, void *element);
+guint queue_depth(queue_t *queue);
+void queue_wait(queue_t *queue, gint64 end_time);
+
+#endif /* _QUEUE_H_ */
@@ -0,0 +1,119 @@
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+#include <modbus.h>
+
+#include "rbe.h"
+
+rbe_t* rbe_new(int n, const int *lengths, double deadband, gboolean percent, int heartbeat)
+{
+    rbe_t *rbe = g_new(rbe_t, 1);
+    int nb_reg = 0;
+    int i;
+
+    rbe->deadband = deadband;
+    rbe->percent = percent;
+    rbe->heartbeat = heartbeat;
+
+    rbe->entry_offset = g_new(int, MAX(n, 1));
+    for (i = 0; i < n; i++) {
+        rbe->entry_offset[i] = nb_reg;
+        nb_reg += lengths[i];
+    }
+
+    rbe->image = g_new0(uint16_t, MAX(nb_reg, 1));
+    rbe->age = g_new0(guint16, MAX(nb_reg, 1));
+
+    return rbe;
+}
+
+void rbe_free(rbe_t *rbe)
+{
+    if (rbe == NULL)
+        return;
+
+    g_free(rbe->entry_offset);
+    g_free(rbe->image);
+    g_free(rbe->age);
+    g_free(rbe);
+}
+
+static float rbe_get_float(output_type_t type, const uint16_t *src)
+{
+    if (type == OUTPUT_TYPE_FLOAT_LSB)
+        return modbus_get_float_dcba(src);
+
+    return modbus_get_float(src);
+}
+
+static gboolean rbe_float_changed(rbe_t *rbe, float last, float value)
+{
+    double delta;
+
+    if (isnan(last) || isnan(value))
+        return isnan(last) != isnan(value);
+
+    delta = fabs((double)value - (double)last);
+    if (rbe->percent)
+        return delta > fabs(last) * rbe->deadband / 100.0;
+
+    return delta > rbe->deadband;
+}
+
+/* Set mask[i] for each value of the entry 'n' to report: changed values
+   (exact match for integers, out of the deadband for floats), never
+   reported values and values due for a heartbeat. The reported registers
+   are saved in the image. Returns the number of values to report. */
+int rbe_filter(rbe_t *rbe, int n, int nb_reg, output_type_t type, const uint16_t *tab_reg, guint8 *mask)
+{
+    uint16_t *image = rbe->image + rbe->entry_offset[n];
+    guint16 *age = rbe->age + rbe->entry_offset[n];
+    gboolean is_integer = (type == OUTPUT_TYPE_INT);
+    int step = is_integer ? 1 : 2;
+    int nb = 0;
+    int i;
+    int j;
+
+    for (i = 0, j = 0; j + step <= nb_reg; i++, j += step) {
+        gboolean report;
+
+        if (age[j] == 0) {
+            report = TRUE;
+        } else if (rbe->heartbeat > 0 && age[j] >= rbe->heartbeat) {
+            report = TRUE;
+        } else if (is_integer) {
+            report = (image[j] != tab_reg[j]);
+        } else {
+            report = rbe_float_changed(rbe, rbe_get_float(type, image + j), rbe_get_float(type, tab_reg + j));
+        }
+
+        if (report) {
+            memcpy(image + j, tab_reg + j, step * sizeof(uint16_t));
+            age[j] = 1;
+            nb++;
+        } else if (age[j] < G_MAXUINT16) {
+            age[j]++;
+        }
+        mask[i] = report;
+    }
+
+    return nb;
+}
+
+/* Parse an absolute deadband ("0.5") or a percentage of the last value
+   ("2%") */
+gboolean rbe_parse_deadband(const char *deadband_string, double *deadband, gboolean *percent)
+{
+    char *end;
+
+    if (deadband_string == NULL)
+        return FALSE;
+
+    *deadband = g_ascii_strtod(deadband_string, &end);
+    if (end == deadband_string || *deadband < 0)
+        g_error("invalid deadband '%s'", deadband_string);
+
+    *percent = (*end == '%');
+
+    return TRUE;
+}
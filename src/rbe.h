@@ -0,0 +1,31 @@
+#ifndef _RBE_H_
+#define _RBE_H_
+
+#include <glib.h>
+#include <inttypes.h>
+
+#include "output.h"
+
+/* Report by exception of the values of a server */
+typedef struct {
+    /* Min change of a float to be reported */
+    double deadband;
+    /* Whether the deadband is a percentage of the last value */
+    gboolean percent;
+    /* Report unchanged values every N polls (0 to never) */
+    int heartbeat;
+    /* Offset of each address entry in the image */
+    int *entry_offset;
+    /* Last reported registers of all entries */
+    uint16_t *image;
+    /* Number of polls since the last report of each register (0 if never
+       reported) */
+    guint16 *age;
+} rbe_t;
+
+rbe_t* rbe_new(int n, const int *lengths, double deadband, gboolean percent, int heartbeat);
+void rbe_free(rbe_t *rbe);
+int rbe_filter(rbe_t *rbe, int n, int nb_reg, output_type_t type, const uint16_t *tab_reg, guint8 *mask);
+gboolean rbe_parse_deadband(const char *deadband_string, double *deadband, gboolean *percent);
+
+#endif /* _RBE_H_ */
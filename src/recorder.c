@@ -2,17 +2,63 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <errno.h>
+#include <getopt.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <glib.h>
+#include <modbus.h>
 
-#define RECV_MAX 256
+#include "parser.h"
+#include "proto.h"
+#include "ring.h"
+#include "store.h"
+
+/* Min free space of the receive buffer */
+#define RECV_MAX 65536
 #define SOCK_PATH "/tmp/mbsocket"
+/* Default size of the shared memory ring in MiB */
+#define RING_SIZE 4
+#define MAX_EVENTS 64
+/* Longest text line, a collector which never ends its lines is dropped */
+#define LINE_MAX_LENGTH PROTO_MAX_LENGTH
+/* Size of a printed value of a binary record, without the name */
+#define VALUE_MAX_LENGTH 48
+
+#define RECORDER_PROTOCOL_UNKNOWN 0
+#define RECORDER_PROTOCOL_TEXT 1
+#define RECORDER_PROTOCOL_BINARY 2
+
+/* Connection of a collector, the protocol is detected on the first bytes and
+   each connection has its own buffer so the records of the collectors are
+   never mixed */
+typedef struct {
+    int fd;
+    int protocol;
+    /* Received bytes not yet handled */
+    uint8_t *buffer;
+    size_t length;
+    size_t size;
+    /* Binary protocol - Names of the servers by index */
+    char **names;
+    int nb_name;
+    parser_t parser;
+} recorder_conn_t;
 
 static volatile int stop = 0;
 static volatile int s = -1;
+static ring_t ring;
+/* Names of all the connections */
+static parser_names_t *names;
+/* NULL without --store */
+static store_t *store = NULL;
+/* Counters of the closed connections */
+static GMutex stats_mutex;
+static guint64 nb_record = 0;
+static guint64 nb_invalid = 0;
 
 static void sigint_stop(int dummy)
 {
@@ -22,18 +68,372 @@ static void sigint_stop(int dummy)
     s = -1;
 }
 
+static void recorder_record(gpointer data, const parser_record_t *record)
+{
+    store_add(data, record);
+}
+
+static void recorder_conn_init(recorder_conn_t *conn, int fd)
+{
+    conn->fd = fd;
+    conn->protocol = RECORDER_PROTOCOL_UNKNOWN;
+    conn->size = RECV_MAX;
+    conn->buffer = malloc(conn->size);
+    conn->length = 0;
+    conn->names = NULL;
+    conn->nb_name = 0;
+    parser_init(&(conn->parser), names, store != NULL ? recorder_record : NULL, store);
+}
+
+static void recorder_conn_clear(recorder_conn_t *conn)
+{
+    int i;
+
+    for (i = 0; i < conn->nb_name; i++) {
+        free(conn->names[i]);
+    }
+    free(conn->names);
+    conn->names = NULL;
+    conn->nb_name = 0;
+    free(conn->buffer);
+    if (conn->fd != -1)
+        close(conn->fd);
+
+    g_mutex_lock(&stats_mutex);
+    nb_record += conn->parser.nb_record;
+    nb_invalid += conn->parser.nb_invalid;
+    g_mutex_unlock(&stats_mutex);
+    parser_clear(&(conn->parser));
+}
+
+static void recorder_set_name(recorder_conn_t *conn, const uint8_t *payload, uint32_t length)
+{
+    int server;
+
+    if (length < 2)
+        return;
+
+    server = proto_get_u16(payload);
+    if (server >= conn->nb_name) {
+        conn->names = realloc(conn->names, (server + 1) * sizeof(char *));
+        memset(conn->names + conn->nb_name, 0, (server + 1 - conn->nb_name) * sizeof(char *));
+        conn->nb_name = server + 1;
+    }
+
+    free(conn->names[server]);
+    conn->names[server] = strndup((const char *)payload + 2, length - 2);
+}
+
+/* Print the values as the text protocol, the line is written at once */
+static void recorder_print_data(recorder_conn_t *conn, const uint8_t *payload, uint32_t length)
+{
+    const char *name = "";
+    uint16_t tab_reg[MODBUS_MAX_READ_REGISTERS];
+    char buffer[8192];
+    char *line;
+    char *p;
+    size_t size;
+    int server;
+    int addr;
+    int type;
+    int nb;
+    int i;
+
+    if (length < PROTO_DATA_HEADER_LENGTH)
+        return;
+
+    server = proto_get_u16(payload + 8);
+    addr = proto_get_u16(payload + 10);
+    type = payload[12];
+    nb = proto_get_u16(payload + 14);
+    if (nb == 0 || nb > MODBUS_MAX_READ_REGISTERS || length != PROTO_DATA_HEADER_LENGTH + (uint32_t)nb * 2)
+        return;
+
+    if (server < conn->nb_name && conn->names[server] != NULL)
+        name = conn->names[server];
+
+    for (i = 0; i < nb; i++) {
+        tab_reg[i] = proto_get_u16(payload + PROTO_DATA_HEADER_LENGTH + 2 * i);
+    }
+
+    size = (size_t)nb * (strlen(name) + VALUE_MAX_LENGTH) + 1;
+    line = size <= sizeof(buffer) ? buffer : malloc(size);
+    p = line;
+
+    for (i = 0; i < nb; i += (type == PROTO_VALUE_INT) ? 1 : 2) {
+        const char *separator = (i == 0) ? "" : "|";
+
+        if (name[0] == '\0')
+            p += sprintf(p, "%smb_%d ", separator, addr + i);
+        else
+            p += sprintf(p, "%smb_%s_%d ", separator, name, addr + i);
+
+        if (type == PROTO_VALUE_INT || i + 1 >= nb) {
+            p += sprintf(p, "%d", tab_reg[i]);
+        } else {
+            float value;
+
+            if (type == PROTO_VALUE_FLOAT_LSB)
+                value = modbus_get_float_dcba(tab_reg + i);
+            else
+                value = modbus_get_float(tab_reg + i);
+
+            p += proto_format_float(p, value);
+        }
+    }
+    *p++ = '\n';
+    fwrite(line, 1, p - line, stdout);
+
+    if (line != buffer)
+        free(line);
+}
+
+/* Handle the complete frames of data. Returns the number of bytes handled or
+   -1 on a protocol error. */
+static int recorder_handle_binary(recorder_conn_t *conn, const uint8_t *data, size_t length)
+{
+    size_t offset = 0;
+
+    while (length - offset >= PROTO_HEADER_LENGTH) {
+        const uint8_t *header = data + offset;
+        uint32_t frame_length;
+
+        if (header[0] != PROTO_MAGIC_0 || header[1] != PROTO_MAGIC_1 || header[2] != PROTO_VERSION) {
+            fprintf(stderr, "Invalid frame header\n");
+            return -1;
+        }
+
+        frame_length = proto_get_u32(header + 4);
+        if (frame_length > PROTO_MAX_LENGTH) {
+            fprintf(stderr, "Frame too long (%u bytes)\n", frame_length);
+            return -1;
+        }
+
+        if (length - offset < PROTO_HEADER_LENGTH + frame_length)
+            break;
+
+        if (header[3] == PROTO_TYPE_DICT && frame_length >= 2) {
+            recorder_set_name(conn, header + PROTO_HEADER_LENGTH, frame_length);
+            parser_set_server(&(conn->parser), proto_get_u16(header + PROTO_HEADER_LENGTH),
+                              header + PROTO_HEADER_LENGTH + 2, frame_length - 2);
+        } else if (header[3] == PROTO_TYPE_DATA) {
+            recorder_print_data(conn, header + PROTO_HEADER_LENGTH, frame_length);
+            parser_data(&(conn->parser), header + PROTO_HEADER_LENGTH, frame_length);
+        }
+        else if (header[3] == PROTO_TYPE_END && frame_length >= 8)
+            printf("#cycle %lld\n", (long long)proto_get_i64(header + PROTO_HEADER_LENGTH));
+        /* Unknown types are skipped */
+
+        offset += PROTO_HEADER_LENGTH + frame_length;
+    }
+
+    return offset;
+}
+
+/* Print the complete records of data, stdout is locked so the lines of the
+   socket and of the ring are not mixed. Returns the number of bytes handled
+   or -1 on a protocol error. */
+static int recorder_handle(recorder_conn_t *conn, const uint8_t *data, size_t length)
+{
+    int handled;
+
+    if (length == 0)
+        return 0;
+
+    if (conn->protocol == RECORDER_PROTOCOL_UNKNOWN) {
+        /* Text lines start with 'mb_' */
+        if (data[0] != PROTO_MAGIC_0)
+            conn->protocol = RECORDER_PROTOCOL_TEXT;
+        else
+            conn->protocol = RECORDER_PROTOCOL_BINARY;
+    }
+
+    flockfile(stdout);
+    if (conn->protocol == RECORDER_PROTOCOL_TEXT) {
+        /* Complete lines only */
+        handled = parser_text(&(conn->parser), data, length, g_get_real_time());
+        fwrite(data, 1, handled, stdout);
+        if (length - handled > LINE_MAX_LENGTH) {
+            fprintf(stderr, "Line too long (more than %d bytes)\n", LINE_MAX_LENGTH);
+            handled = -1;
+        }
+    } else {
+        handled = recorder_handle_binary(conn, data, length);
+    }
+    funlockfile(stdout);
+
+    return handled;
+}
+
+/* Returns -1 when the connection must be closed */
+static int recorder_receive(recorder_conn_t *conn)
+{
+    int handled;
+    int n;
+
+    if (conn->size - conn->length < RECV_MAX) {
+        conn->size *= 2;
+        conn->buffer = realloc(conn->buffer, conn->size);
+    }
+
+    /* The records are parsed in place, only the last partial one is moved */
+    n = read(conn->fd, conn->buffer + conn->length, conn->size - conn->length);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+
+    if (n <= 0) {
+        if (n == -1)
+            perror("recv");
+        return -1;
+    }
+    conn->length += n;
+
+    handled = recorder_handle(conn, conn->buffer, conn->length);
+    if (handled == -1)
+        return -1;
+
+    conn->length -= handled;
+    memmove(conn->buffer, conn->buffer + handled, conn->length);
+
+    return 0;
+}
+
+/* Accept the pending connections of the collectors */
+static void recorder_accept(int epfd, GList **conns)
+{
+    for (;;) {
+        struct epoll_event ev;
+        recorder_conn_t *conn;
+        int fd;
+
+        fd = accept4(s, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && !stop)
+                perror("accept");
+            return;
+        }
+
+        conn = malloc(sizeof(recorder_conn_t));
+        recorder_conn_init(conn, fd);
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl");
+            recorder_conn_clear(conn);
+            free(conn);
+            continue;
+        }
+        *conns = g_list_prepend(*conns, conn);
+    }
+}
+
+/* The socket is removed from the epoll set by close() */
+static void recorder_close(recorder_conn_t *conn, GList **conns)
+{
+    *conns = g_list_remove(*conns, conn);
+    recorder_conn_clear(conn);
+    free(conn);
+}
+
+/* Records of the shared memory ring, read in place */
+static gpointer recorder_ring_thread(gpointer data)
+{
+    recorder_conn_t conn;
+
+    recorder_conn_init(&conn, -1);
+    while (!stop) {
+        const uint8_t *message;
+        uint32_t length;
+        uint32_t flags;
+
+        if (ring_read(&ring, &message, &length, &flags, 1000) == 0)
+            continue;
+
+        if (flags & RING_FLAG_NEW_SESSION) {
+            /* New collector */
+            recorder_conn_clear(&conn);
+            recorder_conn_init(&conn, -1);
+        }
+
+        /* The messages only contain complete records */
+        if (recorder_handle(&conn, message, length) == -1) {
+            recorder_conn_clear(&conn);
+            recorder_conn_init(&conn, -1);
+        }
+        ring_release(&ring, length);
+    }
+    recorder_conn_clear(&conn);
+
+    return NULL;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--shm FILE] [--shmsize MiB] [--store DIR] [--storeage SEC]\n", name);
+    exit(1);
+}
+
 int main(int argc, char **argv)
 {
+    static const struct option long_options[] = {
+        {"shm", required_argument, NULL, 'm'},
+        {"shmsize", required_argument, NULL, 'z'},
+        {"store", required_argument, NULL, 's'},
+        {"storeage", required_argument, NULL, 'a'},
+        {NULL, 0, NULL, 0}
+    };
     struct sockaddr_un server;
-    char str[RECV_MAX];
-    int msgsock = -1;
-    int error;
+    struct epoll_event ev;
+    struct epoll_event events[MAX_EVENTS];
+    GList *conns = NULL;
+    GThread *ring_thread = NULL;
+    const char *ring_file = NULL;
+    int ring_size = RING_SIZE;
+    const char *store_dir = NULL;
+    int store_age = STORE_MAX_AGE;
+    int epfd;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "m:s:", long_options, NULL)) != -1) {
+        if (c == 'm')
+            ring_file = optarg;
+        else if (c == 'z')
+            ring_size = atoi(optarg);
+        else if (c == 's')
+            store_dir = optarg;
+        else if (c == 'a')
+            store_age = atoi(optarg);
+        else
+            usage(argv[0]);
+    }
 
     /* Disable buffering */
     setbuf(stdout, NULL);
     signal(SIGINT, sigint_stop);
+    names = parser_names_new();
+
+    if (store_dir != NULL) {
+        store = store_open(store_dir, names, store_age);
+        if (store == NULL)
+            exit(1);
+    }
+
+    if (ring_file != NULL) {
+        uint64_t capacity = 1 << 16;
+
+        /* Rounded up to a power of two */
+        while (capacity < (uint64_t)ring_size * 1024 * 1024)
+            capacity *= 2;
+
+        if (ring_create(&ring, ring_file, capacity) == -1) {
+            perror("ring");
+            exit(1);
+        }
+        ring_thread = g_thread_new("ring", recorder_ring_thread, NULL);
+    }
 
-    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    if ((s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
         perror("socket");
         exit(1);
     }
@@ -45,38 +445,51 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    if (listen(s, 5) == -1) {
+    if (listen(s, SOMAXCONN) == -1) {
         perror("listen");
         exit(1);
     }
 
+    /* Any number of collectors at once */
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    /* NULL for the listening socket */
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
     while (!stop) {
-        msgsock = accept4(s, 0, 0, SOCK_CLOEXEC);
-        if (msgsock == -1) {
-            unlink(server.sun_path);
-            perror("accept");
-            exit(1);
+        int nb;
+        int i;
+
+        nb = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        if (nb == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
         }
-        error = 0;
-        while (!error && !stop) {
-            int n;
-
-            n = read(msgsock, str, RECV_MAX - 1);
-            if (n <= 0) {
-                perror("recv");
-                error = 1;
-            } else {
-                str[n] = '\0';
-                printf("%s", str);
-            }
+
+        for (i = 0; i < nb && !stop; i++) {
+            recorder_conn_t *conn = events[i].data.ptr;
+
+            if (conn == NULL)
+                recorder_accept(epfd, &conns);
+            else if (recorder_receive(conn) == -1)
+                recorder_close(conn, &conns);
         }
-        close(msgsock);
-        msgsock = -1;
     }
 
-    if (msgsock != -1) {
-        close(msgsock);
-    }
+    while (conns != NULL)
+        recorder_close(conns->data, &conns);
+    close(epfd);
 
     /* Close socket first to not wait locked file */
     if (s != -1) {
@@ -84,5 +497,17 @@ int main(int argc, char **argv)
     }
     unlink(server.sun_path);
 
+    if (ring_file != NULL) {
+        g_thread_join(ring_thread);
+        ring_destroy(&ring, ring_file);
+    }
+
+    /* After the last records */
+    store_close(store);
+
+    fprintf(stderr, "%llu records of %u names, %llu invalid\n", (unsigned long long)nb_record,
+            parser_names_count(names), (unsigned long long)nb_invalid);
+    parser_names_free(names);
+
     return 0;
 }
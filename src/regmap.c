@@ -0,0 +1,353 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <glib.h>
+#include <modbus.h>
+
+#include "regmap.h"
+
+regmap_t* regmap_new(void)
+{
+    regmap_t *regmap = g_new0(regmap_t, 1);
+
+    regmap->areas[REGMAP_COILS].value_size = 1;
+    regmap->areas[REGMAP_DISCRETE_INPUTS].value_size = 1;
+    regmap->areas[REGMAP_HOLDING_REGISTERS].value_size = 2;
+    regmap->areas[REGMAP_INPUT_REGISTERS].value_size = 2;
+
+    return regmap;
+}
+
+void regmap_free(regmap_t *regmap)
+{
+    int i;
+    int j;
+
+    if (regmap == NULL)
+        return;
+
+    for (i = 0; i < REGMAP_NB_TABLES; i++) {
+        for (j = 0; j < REGMAP_NB_PAGES; j++) {
+            g_free(regmap->areas[i].pages[j]);
+        }
+        g_free(regmap->areas[i].ranges);
+    }
+    g_free(regmap);
+}
+
+static int regmap_range_compare(const void *a, const void *b)
+{
+    const regmap_range_t *range_a = a;
+    const regmap_range_t *range_b = b;
+
+    return range_a->start - range_b->start;
+}
+
+/* Add the range to the sorted list and merge the overlapping or contiguous
+   ranges */
+void regmap_ranges_add(regmap_range_t **ranges, int *nb_range, int start, int nb)
+{
+    regmap_range_t *r;
+    int i;
+    int j;
+
+    *ranges = g_renew(regmap_range_t, *ranges, *nb_range + 1);
+    r = *ranges;
+    r[*nb_range].start = start;
+    r[*nb_range].end = start + nb;
+    (*nb_range)++;
+
+    qsort(r, *nb_range, sizeof(regmap_range_t), regmap_range_compare);
+    for (i = 0, j = 1; j < *nb_range; j++) {
+        if (r[j].start <= r[i].end) {
+            r[i].end = MAX(r[i].end, r[j].end);
+        } else {
+            r[++i] = r[j];
+        }
+    }
+    *nb_range = i + 1;
+}
+
+void regmap_add_range(regmap_t *regmap, regmap_table_t table, int start, int nb)
+{
+    regmap_area_t *area = &(regmap->areas[table]);
+
+    regmap_ranges_add(&(area->ranges), &(area->nb_range), start, nb);
+}
+
+/* Parse a list of ranges as '0-399;1000-1099;2000' */
+int regmap_parse_ranges(regmap_t *regmap, regmap_table_t table, const char *ranges)
+{
+    gchar **tokens = g_strsplit_set(ranges, ";,", -1);
+    int rc = 0;
+    int i;
+
+    for (i = 0; tokens[i] != NULL; i++) {
+        gchar *token = g_strstrip(tokens[i]);
+        gchar *end;
+        gint64 start;
+        gint64 last;
+
+        if (*token == '\0')
+            continue;
+
+        start = g_ascii_strtoll(token, &end, 10);
+        last = start;
+        if (end != token && *end == '-') {
+            token = end + 1;
+            last = g_ascii_strtoll(token, &end, 10);
+        }
+
+        if (end == token || *end != '\0' || start < 0 || last < start || last > 65535) {
+            g_warning("Invalid range of addresses '%s'", tokens[i]);
+            rc = -1;
+            break;
+        }
+
+        regmap_add_range(regmap, table, (int)start, (int)(last - start + 1));
+    }
+    g_strfreev(tokens);
+
+    return rc;
+}
+
+gboolean regmap_is_declared(regmap_t *regmap, regmap_table_t table, int addr, int nb)
+{
+    regmap_area_t *area = &(regmap->areas[table]);
+    int low = 0;
+    int high = area->nb_range - 1;
+
+    /* Find the last range starting at or before addr */
+    while (low <= high) {
+        int middle = (low + high) / 2;
+
+        if (area->ranges[middle].start <= addr)
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+
+    return high >= 0 && addr + nb <= area->ranges[high].end;
+}
+
+/* Returns the values of the page from addr and the number of values
+   available in the page */
+static guint8* regmap_page(regmap_t *regmap, regmap_table_t table, int addr, gboolean create, int *nb)
+{
+    regmap_area_t *area = &(regmap->areas[table]);
+    int page = addr / REGMAP_PAGE_SIZE;
+    int offset = addr % REGMAP_PAGE_SIZE;
+
+    *nb = REGMAP_PAGE_SIZE - offset;
+    if (area->pages[page] == NULL) {
+        if (!create)
+            return NULL;
+        area->pages[page] = g_malloc0(REGMAP_PAGE_SIZE * area->value_size);
+        regmap->nb_page++;
+    }
+
+    return (guint8 *)area->pages[page] + offset * area->value_size;
+}
+
+static void regmap_get(regmap_t *regmap, regmap_table_t table, int addr, int nb, void *dest)
+{
+    int value_size = regmap->areas[table].value_size;
+    guint8 *p = dest;
+
+    while (nb > 0) {
+        int nb_page;
+        guint8 *values = regmap_page(regmap, table, addr, FALSE, &nb_page);
+
+        nb_page = MIN(nb_page, nb);
+        if (values == NULL)
+            memset(p, 0, nb_page * value_size);
+        else
+            memcpy(p, values, nb_page * value_size);
+
+        p += nb_page * value_size;
+        addr += nb_page;
+        nb -= nb_page;
+    }
+}
+
+static void regmap_set(regmap_t *regmap, regmap_table_t table, int addr, int nb, const void *src)
+{
+    int value_size = regmap->areas[table].value_size;
+    const guint8 *p = src;
+
+    while (nb > 0) {
+        int nb_page;
+        guint8 *values = regmap_page(regmap, table, addr, TRUE, &nb_page);
+
+        nb_page = MIN(nb_page, nb);
+        memcpy(values, p, nb_page * value_size);
+
+        p += nb_page * value_size;
+        addr += nb_page;
+        nb -= nb_page;
+    }
+}
+
+void regmap_get_registers(regmap_t *regmap, regmap_table_t table, int addr, int nb, uint16_t *dest)
+{
+    regmap_get(regmap, table, addr, nb, dest);
+}
+
+void regmap_set_registers(regmap_t *regmap, regmap_table_t table, int addr, int nb, const uint16_t *src)
+{
+    regmap_set(regmap, table, addr, nb, src);
+}
+
+void regmap_get_bits(regmap_t *regmap, regmap_table_t table, int addr, int nb, uint8_t *dest)
+{
+    regmap_get(regmap, table, addr, nb, dest);
+}
+
+void regmap_set_bits(regmap_t *regmap, regmap_table_t table, int addr, int nb, const uint8_t *src)
+{
+    regmap_set(regmap, table, addr, nb, src);
+}
+
+gboolean regmap_is_write(uint8_t function)
+{
+    switch (function) {
+    case 0x05:
+    case 0x06:
+    case 0x0F:
+    case 0x10:
+    case 0x16:
+    case 0x17:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/* Returns the values of the table in the libmodbus mapping */
+static void* regmap_mapping_values(modbus_mapping_t *mapping, regmap_table_t table)
+{
+    switch (table) {
+    case REGMAP_COILS:
+        return mapping->tab_bits;
+    case REGMAP_DISCRETE_INPUTS:
+        return mapping->tab_input_bits;
+    case REGMAP_HOLDING_REGISTERS:
+        return mapping->tab_registers;
+    default:
+        return mapping->tab_input_registers;
+    }
+}
+
+/* libmodbus mapping of the addresses from start to start + nb of the table
+   with a copy of their values, an empty mapping when nb is 0 */
+static modbus_mapping_t* regmap_mapping_new(regmap_t *regmap, regmap_table_t table, int start, int nb)
+{
+    int starts[REGMAP_NB_TABLES] = {0};
+    int nbs[REGMAP_NB_TABLES] = {0};
+    modbus_mapping_t *mapping;
+
+    starts[table] = start;
+    nbs[table] = nb;
+    mapping = modbus_mapping_new_start_address(
+        starts[REGMAP_COILS], nbs[REGMAP_COILS], starts[REGMAP_DISCRETE_INPUTS], nbs[REGMAP_DISCRETE_INPUTS],
+        starts[REGMAP_HOLDING_REGISTERS], nbs[REGMAP_HOLDING_REGISTERS],
+        starts[REGMAP_INPUT_REGISTERS], nbs[REGMAP_INPUT_REGISTERS]);
+    if (mapping != NULL && nb > 0)
+        regmap_get(regmap, table, start, nb, regmap_mapping_values(mapping, table));
+
+    return mapping;
+}
+
+/* Reply to the request with libmodbus on a temporary mapping of the requested
+   addresses, the values of a write are copied back to the register map (as
+   left by libmodbus when the request is rejected). The caller holds the lock
+   matching regmap_is_write(). The requests on undeclared addresses get an
+   empty mapping so libmodbus replies with an exception, the functions
+   without address (e.g. report slave ID) are handled by libmodbus too.
+   Returns the length of the response or -1 on error. */
+int regmap_reply(regmap_t *regmap, modbus_t *ctx, const uint8_t *req, int req_length)
+{
+    int offset = modbus_get_header_length(ctx);
+    uint8_t function = req[offset];
+    int addr = MODBUS_GET_INT16_FROM_INT8(req, offset + 1);
+    int nb = MODBUS_GET_INT16_FROM_INT8(req, offset + 3);
+    regmap_table_t table = REGMAP_HOLDING_REGISTERS;
+    modbus_mapping_t *mapping;
+    /* Mapped addresses */
+    int start = addr;
+    int end = addr + nb;
+    /* Written addresses */
+    int addr_write = addr;
+    int nb_write = 0;
+    /* Mapped when the number of values is valid and declared */
+    gboolean valid;
+    int rc;
+
+    switch (function) {
+    case 0x01:
+    case 0x02:
+        table = function == 0x01 ? REGMAP_COILS : REGMAP_DISCRETE_INPUTS;
+        valid = nb >= 1 && nb <= MODBUS_MAX_READ_BITS;
+        break;
+    case 0x03:
+    case 0x04:
+        table = function == 0x03 ? REGMAP_HOLDING_REGISTERS : REGMAP_INPUT_REGISTERS;
+        valid = nb >= 1 && nb <= MODBUS_MAX_READ_REGISTERS;
+        break;
+    case 0x05:
+        /* nb is the value, checked by libmodbus */
+        table = REGMAP_COILS;
+        valid = TRUE;
+        end = addr + 1;
+        nb_write = 1;
+        break;
+    case 0x06:
+    case 0x16:
+        end = addr + 1;
+        valid = TRUE;
+        nb_write = 1;
+        break;
+    case 0x0F:
+        table = REGMAP_COILS;
+        valid = nb >= 1 && nb <= MODBUS_MAX_WRITE_BITS;
+        nb_write = nb;
+        break;
+    case 0x10:
+        valid = nb >= 1 && nb <= MODBUS_MAX_WRITE_REGISTERS;
+        nb_write = nb;
+        break;
+    case 0x17:
+        addr_write = MODBUS_GET_INT16_FROM_INT8(req, offset + 5);
+        nb_write = MODBUS_GET_INT16_FROM_INT8(req, offset + 7);
+        valid = nb >= 1 && nb <= MODBUS_MAX_WR_READ_REGISTERS && nb_write >= 1 &&
+            nb_write <= MODBUS_MAX_WR_WRITE_REGISTERS && regmap_is_declared(regmap, table, addr_write, nb_write);
+        /* Both ranges in the same mapping */
+        start = MIN(addr, addr_write);
+        end = MAX(addr + nb, addr_write + nb_write);
+        break;
+    default:
+        valid = FALSE;
+        break;
+    }
+
+    /* The read range of 0x17 is checked here */
+    if (valid)
+        valid = regmap_is_declared(regmap, table, addr, function == 0x17 ? nb : end - addr);
+
+    mapping = regmap_mapping_new(regmap, table, start, valid ? end - start : 0);
+    if (mapping == NULL) {
+        g_warning("modbus_mapping_new_start_address: %s", modbus_strerror(errno));
+        return -1;
+    }
+
+    rc = modbus_reply(ctx, req, req_length, mapping);
+    if (valid && nb_write > 0) {
+        guint8 *values = regmap_mapping_values(mapping, table);
+
+        regmap_set(regmap, table, addr_write, nb_write,
+                   values + (addr_write - start) * regmap->areas[table].value_size);
+    }
+    modbus_mapping_free(mapping);
+
+    return rc;
+}
@@ -0,0 +1,56 @@
+#ifndef _REGMAP_H_
+#define _REGMAP_H_
+
+#include <glib.h>
+#include <inttypes.h>
+#include <modbus.h>
+
+/* Number of values allocated at once */
+#define REGMAP_PAGE_SIZE 256
+#define REGMAP_NB_PAGES (65536 / REGMAP_PAGE_SIZE)
+
+typedef enum {
+    REGMAP_COILS = 0,
+    REGMAP_DISCRETE_INPUTS,
+    REGMAP_HOLDING_REGISTERS,
+    REGMAP_INPUT_REGISTERS,
+    REGMAP_NB_TABLES
+} regmap_table_t;
+
+typedef struct {
+    int start;
+    /* Excluded */
+    int end;
+} regmap_range_t;
+
+typedef struct {
+    /* 1 byte by bit or 2 bytes by register */
+    int value_size;
+    /* Sorted and merged ranges of declared addresses */
+    int nb_range;
+    regmap_range_t *ranges;
+    /* Allocated on first write, NULL pages are read as zeros */
+    void *pages[REGMAP_NB_PAGES];
+} regmap_area_t;
+
+/* Sparse register map of the full address space of each table, only the
+   declared addresses are served */
+typedef struct {
+    regmap_area_t areas[REGMAP_NB_TABLES];
+    int nb_page;
+} regmap_t;
+
+void regmap_ranges_add(regmap_range_t **ranges, int *nb_range, int start, int nb);
+regmap_t* regmap_new(void);
+void regmap_free(regmap_t *regmap);
+void regmap_add_range(regmap_t *regmap, regmap_table_t table, int start, int nb);
+int regmap_parse_ranges(regmap_t *regmap, regmap_table_t table, const char *ranges);
+gboolean regmap_is_declared(regmap_t *regmap, regmap_table_t table, int addr, int nb);
+void regmap_get_registers(regmap_t *regmap, regmap_table_t table, int addr, int nb, uint16_t *dest);
+void regmap_set_registers(regmap_t *regmap, regmap_table_t table, int addr, int nb, const uint16_t *src);
+void regmap_get_bits(regmap_t *regmap, regmap_table_t table, int addr, int nb, uint8_t *dest);
+void regmap_set_bits(regmap_t *regmap, regmap_table_t table, int addr, int nb, const uint8_t *src);
+gboolean regmap_is_write(uint8_t function);
+int regmap_reply(regmap_t *regmap, modbus_t *ctx, const uint8_t *req, int req_length);
+
+#endif /* _REGMAP_H_ */
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "ring.h"
+
+static void ring_futex_wait(uint32_t *addr, uint32_t value, int timeout_ms)
+{
+    struct timespec timeout;
+
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    /* Not private, the futex is shared between processes */
+    syscall(SYS_futex, addr, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void ring_futex_wake(uint32_t *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static int ring_is_alive(int32_t pid)
+{
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+/* Map the header and twice the data. Returns -1 on error. */
+static int ring_map(ring_t *ring, int fd, uint64_t capacity)
+{
+    uint8_t *base;
+
+    ring->map_size = RING_HEADER_SIZE + 2 * capacity;
+    base = mmap(NULL, ring->map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return -1;
+
+    if (mmap(base, RING_HEADER_SIZE + capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + RING_HEADER_SIZE + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+             RING_HEADER_SIZE) == MAP_FAILED) {
+        munmap(base, ring->map_size);
+        return -1;
+    }
+
+    ring->header = (ring_header_t *)base;
+    ring->data = base + RING_HEADER_SIZE;
+    ring->mask = capacity - 1;
+
+    return 0;
+}
+
+static void ring_unmap(ring_t *ring)
+{
+    if (ring->header != NULL) {
+        munmap(ring->header, ring->map_size);
+        ring->header = NULL;
+    }
+}
+
+/* Consumer - Create or reset the ring of 'capacity' bytes (power of two) */
+int ring_create(ring_t *ring, const char *path, uint64_t capacity)
+{
+    int fd;
+    int rc;
+
+    /* A producer still attached to a previous ring keeps its own file until it
+       sees the consumer is gone */
+    unlink(path);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return -1;
+
+    rc = ftruncate(fd, RING_HEADER_SIZE + capacity);
+    if (rc == 0)
+        rc = ring_map(ring, fd, capacity);
+    close(fd);
+    if (rc == -1)
+        return -1;
+
+    memset(ring->header, 0, sizeof(ring_header_t));
+    ring->header->version = RING_VERSION;
+    ring->header->capacity = capacity;
+    ring->header->consumer_pid = getpid();
+    __atomic_store_n(&ring->header->magic, RING_MAGIC, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Consumer */
+void ring_destroy(ring_t *ring, const char *path)
+{
+    if (ring->header == NULL)
+        return;
+
+    __atomic_store_n(&ring->header->consumer_pid, 0, __ATOMIC_RELEASE);
+    ring_unmap(ring);
+    unlink(path);
+}
+
+/* Producer - Returns -1 if the ring doesn't exist, has no consumer or has
+   another producer */
+int ring_attach(ring_t *ring, const char *path)
+{
+    ring_header_t header;
+    struct stat st;
+    int32_t producer_pid;
+    int fd;
+
+    ring->header = NULL;
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &st) == -1 || st.st_size < RING_HEADER_SIZE ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != RING_MAGIC || header.version != RING_VERSION ||
+        (uint64_t)st.st_size != RING_HEADER_SIZE + header.capacity ||
+        !ring_is_alive(header.consumer_pid) ||
+        ring_map(ring, fd, header.capacity) == -1) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    /* Take over the ring of a dead producer */
+    producer_pid = __atomic_load_n(&ring->header->producer_pid, __ATOMIC_ACQUIRE);
+    if ((producer_pid != 0 && ring_is_alive(producer_pid)) ||
+        !__atomic_compare_exchange_n(&ring->header->producer_pid, &producer_pid, getpid(), 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        ring_unmap(ring);
+        return -1;
+    }
+
+    ring->consumer_pid = header.consumer_pid;
+    ring->flags = RING_FLAG_NEW_SESSION;
+
+    return 0;
+}
+
+/* Producer */
+void ring_detach(ring_t *ring)
+{
+    int32_t pid = getpid();
+
+    if (ring->header == NULL)
+        return;
+
+    __atomic_compare_exchange_n(&ring->header->producer_pid, &pid, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    ring_unmap(ring);
+}
+
+/* Producer - Whether the consumer of the attach is still running */
+int ring_has_consumer(ring_t *ring)
+{
+    return __atomic_load_n(&ring->header->consumer_pid, __ATOMIC_ACQUIRE) == ring->consumer_pid &&
+           ring_is_alive(ring->consumer_pid);
+}
+
+/* Producer - Copy the message in the ring. Returns the length written, 0 when
+   the ring is full or -1 if the consumer is gone or the message is too
+   large. */
+long ring_write(ring_t *ring, const void *data, uint32_t length)
+{
+    ring_header_t *header = ring->header;
+    uint64_t total = (RING_MESSAGE_HEADER + length + 7) & ~(uint64_t)7;
+    uint64_t head = header->head;
+    uint8_t *p;
+
+    if (total > ring->mask + 1 ||
+        __atomic_load_n(&header->consumer_pid, __ATOMIC_ACQUIRE) != ring->consumer_pid)
+        return -1;
+
+    if (head + total - __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE) > ring->mask + 1)
+        return ring_has_consumer(ring) ? 0 : -1;
+
+    p = ring->data + (head & ring->mask);
+    memcpy(p, &length, 4);
+    memcpy(p + 4, &ring->flags, 4);
+    memcpy(p + RING_MESSAGE_HEADER, data, length);
+    ring->flags = 0;
+
+    __atomic_store_n(&header->head, head + total, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&header->data_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->consumer_waiting, __ATOMIC_SEQ_CST))
+        ring_futex_wake(&header->data_seq);
+
+    return length;
+}
+
+/* Consumer - Waits up to 'timeout_ms' for a message. Returns 1 with the
+   message in place, to release with ring_release(), or 0 on timeout or early
+   wake up. */
+int ring_read(ring_t *ring, const uint8_t **data, uint32_t *length, uint32_t *flags, int timeout_ms)
+{
+    ring_header_t *header = ring->header;
+    uint64_t tail = header->tail;
+    const uint8_t *p;
+
+    if (__atomic_load_n(&header->head, __ATOMIC_ACQUIRE) == tail) {
+        uint32_t seq = __atomic_load_n(&header->data_seq, __ATOMIC_ACQUIRE);
+
+        __atomic_store_n(&header->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&header->head, __ATOMIC_SEQ_CST) == tail)
+            ring_futex_wait(&header->data_seq, seq, timeout_ms);
+        __atomic_store_n(&header->consumer_waiting, 0, __ATOMIC_RELAXED);
+
+        if (__atomic_load_n(&header->head, __ATOMIC_ACQUIRE) == tail)
+            return 0;
+    }
+
+    p = ring->data + (tail & ring->mask);
+    memcpy(length, p, 4);
+    memcpy(flags, p + 4, 4);
+    *data = p + RING_MESSAGE_HEADER;
+
+    return 1;
+}
+
+/* Consumer - Free the space of the message returned by ring_read() */
+void ring_release(ring_t *ring, uint32_t length)
+{
+    ring_header_t *header = ring->header;
+    uint64_t total = (RING_MESSAGE_HEADER + length + 7) & ~(uint64_t)7;
+
+    __atomic_store_n(&header->tail, header->tail + total, __ATOMIC_RELEASE);
+}
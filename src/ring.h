@@ -0,0 +1,66 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+/* Shared memory ring between a collector (producer) and the recorder
+   (consumer) as an alternative to the Unix socket.
+
+   The file starts with a header of one page followed by the data. The data is
+   mapped twice in a row so a message is always contiguous and the recorder
+   reads it in place. Each message is a block of records (text or binary
+   frames) preceded by its length (uint32) and flags (uint32), padded to 8
+   bytes.
+
+   The producer and the consumer positions are on their own cache lines. The
+   consumer sleeps on a futex incremented by the producer for each message. The
+   producer never waits, the messages are kept by the collector while the ring
+   is full.
+
+   The recorder creates the ring, only one collector is attached at once. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_MAGIC 0x4E52424D
+#define RING_VERSION 1
+#define RING_HEADER_SIZE 4096
+#define RING_CACHE_LINE 64
+#define RING_MESSAGE_HEADER 8
+/* First message of a producer, the protocol and the names are reset */
+#define RING_FLAG_NEW_SESSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    /* Power of two and multiple of the page size */
+    uint64_t capacity;
+    int32_t consumer_pid;
+    /* 0 when no producer is attached */
+    int32_t producer_pid;
+    /* Producer side */
+    uint64_t head __attribute__((aligned(RING_CACHE_LINE)));
+    uint32_t data_seq;
+    uint32_t consumer_waiting;
+    /* Consumer side */
+    uint64_t tail __attribute__((aligned(RING_CACHE_LINE)));
+} ring_header_t;
+
+typedef struct {
+    ring_header_t *header;
+    uint8_t *data;
+    uint64_t mask;
+    size_t map_size;
+    /* Producer - Consumer at attach time and flags of the next message */
+    int32_t consumer_pid;
+    uint32_t flags;
+} ring_t;
+
+int ring_create(ring_t *ring, const char *path, uint64_t capacity);
+void ring_destroy(ring_t *ring, const char *path);
+int ring_attach(ring_t *ring, const char *path);
+void ring_detach(ring_t *ring);
+int ring_has_consumer(ring_t *ring);
+long ring_write(ring_t *ring, const void *data, uint32_t length);
+int ring_read(ring_t *ring, const uint8_t **data, uint32_t *length, uint32_t *flags, int timeout_ms);
+void ring_release(ring_t *ring, uint32_t length);
+
+#endif /* _RING_H_ */
@@ -0,0 +1,108 @@
+#include <glib.h>
+
+#include "sched.h"
+
+sched_t* sched_new(void)
+{
+    sched_t *sched = g_new(sched_t, 1);
+
+    sched->nb = 0;
+    sched->size = 16;
+    sched->items = g_new(sched_item_t, sched->size);
+
+    return sched;
+}
+
+void sched_free(sched_t *sched)
+{
+    if (sched == NULL)
+        return;
+
+    g_free(sched->items);
+    g_free(sched);
+}
+
+static void sched_swap(sched_t *sched, int i, int j)
+{
+    sched_item_t tmp = sched->items[i];
+
+    sched->items[i] = sched->items[j];
+    sched->items[j] = tmp;
+}
+
+static void sched_sift_up(sched_t *sched, int i)
+{
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (sched->items[parent].due <= sched->items[i].due)
+            break;
+        sched_swap(sched, i, parent);
+        i = parent;
+    }
+}
+
+static void sched_sift_down(sched_t *sched, int i)
+{
+    for (;;) {
+        int left = 2 * i + 1;
+        int right = left + 1;
+        int min = i;
+
+        if (left < sched->nb && sched->items[left].due < sched->items[min].due)
+            min = left;
+        if (right < sched->nb && sched->items[right].due < sched->items[min].due)
+            min = right;
+        if (min == i)
+            break;
+        sched_swap(sched, i, min);
+        i = min;
+    }
+}
+
+void sched_add(sched_t *sched, gint64 due, gint64 interval, gpointer data, int index)
+{
+    sched_item_t *item;
+
+    if (sched->nb == sched->size) {
+        sched->size *= 2;
+        sched->items = g_renew(sched_item_t, sched->items, sched->size);
+    }
+
+    item = &(sched->items[sched->nb]);
+    item->due = due;
+    item->interval = interval;
+    item->data = data;
+    item->index = index;
+    sched->nb++;
+    sched_sift_up(sched, sched->nb - 1);
+}
+
+/* Returns the time of the next task or -1 when there is no task */
+gint64 sched_next_due(sched_t *sched)
+{
+    if (sched->nb == 0)
+        return -1;
+
+    return sched->items[0].due;
+}
+
+/* Pops the next task if it's due at 'now' and reschedules it on its next
+   period. The periods missed while late are skipped. */
+gboolean sched_pop_due(sched_t *sched, gint64 now, sched_item_t *item)
+{
+    sched_item_t *top;
+
+    if (sched->nb == 0 || sched->items[0].due > now)
+        return FALSE;
+
+    top = &(sched->items[0]);
+    *item = *top;
+
+    do {
+        top->due += top->interval;
+    } while (top->due <= now);
+    sched_sift_down(sched, 0);
+
+    return TRUE;
+}
@@ -0,0 +1,28 @@
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <glib.h>
+
+/* A periodic task of the scheduler */
+typedef struct {
+    /* Next time to run */
+    gint64 due;
+    gint64 interval;
+    gpointer data;
+    int index;
+} sched_item_t;
+
+/* Min-heap of periodic tasks ordered by due time */
+typedef struct {
+    int nb;
+    int size;
+    sched_item_t *items;
+} sched_t;
+
+sched_t* sched_new(void);
+void sched_free(sched_t *sched);
+void sched_add(sched_t *sched, gint64 due, gint64 interval, gpointer data, int index);
+gint64 sched_next_due(sched_t *sched);
+gboolean sched_pop_due(sched_t *sched, gint64 now, sched_item_t *item);
+
+#endif /* _SCHED_H_ */
@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "spool.h"
+#include "proto.h"
+
+/* Max bytes read at once by the replay, larger than a record */
+#define SPOOL_CHUNK_SIZE (PROTO_HEADER_LENGTH + PROTO_MAX_LENGTH)
+/* Number of segments of a full spool */
+#define SPOOL_NB_SEGMENTS 16
+#define SPOOL_MIN_SEGMENT_SIZE (64 * 1024)
+
+static char* spool_path(spool_t *spool, guint64 seq)
+{
+    return g_strdup_printf("%s/%016" G_GINT64_MODIFIER "x.%s", spool->dir, seq, spool->binary ? "bin" : "txt");
+}
+
+static gint spool_compare_segments(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const spool_segment_t *segment_a = a;
+    const spool_segment_t *segment_b = b;
+
+    if (segment_a->seq == segment_b->seq)
+        return 0;
+    return segment_a->seq < segment_b->seq ? -1 : 1;
+}
+
+/* Remove the oldest segment from the disk */
+static void spool_remove_first(spool_t *spool)
+{
+    spool_segment_t *segment = g_queue_pop_head(spool->segments);
+    char *path;
+
+    if (segment == NULL)
+        return;
+
+    if (spool->read_fd != -1) {
+        close(spool->read_fd);
+        spool->read_fd = -1;
+    }
+    spool->read_offset = 0;
+
+    /* The segment being written */
+    if (g_queue_is_empty(spool->segments) && spool->write_fd != -1) {
+        close(spool->write_fd);
+        spool->write_fd = -1;
+    }
+
+    path = spool_path(spool, segment->seq);
+    if (g_unlink(path) == -1 && errno != ENOENT)
+        g_warning("Unable to remove spool segment %s: %s", path, strerror(errno));
+    g_free(path);
+
+    spool->total_size -= segment->size;
+    g_slice_free(spool_segment_t, segment);
+}
+
+/* The records not replayed of the oldest segment are lost */
+static void spool_drop_first(spool_t *spool)
+{
+    spool_segment_t *segment = g_queue_peek_head(spool->segments);
+
+    if (segment == NULL)
+        return;
+
+    spool->nb_dropped += segment->size - spool->read_offset;
+    spool_remove_first(spool);
+}
+
+/* Keep at least the segment being written */
+static void spool_enforce_bounds(spool_t *spool, gint64 now)
+{
+    spool_segment_t *segment;
+
+    while (g_queue_get_length(spool->segments) > 1 && spool->total_size > spool->max_size)
+        spool_drop_first(spool);
+
+    while (spool->max_age > 0 && g_queue_get_length(spool->segments) > 1) {
+        segment = g_queue_peek_head(spool->segments);
+        if (now - segment->mtime <= spool->max_age)
+            break;
+        spool_drop_first(spool);
+    }
+}
+
+/* Returns NULL if the directory can't be used */
+spool_t* spool_open(const char *dir, gboolean binary, gint64 max_size, gint64 max_age, int rate)
+{
+    spool_t *spool;
+    const char *suffix = binary ? ".bin" : ".txt";
+    const char *name;
+    GDir *gdir;
+
+    if (g_mkdir_with_parents(dir, 0750) == -1) {
+        g_warning("Unable to create spool directory %s: %s", dir, strerror(errno));
+        return NULL;
+    }
+
+    gdir = g_dir_open(dir, 0, NULL);
+    if (gdir == NULL) {
+        g_warning("Unable to open spool directory %s", dir);
+        return NULL;
+    }
+
+    spool = g_new(spool_t, 1);
+    spool->dir = g_strdup(dir);
+    spool->binary = binary;
+    spool->max_size = max_size;
+    spool->segment_size = MAX(max_size / SPOOL_NB_SEGMENTS, SPOOL_MIN_SEGMENT_SIZE);
+    spool->max_age = max_age;
+    spool->rate = rate;
+    spool->segments = g_queue_new();
+    spool->total_size = 0;
+    spool->next_seq = 0;
+    spool->write_fd = -1;
+    spool->read_fd = -1;
+    spool->read_offset = 0;
+    spool->tokens = 0;
+    spool->last_replay = g_get_monotonic_time();
+    spool->buffer = g_malloc(SPOOL_CHUNK_SIZE);
+    spool->nb_spooled = 0;
+    spool->nb_replayed = 0;
+    spool->nb_dropped = 0;
+
+    /* Backlog of a previous run */
+    while ((name = g_dir_read_name(gdir)) != NULL) {
+        spool_segment_t *segment;
+        struct stat st;
+        char *end;
+        char *path;
+        guint64 seq;
+
+        seq = g_ascii_strtoull(name, &end, 16);
+        if (end != name + 16 || strcmp(end, suffix) != 0)
+            continue;
+
+        path = g_build_filename(dir, name, NULL);
+        if (g_stat(path, &st) == 0) {
+            segment = g_slice_new(spool_segment_t);
+            segment->seq = seq;
+            segment->size = st.st_size;
+            segment->mtime = (gint64)st.st_mtime * G_USEC_PER_SEC;
+            g_queue_push_tail(spool->segments, segment);
+            spool->total_size += segment->size;
+            spool->next_seq = MAX(spool->next_seq, seq + 1);
+        }
+        g_free(path);
+    }
+    g_dir_close(gdir);
+
+    g_queue_sort(spool->segments, spool_compare_segments, NULL);
+    spool_enforce_bounds(spool, g_get_real_time());
+
+    return spool;
+}
+
+void spool_close(spool_t *spool)
+{
+    spool_segment_t *segment;
+
+    if (spool == NULL)
+        return;
+
+    if (spool->read_fd != -1)
+        close(spool->read_fd);
+    if (spool->write_fd != -1)
+        close(spool->write_fd);
+
+    while ((segment = g_queue_pop_head(spool->segments)) != NULL)
+        g_slice_free(spool_segment_t, segment);
+    g_queue_free(spool->segments);
+
+    g_free(spool->buffer);
+    g_free(spool->dir);
+    g_free(spool);
+}
+
+gboolean spool_is_empty(spool_t *spool)
+{
+    return g_queue_is_empty(spool->segments);
+}
+
+/* Append the records at the end of the spool, a new segment is started when
+   the current one is full. Returns -1 on error. */
+int spool_append(spool_t *spool, const void *data, gsize length)
+{
+    spool_segment_t *segment = g_queue_peek_tail(spool->segments);
+    gint64 now = g_get_real_time();
+    gsize written = 0;
+
+    if (spool->write_fd != -1 && segment->size >= spool->segment_size) {
+        close(spool->write_fd);
+        spool->write_fd = -1;
+    }
+
+    if (spool->write_fd == -1) {
+        char *path = spool_path(spool, spool->next_seq);
+
+        spool->write_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0640);
+        if (spool->write_fd == -1) {
+            g_warning("Unable to create spool segment %s: %s", path, strerror(errno));
+            g_free(path);
+            return -1;
+        }
+        g_free(path);
+
+        segment = g_slice_new(spool_segment_t);
+        segment->seq = spool->next_seq++;
+        segment->size = 0;
+        segment->mtime = now;
+        g_queue_push_tail(spool->segments, segment);
+    }
+
+    while (written < length) {
+        ssize_t rc = write(spool->write_fd, (const guint8 *)data + written, length - written);
+
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            g_warning("Unable to write spool segment: %s", strerror(errno));
+            /* Don't append after a partial record */
+            close(spool->write_fd);
+            spool->write_fd = -1;
+            break;
+        }
+        written += rc;
+    }
+
+    segment->size += written;
+    segment->mtime = now;
+    spool->total_size += written;
+    spool->nb_spooled += written;
+
+    spool_enforce_bounds(spool, now);
+
+    return written == length ? 0 : -1;
+}
+
+/* Send the oldest records with 'send_func' within the rate, a record is never
+   split. Returns the number of bytes sent or -1 on error of 'send_func'. */
+int spool_replay(spool_t *spool, spool_send_t send_func, gpointer data)
+{
+    gint64 now = g_get_monotonic_time();
+    int replayed = 0;
+
+    /* Bucket of one second of replay */
+    spool->tokens = MIN(spool->tokens + (double)spool->rate * (now - spool->last_replay) / G_USEC_PER_SEC,
+                        spool->rate);
+    spool->last_replay = now;
+
+    while (spool->tokens > 0 && !spool_is_empty(spool)) {
+        spool_segment_t *segment = g_queue_peek_head(spool->segments);
+        gsize wanted = MIN((gsize)spool->tokens, SPOOL_CHUNK_SIZE);
+        ssize_t n;
+        int length;
+
+        if (spool->read_offset >= segment->size) {
+            /* Fully replayed */
+            spool_remove_first(spool);
+            continue;
+        }
+
+        if (spool->read_fd == -1) {
+            char *path = spool_path(spool, segment->seq);
+
+            spool->read_fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (spool->read_fd == -1) {
+                g_warning("Unable to open spool segment %s: %s", path, strerror(errno));
+                g_free(path);
+                spool_drop_first(spool);
+                continue;
+            }
+            g_free(path);
+        }
+
+        n = pread(spool->read_fd, spool->buffer, wanted, spool->read_offset);
+        length = n > 0 ? proto_records_length(spool->buffer, n, spool->binary) : -1;
+        if (length == 0 && (gsize)n == wanted && wanted < SPOOL_CHUNK_SIZE) {
+            /* A record larger than the tokens is sent at once */
+            n = pread(spool->read_fd, spool->buffer, SPOOL_CHUNK_SIZE, spool->read_offset);
+            length = n > 0 ? proto_records_length(spool->buffer, n, spool->binary) : -1;
+        }
+
+        if (length <= 0) {
+            g_warning("Invalid or truncated spool segment %016" G_GINT64_MODIFIER "x", segment->seq);
+            spool_drop_first(spool);
+            continue;
+        }
+
+        if (send_func(data, spool->buffer, length) == -1)
+            return -1;
+
+        spool->read_offset += length;
+        spool->tokens -= length;
+        spool->nb_replayed += length;
+        replayed += length;
+    }
+
+    return replayed;
+}
+
+void spool_report(spool_t *spool)
+{
+    g_print("Spool: %" G_GINT64_FORMAT " bytes in %u segments, %" G_GINT64_FORMAT " spooled, %" G_GINT64_FORMAT
+            " replayed, %" G_GINT64_FORMAT " dropped\n", spool->total_size, g_queue_get_length(spool->segments),
+            spool->nb_spooled, spool->nb_replayed, spool->nb_dropped);
+}
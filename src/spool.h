@@ -0,0 +1,54 @@
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include <glib.h>
+
+/* Append-only segment of the spool, named after its sequence number */
+typedef struct {
+    guint64 seq;
+    gint64 size;
+    /* Time of the last record (us since Epoch) */
+    gint64 mtime;
+} spool_segment_t;
+
+/* Records kept on disk while the recorder is unavailable, then replayed in
+   order at a limited rate. The oldest segments are removed when the spool
+   exceeds its size or age. */
+typedef struct {
+    char *dir;
+    /* Segments of the other protocol are ignored */
+    gboolean binary;
+    gint64 max_size;
+    gint64 segment_size;
+    /* 0 for no limit (us) */
+    gint64 max_age;
+    /* Bytes by second */
+    int rate;
+    /* Oldest first, the last one is written when write_fd is set */
+    GQueue *segments;
+    gint64 total_size;
+    guint64 next_seq;
+    int write_fd;
+    /* Replay of the first segment */
+    int read_fd;
+    gint64 read_offset;
+    double tokens;
+    gint64 last_replay;
+    guint8 *buffer;
+    /* Counters */
+    gint64 nb_spooled;
+    gint64 nb_replayed;
+    gint64 nb_dropped;
+} spool_t;
+
+/* Returns -1 on error */
+typedef int (*spool_send_t)(gpointer data, const guint8 *buffer, gsize length);
+
+spool_t* spool_open(const char *dir, gboolean binary, gint64 max_size, gint64 max_age, int rate);
+void spool_close(spool_t *spool);
+gboolean spool_is_empty(spool_t *spool);
+int spool_append(spool_t *spool, const void *data, gsize length);
+int spool_replay(spool_t *spool, spool_send_t send_func, gpointer data);
+void spool_report(spool_t *spool);
+
+#endif /* _SPOOL_H_ */
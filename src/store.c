@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "proto.h"
+#include "store.h"
+
+/* Blocks written before the end of the commit interval */
+#define STORE_COMMIT_SIZE (1024 * 1024)
+#define STORE_COMMIT_INTERVAL G_USEC_PER_SEC
+/* Blocks by segment (64 MiB) */
+#define STORE_SEGMENT_BLOCKS (64 * 1024)
+
+static guint64 store_key(guint32 name, int addr)
+{
+    return ((guint64)name << 32) | (guint32)addr;
+}
+
+static store_column_t* store_column_new(store_t *store, guint64 key, guint32 point)
+{
+    store_column_t *column = g_new(store_column_t, 1);
+
+    column->key = key;
+    column->point = point;
+    column->type = BLOCK_TYPE_INT;
+    block_encoder_init(&(column->encoder), BLOCK_TYPE_INT);
+    column->opened = 0;
+    g_hash_table_insert(store->columns, &(column->key), column);
+
+    return column;
+}
+
+/* The points of the previous runs keep their number */
+static void store_load_points(store_t *store)
+{
+    char *path = g_build_filename(store->dir, "points", NULL);
+    gchar *contents;
+    gchar **lines;
+    int i;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_free(path);
+        return;
+    }
+    g_free(path);
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i] != NULL; i++) {
+        gchar **fields = g_strsplit(lines[i], "\t", 3);
+
+        if (g_strv_length(fields) == 3) {
+            guint32 point = strtoul(fields[0], NULL, 10);
+            guint32 name = parser_names_intern(store->names, fields[2], strlen(fields[2]));
+
+            store_column_new(store, store_key(name, atoi(fields[1])), point);
+            store->nb_point = MAX(store->nb_point, point + 1);
+        }
+        g_strfreev(fields);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+}
+
+/* The segments of the previous runs are never appended */
+static guint64 store_next_seq(const char *dir)
+{
+    const char *name;
+    guint64 seq = 0;
+    GDir *gdir;
+
+    gdir = g_dir_open(dir, 0, NULL);
+    if (gdir == NULL)
+        return 0;
+
+    while ((name = g_dir_read_name(gdir)) != NULL) {
+        char *end;
+        guint64 value = g_ascii_strtoull(name, &end, 16);
+
+        if (end == name + 16 && strcmp(end, ".blk") == 0)
+            seq = MAX(seq, value + 1);
+    }
+    g_dir_close(gdir);
+
+    return seq;
+}
+
+static int store_open_file(store_t *store, const char *suffix)
+{
+    char *path = g_strdup_printf("%s/%016" G_GINT64_MODIFIER "x.%s", store->dir, store->seq, suffix);
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0640);
+
+    if (fd == -1)
+        g_warning("Unable to create store segment %s: %s", path, strerror(errno));
+    g_free(path);
+
+    return fd;
+}
+
+static void store_write(int fd, const void *data, gsize length)
+{
+    gsize written = 0;
+
+    while (fd != -1 && written < length) {
+        ssize_t rc = write(fd, (const guint8 *)data + written, length - written);
+
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            g_warning("Unable to write the store: %s", strerror(errno));
+            return;
+        }
+        written += rc;
+    }
+}
+
+static int store_compare_entries(const void *a, const void *b)
+{
+    const guint8 *p = a;
+    const guint8 *q = b;
+    guint32 point_a = proto_get_u32(p);
+    guint32 point_b = proto_get_u32(q);
+    gint64 first_a = proto_get_i64(p + 8);
+    gint64 first_b = proto_get_i64(q + 8);
+
+    if (point_a != point_b)
+        return point_a < point_b ? -1 : 1;
+    if (first_a != first_b)
+        return first_a < first_b ? -1 : 1;
+    return 0;
+}
+
+/* Copy of the index of a complete segment sorted by point then by time, so
+   the blocks of a point are found by a binary search */
+static void store_sort_index(store_t *store, guint64 seq, const guint8 *entries, gsize length)
+{
+    char *tmp = g_strdup_printf("%s/%016" G_GINT64_MODIFIER "x.pix.tmp", store->dir, seq);
+    char *path = g_strdup_printf("%s/%016" G_GINT64_MODIFIER "x.pix", store->dir, seq);
+    guint8 *sorted;
+    int fd;
+
+    length -= length % BLOCK_INDEX_LENGTH;
+    sorted = g_malloc(length);
+    memcpy(sorted, entries, length);
+    qsort(sorted, length / BLOCK_INDEX_LENGTH, BLOCK_INDEX_LENGTH, store_compare_entries);
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (fd == -1) {
+        g_warning("Unable to create store index %s: %s", tmp, strerror(errno));
+    } else {
+        store_write(fd, sorted, length);
+        fdatasync(fd);
+        close(fd);
+        if (rename(tmp, path) == -1)
+            g_warning("Unable to rename store index %s: %s", tmp, strerror(errno));
+    }
+
+    g_free(sorted);
+    g_free(path);
+    g_free(tmp);
+}
+
+/* The segments of a previous run stopped before sorting their index */
+static void store_sort_indexes(store_t *store)
+{
+    const char *name;
+    GDir *gdir;
+
+    gdir = g_dir_open(store->dir, 0, NULL);
+    if (gdir == NULL)
+        return;
+
+    while ((name = g_dir_read_name(gdir)) != NULL) {
+        char *end;
+        guint64 seq = g_ascii_strtoull(name, &end, 16);
+        char *path;
+        gchar *contents;
+        gsize length;
+
+        if (end != name + 16 || strcmp(end, ".idx") != 0)
+            continue;
+
+        path = g_strdup_printf("%s/%016" G_GINT64_MODIFIER "x.pix", store->dir, seq);
+        if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+            g_free(path);
+            path = g_build_filename(store->dir, name, NULL);
+            if (g_file_get_contents(path, &contents, &length, NULL)) {
+                store_sort_index(store, seq, (const guint8 *)contents, length);
+                g_free(contents);
+            }
+        }
+        g_free(path);
+    }
+    g_dir_close(gdir);
+}
+
+/* The index of the previous segment is sorted. Returns -1 on error. */
+static int store_open_segment(store_t *store)
+{
+    if (store->data_fd != -1)
+        close(store->data_fd);
+    if (store->index_fd != -1) {
+        close(store->index_fd);
+        store_sort_index(store, store->seq - 1, store->index->data, store->index->len);
+        g_byte_array_set_size(store->index, 0);
+    }
+
+    store->data_fd = store_open_file(store, "blk");
+    store->index_fd = store_open_file(store, "idx");
+    store->nb_block = 0;
+    store->seq++;
+
+    return (store->data_fd == -1 || store->index_fd == -1) ? -1 : 0;
+}
+
+/* The mutex is held */
+static void store_seal(store_t *store, store_column_t *column)
+{
+    if (column->encoder.count == 0)
+        return;
+
+    block_encoder_finish(&(column->encoder), column->point);
+    g_byte_array_append(store->blocks, column->encoder.data, BLOCK_SIZE);
+    block_encoder_init(&(column->encoder), column->encoder.type);
+
+    if (store->blocks->len >= STORE_COMMIT_SIZE)
+        g_cond_signal(&(store->cond));
+}
+
+/* The blocks opened for too long, or all of them, are written even if not
+   full so a crash loses at most 'max_age' of samples */
+static void store_seal_old(store_t *store, gboolean all)
+{
+    gint64 now = g_get_monotonic_time();
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, store->columns);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        store_column_t *column = value;
+
+        if (column->encoder.count > 0 && (all || now - column->opened >= store->max_age))
+            store_seal(store, column);
+    }
+}
+
+/* The new points, the blocks then their index are written at once and
+   synced once */
+static void store_commit(store_t *store, GString *points, GByteArray *blocks)
+{
+    guint nb = blocks->len / BLOCK_SIZE;
+    guint8 *index;
+    guint i;
+
+    if (points->len > 0) {
+        store_write(store->points_fd, points->str, points->len);
+        fdatasync(store->points_fd);
+    }
+
+    if (nb == 0)
+        return;
+
+    if (store->data_fd == -1 || store->index_fd == -1 ||
+        (store->nb_block + nb > STORE_SEGMENT_BLOCKS && store->nb_block > 0)) {
+        if (store_open_segment(store) == -1) {
+            /* Opened again on the next commit */
+            g_warning("No store segment, %u blocks dropped", nb);
+            store->nb_dropped += nb;
+            return;
+        }
+    }
+
+    index = g_malloc(nb * BLOCK_INDEX_LENGTH);
+    for (i = 0; i < nb; i++) {
+        const guint8 *footer = blocks->data + (i + 1) * BLOCK_SIZE - BLOCK_FOOTER_LENGTH;
+        guint8 *p = index + i * BLOCK_INDEX_LENGTH;
+
+        /* Point then the first and last timestamps of the footer */
+        p = proto_put_u32(p, proto_get_u32(footer + 4));
+        p = proto_put_u32(p, store->nb_block + i);
+        memcpy(p, footer + 16, 16);
+    }
+
+    /* The index only refers to synced blocks */
+    store_write(store->data_fd, blocks->data, blocks->len);
+    fdatasync(store->data_fd);
+    store_write(store->index_fd, index, nb * BLOCK_INDEX_LENGTH);
+    fdatasync(store->index_fd);
+    g_byte_array_append(store->index, index, nb * BLOCK_INDEX_LENGTH);
+    g_free(index);
+
+    store->nb_block += nb;
+    store->nb_written += nb;
+    store->nb_commit++;
+}
+
+/* Group commit of the blocks sealed during the interval */
+static gpointer store_thread(gpointer data)
+{
+    store_t *store = data;
+    gboolean stop;
+
+    do {
+        gint64 end_time = g_get_monotonic_time() + STORE_COMMIT_INTERVAL;
+        GByteArray *blocks;
+        GString *points;
+
+        g_mutex_lock(&(store->mutex));
+        while (!store->stop && store->blocks->len < STORE_COMMIT_SIZE) {
+            if (!g_cond_wait_until(&(store->cond), &(store->mutex), end_time))
+                break;
+        }
+        stop = store->stop;
+        store_seal_old(store, stop);
+
+        points = store->points;
+        store->points = g_string_new(NULL);
+        blocks = store->blocks;
+        store->blocks = g_byte_array_new();
+        g_mutex_unlock(&(store->mutex));
+
+        store_commit(store, points, blocks);
+        g_string_free(points, TRUE);
+        g_byte_array_free(blocks, TRUE);
+    } while (!stop);
+
+    return NULL;
+}
+
+/* 'max_age' in seconds. Returns NULL if the directory can't be used. */
+store_t* store_open(const char *dir, parser_names_t *names, int max_age)
+{
+    store_t *store;
+    char *path;
+
+    if (g_mkdir_with_parents(dir, 0750) == -1) {
+        g_warning("Unable to create store directory %s: %s", dir, strerror(errno));
+        return NULL;
+    }
+
+    store = g_new(store_t, 1);
+    store->dir = g_strdup(dir);
+    store->names = names;
+    store->max_age = (gint64)max_age * G_USEC_PER_SEC;
+    g_mutex_init(&(store->mutex));
+    g_cond_init(&(store->cond));
+    store->columns = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+    store->nb_point = 0;
+    store->points = g_string_new(NULL);
+    store->blocks = g_byte_array_new();
+    store->seq = store_next_seq(dir);
+    store->data_fd = -1;
+    store->index_fd = -1;
+    store->index = g_byte_array_new();
+    store->stop = FALSE;
+    store->nb_sample = 0;
+    store->nb_written = 0;
+    store->nb_dropped = 0;
+    store->nb_commit = 0;
+
+    store_load_points(store);
+    store_sort_indexes(store);
+
+    path = g_build_filename(dir, "points", NULL);
+    store->points_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    g_free(path);
+
+    if (store->points_fd == -1 || store_open_segment(store) == -1) {
+        g_warning("Unable to open the store %s", dir);
+        store->thread = NULL;
+        store_close(store);
+        return NULL;
+    }
+
+    store->thread = g_thread_new("store", store_thread, store);
+
+    return store;
+}
+
+/* The blocks not full are written before returning */
+void store_close(store_t *store)
+{
+    if (store == NULL)
+        return;
+
+    if (store->thread != NULL) {
+        g_mutex_lock(&(store->mutex));
+        store->stop = TRUE;
+        g_cond_signal(&(store->cond));
+        g_mutex_unlock(&(store->mutex));
+        g_thread_join(store->thread);
+
+        fprintf(stderr, "Store: %llu samples in %llu blocks of %d bytes, %llu dropped, %llu commits\n",
+                (unsigned long long)store->nb_sample, (unsigned long long)store->nb_written, BLOCK_SIZE,
+                (unsigned long long)store->nb_dropped, (unsigned long long)store->nb_commit);
+    }
+
+    if (store->points_fd != -1)
+        close(store->points_fd);
+    if (store->data_fd != -1)
+        close(store->data_fd);
+    if (store->index_fd != -1) {
+        close(store->index_fd);
+        store_sort_index(store, store->seq - 1, store->index->data, store->index->len);
+    }
+
+    g_hash_table_destroy(store->columns);
+    g_string_free(store->points, TRUE);
+    g_byte_array_free(store->blocks, TRUE);
+    g_byte_array_free(store->index, TRUE);
+    g_cond_clear(&(store->cond));
+    g_mutex_clear(&(store->mutex));
+    g_free(store->dir);
+    g_free(store);
+}
+
+/* Timestamps are stored in ms */
+void store_add(store_t *store, const parser_record_t *record)
+{
+    guint64 key = store_key(record->name, record->addr);
+    guint8 type = (record->type == PARSER_VALUE_INT) ? BLOCK_TYPE_INT : BLOCK_TYPE_FLOAT;
+    gint64 timestamp = record->timestamp / 1000;
+    store_column_t *column;
+
+    g_mutex_lock(&(store->mutex));
+    column = g_hash_table_lookup(store->columns, &key);
+    if (column == NULL) {
+        const char *name = parser_names_get(store->names, record->name);
+
+        column = store_column_new(store, key, store->nb_point++);
+        g_string_append_printf(store->points, "%u\t%d\t%s\n", column->point, record->addr,
+                               name != NULL ? name : "");
+    }
+
+    /* The values of a float point are often integral ("100"), they are
+       stored as floats once the point has received a float so the blocks
+       aren't sealed on each change of type */
+    if (type == BLOCK_TYPE_FLOAT)
+        column->type = BLOCK_TYPE_FLOAT;
+
+    /* A block has only one type */
+    if (column->encoder.type != column->type)
+        store_seal(store, column);
+
+    if (column->encoder.count > 0 && !block_encoder_add(&(column->encoder), timestamp, record->value))
+        store_seal(store, column);
+
+    if (column->encoder.count == 0) {
+        column->encoder.type = column->type;
+        column->opened = g_get_monotonic_time();
+        block_encoder_add(&(column->encoder), timestamp, record->value);
+    }
+    store->nb_sample++;
+    g_mutex_unlock(&(store->mutex));
+}
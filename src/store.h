@@ -0,0 +1,66 @@
+#ifndef _STORE_H_
+#define _STORE_H_
+
+#include <glib.h>
+
+#include "block.h"
+#include "parser.h"
+
+/* Default max time before a block is written even if not full (s) */
+#define STORE_MAX_AGE 300
+
+/* Block being filled for a point (name and address) */
+typedef struct {
+    guint64 key;
+    guint32 point;
+    /* Type of the next blocks, only promoted from int to float */
+    guint8 type;
+    block_encoder_t encoder;
+    /* Time of the first sample of the block (us, monotonic) */
+    gint64 opened;
+} store_column_t;
+
+/* Append-only storage of the samples, one column of compressed blocks by
+   point. The full blocks are written by a thread at once (group commit) in
+   segment files with an index of their time ranges:
+     points: '<point>\t<address>\t<name>' by line
+     <seq>.blk: blocks of BLOCK_SIZE bytes
+     <seq>.idx: point (uint32), block (uint32), first and last timestamps
+       (int64) of each block
+     <seq>.pix: same entries sorted by point then by time, written once the
+       segment is complete */
+typedef struct {
+    char *dir;
+    parser_names_t *names;
+    /* Max time before a block is written even if not full (us) */
+    gint64 max_age;
+    GMutex mutex;
+    GCond cond;
+    /* Columns by key (name id and address) */
+    GHashTable *columns;
+    guint32 nb_point;
+    /* Waiting for the next commit */
+    GString *points;
+    GByteArray *blocks;
+    /* Segment being written */
+    guint64 seq;
+    int points_fd;
+    int data_fd;
+    int index_fd;
+    guint32 nb_block;
+    /* Index of the segment, only used by the thread */
+    GByteArray *index;
+    GThread *thread;
+    gboolean stop;
+    /* Counters */
+    guint64 nb_sample;
+    guint64 nb_written;
+    guint64 nb_dropped;
+    guint64 nb_commit;
+} store_t;
+
+store_t* store_open(const char *dir, parser_names_t *names, int max_age);
+void store_close(store_t *store);
+void store_add(store_t *store, const parser_record_t *record);
+
+#endif /* _STORE_H_ */
@@ -11,10 +11,10 @@ class CommonMSTestCase(unittest.TestCase):
 
     def setUp(self):
         self.expected_values = [
-            {'a': 0, 'l': 2, 'type': 'floatmsb', 'values': ['12345.599609']},
-            {'a': 2, 'l': 2, 'type': 'floatlsb', 'values': ['789.000000']},
+            {'a': 0, 'l': 2, 'type': 'floatmsb', 'values': ['12345.6']},
+            {'a': 2, 'l': 2, 'type': 'floatlsb', 'values': ['789']},
             {'a': 0, 'l': 4, 'type': 'floatmsb', 'values': [
-                '12345.599609', '0.000000']},
+                '12345.6', '0']},
             {'a': 4, 'l': 1, 'type': 'int', 'values': ['1']},
             {'a': 4, 'l': 3, 'type': 'int', 'values': ['1', '2', '3']},
         ]
@@ -161,5 +161,14 @@ class ServerTestCase(SlaveTestCase):
         self.uts = Popen(["./unit-test-client", "tcp"], stdout=PIPE, stderr=PIPE)
 
 
+class BlockTestCase(unittest.TestCase):
+    """Round trip of the compressed blocks of the store, no device needed"""
+
+    def test_round_trip(self):
+        ut = Popen(["./unit-test-block"], stdout=PIPE)
+        output = ut.communicate()[0]
+        self.assertEqual(ut.returncode, 0, output)
+
+
 if __name__ == '__main__':
     unittest.main()
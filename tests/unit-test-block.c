@@ -0,0 +1,231 @@
+/*
+ * Round trip of the compressed blocks of the recorder store (src/block.c):
+ * varints, delta-of-delta timestamps and XOR floats.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <stdint.h>
+
+#include "block.h"
+
+#define MAX_SAMPLES 4096
+#define POINT 42
+
+static int nb_fail = 0;
+
+#define CHECK(cond, ...) do {                   \
+    if (!(cond)) {                              \
+        printf("FAILED %s:%d ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__);                    \
+        printf("\n");                           \
+        nb_fail++;                              \
+    }                                           \
+} while (0)
+
+/* Encode the samples in one block then decode them back. Returns the number
+   of samples accepted by the block. */
+static int round_trip(const char *name, uint8_t type, const int64_t *timestamps, const double *values, int nb)
+{
+    block_encoder_t encoder;
+    block_decoder_t decoder;
+    int64_t timestamp;
+    double value;
+    double min;
+    double max;
+    int count = 0;
+    int rc;
+    int i;
+
+    block_encoder_init(&encoder, type);
+    while (count < nb && block_encoder_add(&encoder, timestamps[count], values[count]))
+        count++;
+    block_encoder_finish(&encoder, POINT);
+
+    CHECK(block_decoder_init(&decoder, encoder.data) == 0, "%s: invalid footer", name);
+    CHECK(decoder.point == POINT, "%s: point %u", name, decoder.point);
+    CHECK(decoder.count == (uint32_t)count, "%s: count %u instead of %d", name, decoder.count, count);
+    CHECK(decoder.type == type, "%s: type %d", name, decoder.type);
+    if (count > 0) {
+        CHECK(decoder.first == timestamps[0], "%s: first %lld", name, (long long)decoder.first);
+        CHECK(decoder.last == timestamps[count - 1], "%s: last %lld", name, (long long)decoder.last);
+    }
+
+    min = max = values[0];
+    for (i = 0; i < count; i++) {
+        rc = block_decoder_next(&decoder, &timestamp, &value);
+        CHECK(rc == 1, "%s: sample %d not decoded (%d)", name, i, rc);
+        if (rc != 1)
+            return count;
+
+        CHECK(timestamp == timestamps[i], "%s: sample %d timestamp %lld instead of %lld", name, i,
+              (long long)timestamp, (long long)timestamps[i]);
+        /* Bit exact, also for NaN and -0 */
+        if (type == BLOCK_TYPE_FLOAT)
+            CHECK(memcmp(&value, &values[i], sizeof(double)) == 0, "%s: sample %d value %.17g instead of %.17g",
+                  name, i, value, values[i]);
+        else
+            CHECK(value == values[i], "%s: sample %d value %.17g instead of %.17g", name, i, value, values[i]);
+
+        if (values[i] < min)
+            min = values[i];
+        if (values[i] > max)
+            max = values[i];
+    }
+    CHECK(block_decoder_next(&decoder, &timestamp, &value) == 0, "%s: sample after the end", name);
+
+    if (count > 0) {
+        CHECK(decoder.min == min || (isnan(decoder.min) && isnan(min)), "%s: min %g", name, decoder.min);
+        CHECK(decoder.max == max || (isnan(decoder.max) && isnan(max)), "%s: max %g", name, decoder.max);
+    }
+
+    return count;
+}
+
+/* Timestamps whose deltas change by each 'dods' in turn */
+static void make_timestamps(int64_t *timestamps, int nb, const int64_t *dods, int nb_dod)
+{
+    int64_t delta = 1000;
+    int i;
+
+    timestamps[0] = 1700000000000LL;
+    for (i = 1; i < nb; i++) {
+        if (i > 1)
+            delta += dods[(i - 2) % nb_dod];
+        timestamps[i] = timestamps[i - 1] + delta;
+    }
+}
+
+static void test_timestamps(void)
+{
+    /* Both ends of each bucket (7, 9 and 12 bits) and the 64-bit escape */
+    static const int64_t dods[] = {
+        0, -64, 63, 64, -65, -256, 255, 256, -257, -2048, 2047, 2048, -2049,
+        (int64_t)1 << 40, -((int64_t)1 << 40), 0, 1, -1
+    };
+    int nb_dod = sizeof(dods) / sizeof(dods[0]);
+    int64_t timestamps[64];
+    double values[64];
+    int nb = nb_dod + 2;
+    int i;
+
+    make_timestamps(timestamps, nb, dods, nb_dod);
+    for (i = 0; i < nb; i++)
+        values[i] = i;
+
+    CHECK(round_trip("timestamps", BLOCK_TYPE_INT, timestamps, values, nb) == nb, "timestamps: block full");
+
+    /* Negative and huge first delta (varint) */
+    timestamps[0] = 0;
+    timestamps[1] = -((int64_t)1 << 50);
+    timestamps[2] = (int64_t)1 << 50;
+    CHECK(round_trip("first delta", BLOCK_TYPE_INT, timestamps, values, 3) == 3, "first delta: block full");
+}
+
+static void test_integers(void)
+{
+    static const double edges[] = {
+        0, 1, -1, 0, 65535, 0, 65535, 32767, -32768, 2147483647.0, -2147483648.0, 4294967295.0,
+        9007199254740992.0, -9007199254740992.0, 0, 127, 128, -64, -65, 8191, 8192
+    };
+    int nb = sizeof(edges) / sizeof(edges[0]);
+    int64_t timestamps[64];
+    int64_t dod = 0;
+
+    make_timestamps(timestamps, nb, &dod, 1);
+    CHECK(round_trip("integers", BLOCK_TYPE_INT, timestamps, edges, nb) == nb, "integers: block full");
+}
+
+static void test_floats(void)
+{
+    double values[64];
+    int64_t timestamps[64];
+    int64_t dod = 0;
+    int nb = 0;
+    int i;
+
+    values[nb++] = 0.0;
+    values[nb++] = -0.0;
+    values[nb++] = NAN;
+    values[nb++] = INFINITY;
+    values[nb++] = -INFINITY;
+    values[nb++] = DBL_MIN;
+    values[nb++] = DBL_MAX;
+    values[nb++] = 5e-324;
+    values[nb++] = 12345.6f;
+    /* Same value */
+    values[nb++] = 12345.6f;
+    /* Small changes reuse the window of the previous XOR */
+    for (i = 0; i < 16; i++)
+        values[nb++] = 230.0f + i * 0.25f;
+    /* Then a wider XOR */
+    values[nb++] = -1e300;
+    values[nb++] = 1.0;
+
+    make_timestamps(timestamps, nb, &dod, 1);
+    CHECK(round_trip("floats", BLOCK_TYPE_FLOAT, timestamps, values, nb) == nb, "floats: block full");
+}
+
+/* Fill the block up to its end with the worst and the usual samples */
+static void test_full_block(void)
+{
+    static const int64_t dods[] = {(int64_t)1 << 40, -((int64_t)1 << 40)};
+    static int64_t timestamps[MAX_SAMPLES];
+    static double values[MAX_SAMPLES];
+    int64_t dod = 0;
+    int count;
+    int i;
+
+    /* Random doubles and 64-bit escapes */
+    srand(1);
+    for (i = 0; i < MAX_SAMPLES; i++)
+        values[i] = ((double)rand() / RAND_MAX - 0.5) * pow(10, rand() % 40 - 20);
+    make_timestamps(timestamps, MAX_SAMPLES, dods, 2);
+    count = round_trip("full floats", BLOCK_TYPE_FLOAT, timestamps, values, MAX_SAMPLES);
+    CHECK(count > 0 && count < MAX_SAMPLES, "full floats: %d samples", count);
+
+    /* Large integer steps */
+    for (i = 0; i < MAX_SAMPLES; i++)
+        values[i] = (i % 2) ? 9007199254740992.0 : -9007199254740992.0;
+    count = round_trip("full integers", BLOCK_TYPE_INT, timestamps, values, MAX_SAMPLES);
+    CHECK(count > 0 && count < MAX_SAMPLES, "full integers: %d samples", count);
+
+    /* Regular samples, many by block */
+    for (i = 0; i < MAX_SAMPLES; i++)
+        values[i] = i / 3;
+    make_timestamps(timestamps, MAX_SAMPLES, &dod, 1);
+    count = round_trip("full regular", BLOCK_TYPE_INT, timestamps, values, MAX_SAMPLES);
+    CHECK(count > 500, "full regular: only %d samples", count);
+}
+
+static void test_invalid(void)
+{
+    block_encoder_t encoder;
+    block_decoder_t decoder;
+
+    block_encoder_init(&encoder, BLOCK_TYPE_INT);
+    block_encoder_add(&encoder, 1000, 1);
+    block_encoder_finish(&encoder, POINT);
+    encoder.data[BLOCK_SIZE - BLOCK_FOOTER_LENGTH] ^= 0xFF;
+    CHECK(block_decoder_init(&decoder, encoder.data) == -1, "invalid magic accepted");
+}
+
+int main(void)
+{
+    test_timestamps();
+    test_integers();
+    test_floats();
+    test_full_block();
+    test_invalid();
+
+    if (nb_fail > 0) {
+        printf("%d checks FAILED\n", nb_fail);
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}
@@ -35,7 +35,9 @@ int main(int argc, char *argv[])
     uint16_t *tab_reg;
     int rc;
     int use_backend;
+    int status = -1;
     const uint16_t values[] = {5678, 9012};
+    const uint16_t values_page[] = {1, 2, 3, 4};
 
     if (argc > 1) {
         if (strcmp(argv[1], "tcp") == 0) {
@@ -76,7 +78,7 @@ int main(int argc, char *argv[])
     }
 
     /* Allocate and initialize the memory to store the registers */
-    tab_reg = (uint16_t *) malloc(10 * sizeof(uint16_t));
+    tab_reg = (uint16_t *) malloc(MODBUS_MAX_READ_REGISTERS * sizeof(uint16_t));
 
     /* Single register */
     printf("1/2 modbus_write_register");
@@ -104,11 +106,107 @@ int main(int argc, char *argv[])
 
     printf("2/2 modbus_read_registers");
     rc = modbus_read_registers(ctx, 1, 2, tab_reg);
-    if (rc != 2) {
+    if (rc != 2 || tab_reg[0] != 5678 || tab_reg[1] != 9012) {
+        goto close;
+    }
+
+    /* Registers 255 and 256 are stored in two pages of the register map */
+    printf("1/2 modbus_write_registers across a page");
+    rc = modbus_write_registers(ctx, 254, 4, values_page);
+    if (rc != 4) {
+        goto close;
+    }
+
+    printf("2/2 modbus_read_registers across a page");
+    rc = modbus_read_registers(ctx, 254, 4, tab_reg);
+    if (rc != 4 || memcmp(tab_reg, values_page, sizeof(values_page)) != 0) {
+        goto close;
+    }
+
+    /* 0x16, (3 & 0x00F2) | (0x0025 & ~0x00F2) */
+    printf("1/2 modbus_mask_write_register");
+    rc = modbus_mask_write_register(ctx, 256, 0x00F2, 0x0025);
+    if (rc != 1) {
+        goto close;
+    }
+
+    printf("2/2 modbus_read_registers");
+    rc = modbus_read_registers(ctx, 256, 1, tab_reg);
+    if (rc != 1 || tab_reg[0] != 0x0007) {
+        goto close;
+    }
+
+    /* 0x17, the write is done before the read */
+    printf("1/1 modbus_write_and_read_registers across a page");
+    rc = modbus_write_and_read_registers(ctx, 255, 2, values, 253, 6, tab_reg);
+    if (rc != 6 || tab_reg[1] != 1 || tab_reg[2] != 5678 || tab_reg[3] != 9012 || tab_reg[4] != 4) {
+        goto close;
+    }
+
+    /* Merged ranges 0-199, 200-299 and 250-399 */
+    printf("1/1 modbus_read_registers across merged ranges");
+    rc = modbus_read_registers(ctx, 190, 120, tab_reg);
+    if (rc != 120) {
+        goto close;
+    }
+
+    printf("1/1 modbus_read_registers at the end of a range");
+    rc = modbus_read_registers(ctx, 1020, 10, tab_reg);
+    if (rc != 10) {
         goto close;
     }
 
+    /* Undeclared addresses */
+    printf("1/6 modbus_read_registers between two ranges");
+    rc = modbus_read_registers(ctx, 500, 1, tab_reg);
+    if (rc != -1 || errno != EMBXILADD) {
+        goto close;
+    }
+
+    printf("2/6 modbus_read_registers after the end of a range");
+    rc = modbus_read_registers(ctx, 395, 10, tab_reg);
+    if (rc != -1 || errno != EMBXILADD) {
+        goto close;
+    }
+
+    printf("3/6 modbus_read_registers after the last range");
+    rc = modbus_read_registers(ctx, 1020, 11, tab_reg);
+    if (rc != -1 || errno != EMBXILADD) {
+        goto close;
+    }
+
+    printf("4/6 modbus_write_register between two ranges");
+    rc = modbus_write_register(ctx, 400, 1);
+    if (rc != -1 || errno != EMBXILADD) {
+        goto close;
+    }
+
+    printf("5/6 modbus_write_registers before a range");
+    rc = modbus_write_registers(ctx, 1018, 4, values_page);
+    if (rc != -1 || errno != EMBXILADD) {
+        goto close;
+    }
+
+    printf("6/6 modbus_write_and_read_registers between two ranges");
+    rc = modbus_write_and_read_registers(ctx, 999, 2, values, 254, 4, tab_reg);
+    if (rc != -1 || errno != EMBXILADD) {
+        goto close;
+    }
+
+    /* Nothing written by the rejected requests */
+    printf("1/1 modbus_read_registers");
+    rc = modbus_read_registers(ctx, 254, 4, tab_reg);
+    if (rc != 4 || tab_reg[0] != 1 || tab_reg[1] != 5678 || tab_reg[2] != 9012 || tab_reg[3] != 4) {
+        goto close;
+    }
+
+    status = 0;
+
 close:
+    if (status == -1) {
+        printf("FAILED\n");
+    }
+
     /* Free the memory */
     free(tab_reg);
 
@@ -116,5 +214,5 @@ close:
     modbus_close(ctx);
     modbus_free(ctx);
 
-    return 0;
+    return status;
 }